@@ -0,0 +1,133 @@
+#include <acl.h>
+
+/* Plain binary trie the prefixes are first inserted into; it only lives while the poptrie is being built. */
+class acl_builder {
+    struct bit_node {
+        int32_t                                             child[2];
+        uint8_t                                             action;
+    };
+
+public:
+    inline acl_builder(int width_)
+        : width_(width_) {
+        new_node();
+    }
+
+public:
+    inline void                                             insert(const uint8_t* key_, int prefix_, int action_) {
+        int32_t node_ = 0;
+        for (int i = 0; i < prefix_ && i < width_; i++) {
+            int bit_ = (key_[i >> 3] >> (7 - (i & 7))) & 1;
+            if (nodes_[node_].child[bit_] < 0) {
+                int32_t child_ = new_node();
+                nodes_[node_].child[bit_] = child_;
+            }
+            node_ = nodes_[node_].child[bit_];
+        }
+        nodes_[node_].action = (uint8_t)action_;
+    }
+    template<typename TFamily, typename TNode>
+    inline void                                             build(TFamily& family_, uint32_t leaf_flag_, int direct_bits_, int stride_) {
+        family_.direct.resize((size_t)1 << direct_bits_);
+        for (uint32_t i = 0, l = (uint32_t)family_.direct.size(); i < l; i++) {
+            uint8_t action_ = nodes_[0].action;
+            int32_t node_ = descend(0, i, direct_bits_, action_);
+            if (node_ < 0 || !has_children(node_)) {
+                family_.direct[i] = leaf_flag_ | action_;
+                continue;
+            }
+            uint32_t index_ = (uint32_t)family_.nodes.size();
+            family_.nodes.resize(index_ + 1);
+            build_node<TFamily, TNode>(family_, index_, node_, action_, stride_);
+            family_.direct[i] = index_;
+        }
+    }
+
+private:
+    inline int32_t                                          new_node() {
+        bit_node node_;
+        node_.child[0] = -1;
+        node_.child[1] = -1;
+        node_.action = acl_table::ACL_NONE;
+        nodes_.push_back(node_);
+        return (int32_t)nodes_.size() - 1;
+    }
+    inline bool                                             has_children(int32_t node_) {
+        return nodes_[node_].child[0] >= 0 || nodes_[node_].child[1] >= 0;
+    }
+    /* Follows count bits of path below node, picking up the action of every prefix passed on the way; -1 once the
+     * trie ends, the inherited action then covers the rest of the path. */
+    inline int32_t                                          descend(int32_t node_, uint32_t path_, int count_, uint8_t& action_) {
+        for (int i = count_ - 1; i >= 0 && node_ >= 0; i--) {
+            node_ = nodes_[node_].child[(path_ >> i) & 1];
+            if (node_ >= 0 && nodes_[node_].action != acl_table::ACL_NONE) {
+                action_ = nodes_[node_].action;
+            }
+        }
+        return node_;
+    }
+    /* Children of a node are stored contiguously, so they are all reserved before any of them is filled in. */
+    template<typename TFamily, typename TNode>
+    inline void                                             build_node(TFamily& family_, uint32_t index_, int32_t node_, uint8_t inherited_, int stride_) {
+        int slots_ = 1 << stride_;
+        std::vector<int32_t> children_;
+        std::vector<uint8_t> actions_;
+
+        TNode pop_;
+        pop_.vector = 0;
+        pop_.leafvec = 0;
+        pop_.base0 = (uint32_t)family_.leaves.size();
+
+        int last_leaf_ = -1;
+        for (int i = 0; i < slots_; i++) {
+            uint8_t action_ = inherited_;
+            int32_t child_ = descend(node_, (uint32_t)i, stride_, action_);
+            if (child_ >= 0 && has_children(child_)) {
+                pop_.vector |= 1ULL << i;
+                children_.push_back(child_);
+                actions_.push_back(action_);
+            }
+            else if (last_leaf_ < 0 || action_ != last_leaf_) {
+                pop_.leafvec |= 1ULL << i;
+                family_.leaves.push_back(action_);
+                last_leaf_ = action_;
+            }
+        }
+
+        pop_.base1 = (uint32_t)family_.nodes.size();
+        family_.nodes.resize(family_.nodes.size() + children_.size());
+        family_.nodes[index_] = pop_;
+        for (size_t i = 0, l = children_.size(); i < l; i++) {
+            build_node<TFamily, TNode>(family_, pop_.base1 + (uint32_t)i, children_[i], actions_[i], stride_);
+        }
+    }
+
+private:
+    int                                                     width_;
+    std::vector<bit_node>                                   nodes_;
+};
+
+std::shared_ptr<acl_table> acl_table::compile(const std::vector<acl_entry>& entries_) {
+    std::shared_ptr<acl_table> table_ = make_shared_object<acl_table>();
+    table_->has_allow_ = false;
+    table_->prefixes_ = entries_.size();
+
+    acl_builder v4_(32);
+    acl_builder v6_(128);
+    for (size_t i = 0, l = entries_.size(); i < l; i++) {
+        const acl_entry& entry_ = entries_[i];
+        int action_ = entry_.allow ? ACL_ALLOW : ACL_DENY;
+        if (entry_.allow) {
+            table_->has_allow_ = true;
+        }
+        if (entry_.address.bv6) {
+            v6_.insert(entry_.address.in6, entry_.prefix, action_);
+        }
+        else {
+            v4_.insert((const uint8_t*)&entry_.address.in4, entry_.prefix, action_);
+        }
+    }
+    v4_.build<acl_family, acl_node>(table_->v4_, ACL_LEAF, ACL_DIRECT_BITS, ACL_STRIDE);
+    v6_.build<acl_family, acl_node>(table_->v6_, ACL_LEAF, ACL_DIRECT_BITS, ACL_STRIDE);
+    return table_;
+}
@@ -0,0 +1,108 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdafx.h>
+#include <config.h>
+
+#ifdef _WIN32
+#include <intrin.h>
+#endif
+
+/* Allow/deny list of one rule compiled into a poptrie: the first 16 bits of the address index a direct table, the rest
+ * is walked 6 bits at a time through nodes holding two 64-bit maps, one for the slots that continue into a child node
+ * and one for the slots where a run of equal leaves starts; a popcount of either map gives the position among the
+ * node's children or leaves. A lookup costs the direct entry plus at most 3 nodes for ipv4 and 19 for ipv6, however
+ * many prefixes were compiled; runs of equal leaves are stored once, so a node takes 24 bytes plus its distinct
+ * leaves. The table is immutable once built and read by every worker without locks. */
+class acl_table {
+    struct acl_node {
+        uint64_t                                            vector;         /* slot continues into a child node */
+        uint64_t                                            leafvec;        /* slot starts a new run of leaves */
+        uint32_t                                            base0;          /* first leaf */
+        uint32_t                                            base1;          /* first child node */
+    };
+    struct acl_family {
+        std::vector<uint32_t>                               direct;         /* ACL_LEAF | action, or a node index */
+        std::vector<acl_node>                               nodes;
+        std::vector<uint8_t>                                leaves;
+    };
+
+public:
+    static int const ACL_NONE                               = 0;
+    static int const ACL_ALLOW                              = 1;
+    static int const ACL_DENY                               = 2;
+    static int const ACL_DIRECT_BITS                        = 16;
+    static int const ACL_STRIDE                             = 6;
+    static uint32_t const ACL_LEAF                          = 0x80000000;
+
+public:
+    /* The longest matching prefix decides; an address matching none is let in unless the list allows anything. */
+    inline bool                                             permit(const boost::asio::ip::address& address_) {
+        uint8_t key_[16 + 3] = { 0 };
+        int action_;
+        if (address_.is_v6() && !address_.to_v6().is_v4_mapped()) {
+            boost::asio::ip::address_v6::bytes_type bytes_ = address_.to_v6().to_bytes();
+            memcpy(key_, bytes_.data(), bytes_.size());
+            action_ = lookup(v6_, key_);
+        }
+        else {
+            boost::asio::ip::address_v4::bytes_type bytes_ = address_.is_v6() ?
+                address_.to_v6().to_v4().to_bytes() : address_.to_v4().to_bytes();
+            memcpy(key_, bytes_.data(), bytes_.size());
+            action_ = lookup(v4_, key_);
+        }
+        if (action_ == ACL_NONE) {
+            return !has_allow_;
+        }
+        return action_ == ACL_ALLOW;
+    }
+    inline size_t                                           prefixes() {
+        return prefixes_;
+    }
+    inline size_t                                           memory() {
+        return family_memory(v4_) + family_memory(v6_);
+    }
+
+public:
+    /* Later entries override earlier ones for the same prefix, so rule entries listed after the global ones win. */
+    static std::shared_ptr<acl_table>                       compile(const std::vector<acl_entry>& entries_);
+
+private:
+    inline static uint32_t                                  bits(const uint8_t* key_, int offset_, int count_) {
+        uint32_t word_ = ((uint32_t)key_[offset_ >> 3] << 16) | ((uint32_t)key_[(offset_ >> 3) + 1] << 8) | key_[(offset_ >> 3) + 2];
+        return (word_ >> (24 - (offset_ & 7) - count_)) & ((1u << count_) - 1);
+    }
+    inline static int                                       popcount(uint64_t value_) {
+        #ifdef _WIN32
+        return (int)__popcnt64(value_);
+        #else
+        return __builtin_popcountll(value_);
+        #endif
+    }
+    inline static int                                       lookup(const acl_family& family_, const uint8_t* key_) {
+        uint32_t direct_ = family_.direct[bits(key_, 0, ACL_DIRECT_BITS)];
+        if (direct_ & ACL_LEAF) {
+            return (int)(direct_ & ~ACL_LEAF);
+        }
+        const acl_node* node_ = &family_.nodes[direct_];
+        for (int offset_ = ACL_DIRECT_BITS; ; offset_ += ACL_STRIDE) {
+            uint64_t bit_ = 1ULL << bits(key_, offset_, ACL_STRIDE);
+            uint64_t mask_ = (bit_ << 1) - 1;
+            if (node_->vector & bit_) {
+                node_ = &family_.nodes[node_->base1 + popcount(node_->vector & mask_) - 1];
+                continue;
+            }
+            return family_.leaves[node_->base0 + popcount(node_->leafvec & mask_) - 1];
+        }
+    }
+    inline static size_t                                    family_memory(const acl_family& family_) {
+        return family_.direct.size() * sizeof(uint32_t) + family_.nodes.size() * sizeof(acl_node) + family_.leaves.size();
+    }
+
+private:
+    acl_family                                              v4_;
+    acl_family                                              v6_;
+    bool                                                    has_allow_;
+    size_t                                                  prefixes_;
+};
+typedef std::shared_ptr<acl_table>                          acl_table_ptr;
@@ -0,0 +1,788 @@
+#pragma once
+
+#include <stdafx.h>
+#include <config.h>
+#include <worker.hpp>
+#include <sockmap.h>
+#include <tcp_forward.hpp>
+#include <udp_forward.hpp>
+#include <memory_budget.hpp>
+
+#ifndef _WIN32
+#include <sys/stat.h>
+#include <dirent.h>
+
+/* Resolved when rinetd is linked against jemalloc, NULL with any other allocator. */
+extern "C" int mallctl(const char* name, void* oldp, size_t* oldlenp, void* newp, size_t newlen) __attribute__((weak));
+
+/* Line based control socket: every request is answered with zero or more lines and a terminating ".".
+ * Connection state is only ever touched on its own worker, a listing walks each forward with a cursor and yields
+ * the worker after RINETD_ADMIN_BATCH entries, so enumerating a huge table never stalls the relay. */
+class admin_server : public std::enable_shared_from_this<admin_server> {
+public:
+    typedef std::vector<std::shared_ptr<tcp_forward> >      tcp_forward_list;
+    typedef std::vector<std::shared_ptr<udp_forward> >      udp_forward_list;
+
+private:
+    /* Produces the next chunk of output on the worker owning the data, called again while it returns true; called
+     * once with cancel set when the client goes away mid-walk so cursors are unlinked on the right thread. */
+    typedef std::function<bool(std::string& out_, bool cancel_)> admin_step_handler;
+    typedef struct {
+        boost::asio::io_context*                            context;
+        admin_step_handler                                  next;
+    } admin_step;
+    typedef struct {
+        uint64_t                                            accepted;
+        uint64_t                                            rejected;
+        uint64_t                                            connections;
+        uint64_t                                            tunnels;
+        uint64_t                                            tunnel_bytes;
+        uint64_t                                            evictions;
+        uint64_t                                            drops;
+        uint64_t                                            send_errors;
+        uint64_t                                            receive_errors;
+    } admin_totals;
+    /* One worker's heavy hitter table as copied out on that worker. */
+    typedef struct {
+        std::vector<heavy_hitters::entry>                   entries;
+        uint64_t                                            floor;
+    } admin_top_table;
+    typedef struct {
+        std::vector<admin_top_table>                        bytes;
+        std::vector<admin_top_table>                        connections;
+        std::vector<top_talkers::backend_load>              backends;
+    } admin_top;
+
+    class client_filter {
+    public:
+        inline client_filter()
+            : any_(true)
+            , port_(0) {
+
+        }
+
+    public:
+        inline bool                                         parse(const std::string& str) {
+            std::string host_ = str;
+            size_t sz_ = str.rfind(':');
+            if (str.size() > 0 && str[0] == '[') {
+                size_t end_ = str.find(']');
+                if (end_ == std::string::npos) {
+                    return false;
+                }
+                host_ = str.substr(1, end_ - 1);
+                sz_ = end_ + 1 < str.size() && str[end_ + 1] == ':' ? end_ + 1 : std::string::npos;
+            }
+            else if (sz_ != std::string::npos && str.find(':') != sz_) {
+                sz_ = std::string::npos;
+            }
+            else if (sz_ != std::string::npos) {
+                host_ = str.substr(0, sz_);
+            }
+            if (sz_ != std::string::npos) {
+                port_ = (uint16_t)atoi(str.data() + sz_ + 1);
+            }
+
+            boost::system::error_code ec;
+            address_ = unmapped(boost::asio::ip::make_address(host_, ec));
+            any_ = false;
+            return !ec;
+        }
+        template<class TProtocol>
+        inline bool                                         match(const boost::asio::ip::basic_endpoint<TProtocol>& ep) const {
+            if (any_) {
+                return true;
+            }
+            return unmapped(ep.address()) == address_ && (port_ == 0 || port_ == ep.port());
+        }
+
+    private:
+        inline static boost::asio::ip::address              unmapped(const boost::asio::ip::address& address_) {
+            if (address_.is_v6() && address_.to_v6().is_v4_mapped()) {
+                return boost::asio::ip::make_address_v4(boost::asio::ip::v4_mapped, address_.to_v6());
+            }
+            return address_;
+        }
+
+    private:
+        bool                                                any_;
+        boost::asio::ip::address                            address_;
+        uint16_t                                            port_;
+    };
+
+    class admin_session : public std::enable_shared_from_this<admin_session> {
+        friend class admin_server;
+
+    public:
+        inline admin_session(const std::shared_ptr<admin_server>& server_)
+            : enable_shared_from_this()
+            , server_(server_)
+            , context_(server_->context_)
+            , socket_(context_) {
+
+        }
+
+    public:
+        inline void                                         run() {
+            std::shared_ptr<admin_session> self = shared_from_this();
+            boost::asio::async_read_until(socket_, request_, '\n',
+                [self, this](const boost::system::error_code& ec, std::size_t sz) {
+                    if (ec) {
+                        abort();
+                        return;
+                    }
+
+                    std::string line_;
+                    std::istream stream_(&request_);
+                    std::getline(stream_, line_);
+                    line_ = RTrim(LTrim(line_));
+                    if (line_ == "quit") {
+                        abort();
+                        return;
+                    }
+
+                    std::string out_;
+                    if (!server_->execute(line_, steps_, out_)) {
+                        steps_.clear();
+                    }
+                    write(make_shared_object<std::string>(out_));
+                });
+        }
+        inline void                                         abort() {
+            boost::system::error_code ec;
+            socket_.close(ec);
+            if (!steps_.empty()) {
+                admin_step step_ = steps_.front();
+                boost::asio::post(*step_.context, [step_] {
+                    std::string out_;
+                    step_.next(out_, true);
+                });
+            }
+            steps_.clear();
+        }
+
+    private:
+        inline void                                         next_step() {
+            if (steps_.empty()) {
+                write(make_shared_object<std::string>(".\n"), true);
+                return;
+            }
+
+            std::shared_ptr<admin_session> self = shared_from_this();
+            boost::asio::post(*steps_.front().context, [self, this] {
+                std::shared_ptr<std::string> out_ = make_shared_object<std::string>();
+                bool more_ = steps_.front().next(*out_, false);
+                boost::asio::post(context_, [self, this, out_, more_] {
+                    if (!more_) {
+                        steps_.pop_front();
+                    }
+                    write(out_);
+                });
+            });
+        }
+        inline void                                         write(const std::shared_ptr<std::string>& out_, bool completed_ = false) {
+            if (!socket_.is_open()) {
+                abort();
+                return;
+            }
+
+            std::shared_ptr<admin_session> self = shared_from_this();
+            boost::asio::async_write(socket_, boost::asio::buffer(out_->data(), out_->size()),
+                [self, this, out_, completed_](const boost::system::error_code& ec, std::size_t sz) {
+                    if (ec) {
+                        abort();
+                    }
+                    else if (completed_) {
+                        run();
+                    }
+                    else {
+                        next_step();
+                    }
+                });
+        }
+
+    private:
+        std::shared_ptr<admin_server>                       server_;
+        boost::asio::io_context&                            context_;
+        boost::asio::local::stream_protocol::socket         socket_;
+        boost::asio::streambuf                              request_;
+        std::deque<admin_step>                              steps_;
+    };
+
+public:
+    inline admin_server(rinetd_worker& worker_, tcp_forward_list& tcp_forwards_, udp_forward_list& udp_forwards_)
+        : enable_shared_from_this()
+        , worker_(worker_)
+        , context_(worker_.context())
+        , config_(worker_.config())
+        , tcp_forwards_(tcp_forwards_)
+        , udp_forwards_(udp_forwards_)
+        , server_(context_) {
+
+    }
+
+public:
+    inline bool                                             run(const std::string& path_) {
+        try {
+            unlink(path_.data());
+            server_.open(boost::asio::local::stream_protocol());
+            server_.bind(boost::asio::local::stream_protocol::endpoint(path_));
+            chmod(path_.data(), S_IRUSR | S_IWUSR);
+            server_.listen();
+
+            accept_socket();
+            return true;
+        }
+        catch (std::exception&) {
+            return false;
+        }
+    }
+
+private:
+    inline void                                             accept_socket() {
+        if (!server_.is_open()) {
+            return;
+        }
+        std::shared_ptr<admin_server> self = shared_from_this();
+        std::shared_ptr<admin_session> session_ = make_shared_object<admin_session>(self);
+        server_.async_accept(session_->socket_, [self, this, session_](const boost::system::error_code& ec) {
+            if (ec == boost::asio::error::operation_aborted) {
+                return;
+            }
+            if (!ec) {
+                session_->run();
+            }
+            accept_socket();
+        });
+    }
+    inline bool                                             execute(const std::string& line_, std::deque<admin_step>& steps_, std::string& out_) {
+        std::vector<std::string> args_;
+        Tokenize(line_, args_, " \t");
+        std::string command_ = args_.empty() ? std::string() : args_[0];
+        if (command_ == "help") {
+            out_ = "rules                 rules, backends and per worker state\n"
+                "conns [rule]          active connections and udp tunnels\n"
+                "kill <ip[:port]>      close every connection and tunnel of a client\n"
+                "drain <rule>          stop accepting on a rule, existing sessions continue\n"
+                "stats                 process wide counters\n"
+                "top [rule] [count]    heaviest client prefixes by bytes and connections, load per backend\n"
+                "quit\n";
+        }
+        else if (command_ == "rules") {
+            std::vector<listen_port>& list_ = config_.listen_ports;
+            for (size_t i = 0, l = list_.size(); i < l; i++) {
+                admin_step step_;
+                step_.context = &context_;
+                step_.next = [this, i](std::string& out_, bool cancel_) {
+                    if (!cancel_) {
+                        out_ += describe_rule(i);
+                    }
+                    return false;
+                };
+                steps_.push_back(step_);
+                add_forward_steps(steps_, (int)i, [](std::string& out_, const std::shared_ptr<tcp_forward>& forward_) {
+                    out_ += "    worker " + std::to_string(forward_->worker().index()) +
+                        " connections " + std::to_string(forward_->connections().size()) +
+                        " accepted " + std::to_string(forward_->accepted()) +
+                        " rejected " + std::to_string(forward_->rejected()) +
+                        " limited " + std::to_string(forward_->limited()) +
+                        " denied " + std::to_string(forward_->denied()) +
+                        (forward_->draining() ? " draining\n" : "\n");
+                }, [](std::string& out_, const std::shared_ptr<udp_forward>& forward_) {
+                    out_ += "    worker " + std::to_string(forward_->worker().index()) +
+                        " tunnels " + std::to_string(forward_->tunnels().size()) +
+                        " bytes " + std::to_string(forward_->tunnel_bytes()) +
+                        " evicted " + std::to_string(forward_->evictions()) +
+                        " dropped " + std::to_string(forward_->drops()) +
+                        " errors " + std::to_string(forward_->send_errors()) +
+                        " receive_errors " + std::to_string(forward_->receive_errors()) +
+                        " limited " + std::to_string(forward_->limited()) +
+                        " denied " + std::to_string(forward_->denied()) +
+                        (forward_->rule().quic ? " migrated " + std::to_string(forward_->migrations()) + 
+                            " refused " + std::to_string(forward_->migrations_refused()) : "") +
+                        (forward_->draining() ? " draining\n" : "\n");
+                });
+            }
+        }
+        else if (command_ == "conns" || command_ == "kill") {
+            int rule_ = -1;
+            client_filter filter_;
+            bool kill_ = command_ == "kill";
+            if (kill_) {
+                if (args_.size() != 2 || !filter_.parse(args_[1])) {
+                    out_ = "error: usage kill <ip[:port]>\n";
+                    return false;
+                }
+            }
+            else if (args_.size() > 1 && !parse_rule(args_[1], rule_)) {
+                out_ = "error: no such rule\n";
+                return false;
+            }
+            add_walk_steps(steps_, rule_, filter_, kill_);
+        }
+        else if (command_ == "drain") {
+            int rule_ = -1;
+            if (args_.size() != 2 || !parse_rule(args_[1], rule_)) {
+                out_ = "error: usage drain <rule>\n";
+                return false;
+            }
+            add_forward_steps(steps_, rule_, [rule_](std::string& out_, const std::shared_ptr<tcp_forward>& forward_) {
+                forward_->drain();
+                out_ += "rule " + std::to_string(rule_) + " worker " + std::to_string(forward_->worker().index()) + " draining\n";
+            }, [rule_](std::string& out_, const std::shared_ptr<udp_forward>& forward_) {
+                forward_->drain();
+                out_ += "rule " + std::to_string(rule_) + " worker " + std::to_string(forward_->worker().index()) + " draining\n";
+            });
+        }
+        else if (command_ == "stats") {
+            std::shared_ptr<admin_totals> totals_ = make_shared_object<admin_totals>();
+            memset(totals_.get(), 0, sizeof(admin_totals));
+            add_forward_steps(steps_, -1, [totals_](std::string& out_, const std::shared_ptr<tcp_forward>& forward_) {
+                totals_->accepted += forward_->accepted();
+                totals_->rejected += forward_->rejected();
+                totals_->connections += forward_->connections().size();
+            }, [totals_](std::string& out_, const std::shared_ptr<udp_forward>& forward_) {
+                totals_->tunnels += forward_->tunnels().size();
+                totals_->tunnel_bytes += forward_->tunnel_bytes();
+                totals_->evictions += forward_->evictions();
+                totals_->drops += forward_->drops();
+                totals_->send_errors += forward_->send_errors();
+                totals_->receive_errors += forward_->receive_errors();
+            });
+
+            admin_step step_;
+            step_.context = &context_;
+            step_.next = [this, totals_](std::string& out_, bool cancel_) {
+                if (cancel_) {
+                    return false;
+                }
+                /* Rules and workers share backend_state objects, count each backend once. */
+                uint64_t up_ = 0;
+                uint64_t down_ = 0;
+                uint64_t now = GetTickCount(false);
+                std::unordered_set<backend_state*> counted_;
+                for (size_t i = 0, l = config_.listen_ports.size(); i < l; i++) {
+                    backend_state_list* backends_ = rule_backends(config_.listen_ports[i]);
+                    for (size_t n = 0, c = backends_ ? backends_->size() : 0; n < c; n++) {
+                        backend_state_ptr& backend_ = (*backends_)[n];
+                        if (!counted_.insert(backend_.get()).second) {
+                            continue;
+                        }
+                        if (backend_->is_up(now)) {
+                            up_++;
+                        }
+                        else {
+                            down_++;
+                        }
+                    }
+                }
+                out_ += "workers " + std::to_string(config_.workers) + "\n" +
+                    "tcp.connections " + std::to_string(totals_->connections) + "\n" +
+                    "tcp.accepted " + std::to_string(totals_->accepted) + "\n" +
+                    "tcp.rejected " + std::to_string(totals_->rejected) + "\n" +
+                    "tcp.sockmap " + (sockmap_available() ? "on\n" : "off\n") +
+                    "udp.tunnels " + std::to_string(totals_->tunnels) + "\n" +
+                    "udp.tunnel_bytes " + std::to_string(totals_->tunnel_bytes) + "\n" +
+                    "udp.evicted " + std::to_string(totals_->evictions) + "\n" +
+                    "udp.dropped " + std::to_string(totals_->drops) + "\n" +
+                    "udp.send_errors " + std::to_string(totals_->send_errors) + "\n" +
+                    "udp.receive_errors " + std::to_string(totals_->receive_errors) + "\n" +
+                    "backends.up " + std::to_string(up_) + "\n" +
+                    "backends.down " + std::to_string(down_) + "\n" +
+                    "memory.used " + std::to_string(memory_budget::used()) + "\n" +
+                    "memory.budget " + std::to_string(memory_budget::budget()) + "\n" +
+                    "memory.pressure " + (memory_budget::pressure() ? "on\n" : "off\n") +
+                    "objects.tcp_connection " + std::to_string(tcp_forward::connection_count()) + "\n" +
+                    "objects.tcp_connection_cached " + std::to_string(tcp_forward::connection_cached()) + "\n" +
+                    "objects.udp_tunnel " + std::to_string(udp_forward::tunnel_count()) + "\n" +
+                    "objects.udp_tunnel_cached " + std::to_string(udp_forward::tunnel_cached()) + "\n" +
+                    "objects.handler_heap " + std::to_string(handler_memory_heap().load(std::memory_order_relaxed)) + "\n" +
+                    "process.pid " + std::to_string(getpid()) + "\n" +
+                    "process.fds " + std::to_string(process_fds()) + "\n" +
+                    "process.rss " + std::to_string(process_rss()) + "\n";
+                uint64_t allocated_ = 0;
+                uint64_t resident_ = 0;
+                if (allocator_stats(allocated_, resident_)) {
+                    out_ += "allocator.allocated " + std::to_string(allocated_) + "\n" +
+                        "allocator.resident " + std::to_string(resident_) + "\n";
+                }
+                return false;
+            };
+            steps_.push_back(step_);
+        }
+        else if (command_ == "top") {
+            int rule_ = -1;
+            size_t count_ = RINETD_TOP_LISTED;
+            if (args_.size() > 3 || (args_.size() > 1 && !parse_rule(args_[1], rule_))) {
+                out_ = "error: usage top [rule] [count]\n";
+                return false;
+            }
+            if (args_.size() > 2) {
+                count_ = strtoul(args_[2].data(), NULL, 10);
+            }
+            if (config_.top_talkers < 1) {
+                out_ = "error: top_talkers is off\n";
+                return false;
+            }
+
+            std::shared_ptr<std::vector<admin_top> > tops_ = make_shared_object<std::vector<admin_top> >(config_.listen_ports.size());
+            add_forward_steps(steps_, rule_, [this, tops_](std::string& out_, const std::shared_ptr<tcp_forward>& forward_) {
+                collect_top((*tops_)[rule_index(forward_->rule())], forward_->top());
+            }, [this, tops_](std::string& out_, const std::shared_ptr<udp_forward>& forward_) {
+                collect_top((*tops_)[rule_index(forward_->rule())], forward_->top());
+            });
+
+            admin_step step_;
+            step_.context = &context_;
+            step_.next = [this, tops_, rule_, count_](std::string& out_, bool cancel_) {
+                if (cancel_) {
+                    return false;
+                }
+                for (size_t i = 0, l = tops_->size(); i < l; i++) {
+                    admin_top& top_ = (*tops_)[i];
+                    backend_state_list* backends_ = rule_backends(config_.listen_ports[i]);
+                    if ((rule_ >= 0 && (size_t)rule_ != i) || !backends_) {
+                        continue;
+                    }
+                    listen_port& rule_port_ = config_.listen_ports[i];
+                    out_ += "rule " + std::to_string(i) + (rule_port_.tcp_or_udp ? " tcp " : " udp ") +
+                        to_address(rule_port_.local_host, rule_port_.local_port) + 
+                        " half-life " + std::to_string(RINETD_TOP_HALF_LIFE / 1000) + "s\n";
+                    describe_top(out_, "bytes", top_.bytes, count_);
+                    describe_top(out_, "connections", top_.connections, count_);
+                    for (size_t n = 0, c = std::min(backends_->size(), top_.backends.size()); n < c; n++) {
+                        backend_state_ptr& backend_ = (*backends_)[n];
+                        out_ += "    backend " + to_address(backend_->host(), backend_->port()) +
+                            " bytes " + std::to_string(top_.backends[n].bytes) +
+                            " connections " + std::to_string(top_.backends[n].connections) + "\n";
+                    }
+                }
+                return false;
+            };
+            steps_.push_back(step_);
+        }
+        else {
+            out_ = "error: unknown command, try help\n";
+            return false;
+        }
+        return true;
+    }
+    /* Runs on the forward's worker, the tables are only ever touched there. */
+    inline static void                                      collect_top(admin_top& top_, top_talkers& talkers_) {
+        uint64_t now = GetTickCount(false);
+        admin_top_table bytes_;
+        bytes_.entries = talkers_.bytes(now).entries();
+        bytes_.floor = talkers_.bytes(now).floor();
+        top_.bytes.push_back(std::move(bytes_));
+
+        admin_top_table connections_;
+        connections_.entries = talkers_.connections(now).entries();
+        connections_.floor = talkers_.connections(now).floor();
+        top_.connections.push_back(std::move(connections_));
+
+        const std::vector<top_talkers::backend_load>& loads_ = talkers_.backend_loads(now);
+        if (top_.backends.size() < loads_.size()) {
+            top_talkers::backend_load load_ = { 0, 0 };
+            top_.backends.resize(loads_.size(), load_);
+        }
+        for (size_t i = 0, l = loads_.size(); i < l; i++) {
+            top_.backends[i].bytes += loads_[i].bytes;
+            top_.backends[i].connections += loads_[i].connections;
+        }
+    }
+    /* Merges the workers' tables: a worker that does not list a key may still have seen up to its floor of it, that
+     * much is added to both the key's count and its error, so count - error <= true weight <= count still holds. */
+    inline void                                             describe_top(std::string& out_, const char* name_, std::vector<admin_top_table>& tables_, size_t count_) {
+        typedef struct {
+            top_key                                         key;
+            uint64_t                                        count;
+            uint64_t                                        error;
+            uint64_t                                        floor;
+        } merged_entry;
+        typedef std::map<std::pair<uint64_t, uint64_t>, merged_entry> merged_map;
+
+        merged_map merged_;
+        uint64_t floor_ = 0;
+        for (size_t i = 0, l = tables_.size(); i < l; i++) {
+            admin_top_table& table_ = tables_[i];
+            floor_ += table_.floor;
+            for (size_t n = 0, c = table_.entries.size(); n < c; n++) {
+                const heavy_hitters::entry& entry_ = table_.entries[n];
+                merged_entry& merged_entry_ = merged_[std::make_pair(entry_.key.hi, entry_.key.lo)];
+                merged_entry_.key = entry_.key;
+                merged_entry_.count += entry_.count;
+                merged_entry_.error += entry_.error;
+                merged_entry_.floor += table_.floor;
+            }
+        }
+
+        std::vector<merged_entry> list_;
+        list_.reserve(merged_.size());
+        for (merged_map::iterator it = merged_.begin(); it != merged_.end(); it++) {
+            merged_entry& merged_entry_ = it->second;
+            merged_entry_.count += floor_ - merged_entry_.floor;
+            merged_entry_.error += floor_ - merged_entry_.floor;
+            if (merged_entry_.count > 0) {
+                list_.push_back(merged_entry_);
+            }
+        }
+        std::sort(list_.begin(), list_.end(), [](const merged_entry& x, const merged_entry& y) {
+            return x.count > y.count;
+        });
+        for (size_t i = 0, l = std::min(count_, list_.size()); i < l; i++) {
+            out_ += std::string("    ") + name_ + " " + top_talkers::to_string(list_[i].key, config_) +
+                " " + std::to_string(list_[i].count) + " error " + std::to_string(list_[i].error) + "\n";
+        }
+    }
+    inline void                                             add_forward_steps(
+        std::deque<admin_step>&                             steps_,
+        int                                                 rule_,
+        const std::function<void(std::string&, const std::shared_ptr<tcp_forward>&)>& tcp_,
+        const std::function<void(std::string&, const std::shared_ptr<udp_forward>&)>& udp_) {
+        for (size_t i = 0, l = tcp_forwards_.size(); i < l; i++) {
+            std::shared_ptr<tcp_forward> forward_ = tcp_forwards_[i];
+            if (rule_ < 0 || rule_index(forward_->rule()) == rule_) {
+                admin_step step_;
+                step_.context = &forward_->context();
+                step_.next = [forward_, tcp_](std::string& out_, bool cancel_) {
+                    if (!cancel_) {
+                        tcp_(out_, forward_);
+                    }
+                    return false;
+                };
+                steps_.push_back(step_);
+            }
+        }
+        for (size_t i = 0, l = udp_forwards_.size(); i < l; i++) {
+            std::shared_ptr<udp_forward> forward_ = udp_forwards_[i];
+            if (rule_ < 0 || rule_index(forward_->rule()) == rule_) {
+                admin_step step_;
+                step_.context = &forward_->context();
+                step_.next = [forward_, udp_](std::string& out_, bool cancel_) {
+                    if (!cancel_) {
+                        udp_(out_, forward_);
+                    }
+                    return false;
+                };
+                steps_.push_back(step_);
+            }
+        }
+    }
+    inline void                                             add_walk_steps(std::deque<admin_step>& steps_, int rule_, const client_filter& filter_, bool kill_) {
+        for (size_t i = 0, l = tcp_forwards_.size(); i < l; i++) {
+            std::shared_ptr<tcp_forward> forward_ = tcp_forwards_[i];
+            if (rule_ >= 0 && rule_index(forward_->rule()) != rule_) {
+                continue;
+            }
+
+            std::shared_ptr<linked_list_node> cursor_ = make_shared_object<linked_list_node>();
+            std::shared_ptr<bool> started_ = make_shared_object<bool>(false);
+            std::string rule_text_ = "tcp " + to_address(forward_->rule().local_host, forward_->rule().local_port);
+
+            admin_step step_;
+            step_.context = &forward_->context();
+            step_.next = [forward_, cursor_, started_, filter_, kill_, rule_text_](std::string& out_, bool cancel_) {
+                linked_list<tcp_forward::tcp_connection>& list_ = forward_->connections();
+                if (cancel_) {
+                    list_.cursor_end(*cursor_);
+                    return false;
+                }
+                if (!*started_) {
+                    list_.cursor_begin(*cursor_);
+                    *started_ = true;
+                }
+
+                uint64_t now = GetTickCount(false);
+                for (int n = 0; n < RINETD_ADMIN_BATCH; n++) {
+                    tcp_forward::tcp_connection* connection_ = list_.cursor_next(*cursor_);
+                    if (!connection_) {
+                        list_.cursor_end(*cursor_);
+                        return false;
+                    }
+                    if (!filter_.match(connection_->client())) {
+                        continue;
+                    }
+                    out_ += describe_session(kill_, rule_text_, connection_->client(), connection_->backend(),
+                        connection_->bytes_up(), connection_->bytes_down(), now - connection_->created(), connection_->spliced());
+                    if (kill_) {
+                        connection_->abort(RINETD_REASON_KILLED, 0);
+                    }
+                }
+                return true;
+            };
+            steps_.push_back(step_);
+        }
+        for (size_t i = 0, l = udp_forwards_.size(); i < l; i++) {
+            std::shared_ptr<udp_forward> forward_ = udp_forwards_[i];
+            if (rule_ >= 0 && rule_index(forward_->rule()) != rule_) {
+                continue;
+            }
+
+            /* Tunnels touched between two batches move behind the cursor and may be listed twice or not at all. */
+            std::shared_ptr<linked_list_node> cursor_ = make_shared_object<linked_list_node>();
+            std::shared_ptr<bool> started_ = make_shared_object<bool>(false);
+            std::string rule_text_ = "udp " + to_address(forward_->rule().local_host, forward_->rule().local_port);
+
+            admin_step step_;
+            step_.context = &forward_->context();
+            step_.next = [forward_, cursor_, started_, filter_, kill_, rule_text_](std::string& out_, bool cancel_) {
+                linked_list<udp_forward::udp_tunnel>& list_ = forward_->tunnels();
+                if (cancel_) {
+                    list_.cursor_end(*cursor_);
+                    return false;
+                }
+                if (!*started_) {
+                    list_.cursor_begin(*cursor_);
+                    *started_ = true;
+                }
+
+                uint64_t now = GetTickCount(false);
+                for (int n = 0; n < RINETD_ADMIN_BATCH; n++) {
+                    udp_forward::udp_tunnel* tunnel_ = list_.cursor_next(*cursor_);
+                    if (!tunnel_) {
+                        list_.cursor_end(*cursor_);
+                        return false;
+                    }
+                    if (!filter_.match(tunnel_->client())) {
+                        continue;
+                    }
+                    out_ += describe_session(kill_, rule_text_, tunnel_->client(), tunnel_->backend(),
+                        tunnel_->bytes_up(), tunnel_->bytes_down(), now - tunnel_->created(), false);
+                    if (kill_) {
+                        forward_->release_tunnel(tunnel_, RINETD_REASON_KILLED);
+                    }
+                }
+                return true;
+            };
+            steps_.push_back(step_);
+        }
+    }
+    template<class TProtocol>
+    inline static std::string                               describe_session(
+        bool                                                kill_,
+        const std::string&                                  rule_text_,
+        const boost::asio::ip::basic_endpoint<TProtocol>&   client_,
+        const backend_state_ptr&                            backend_,
+        uint64_t                                            bytes_up_,
+        uint64_t                                            bytes_down_,
+        uint64_t                                            age_,
+        bool                                                spliced_) {
+        std::string sb = kill_ ? "killed " : "";
+        sb += rule_text_ + " client " + to_address(client_) + " backend ";
+        sb += backend_ ? to_address(backend_->host(), backend_->port()) : std::string("-");
+        sb += " up " + std::to_string(bytes_up_) + " down " + std::to_string(bytes_down_);
+        sb += " age " + std::to_string(age_ / 1000) + "s";
+        sb += spliced_ ? " sockmap\n" : "\n";
+        return sb;
+    }
+    inline std::string                                      describe_rule(size_t index_) {
+        listen_port& rule_ = config_.listen_ports[index_];
+        std::string sb = "rule " + std::to_string(index_) + (rule_.tcp_or_udp ? " tcp " : " udp ") +
+            to_address(rule_.local_host, rule_.local_port) + " ->";
+
+        backend_state_list* backends_ = rule_backends(rule_);
+        if (!backends_) {
+            return sb + " not listening\n";
+        }
+
+        uint64_t now = GetTickCount(false);
+        for (size_t i = 0, l = backends_->size(); i < l; i++) {
+            backend_state_ptr& backend_ = (*backends_)[i];
+            sb += (i ? "," : " ") + to_address(backend_->host(), backend_->port()) + (backend_->is_up(now) ? "(up)" : "(down)");
+        }
+        if (rule_.balance == RINETD_BALANCE_SOURCE) {
+            sb += " balance source";
+        }
+        if (rule_.mptcp) {
+            sb += rule_.mptcp == RINETD_MPTCP_CLIENT ? " mptcp client" : rule_.mptcp == RINETD_MPTCP_BACKEND ? " mptcp backend" : " mptcp both";
+        }
+        if (rule_.quic && !rule_.tcp_or_udp) {
+            sb += " quic";
+        }
+        return sb + "\n";
+    }
+    inline backend_state_list*                              rule_backends(listen_port& rule_) {
+        /* Every forward of a rule holds the same list, which never changes after startup. */
+        for (size_t i = 0, l = tcp_forwards_.size(); i < l; i++) {
+            if (&tcp_forwards_[i]->rule() == &rule_) {
+                return &tcp_forwards_[i]->backends();
+            }
+        }
+        for (size_t i = 0, l = udp_forwards_.size(); i < l; i++) {
+            if (&udp_forwards_[i]->rule() == &rule_) {
+                return &udp_forwards_[i]->backends();
+            }
+        }
+        return NULL;
+    }
+    inline bool                                             parse_rule(const std::string& str, int& rule_) {
+        char* end_ = NULL;
+        long index_ = strtol(str.data(), &end_, 10);
+        if (end_ == str.data() || *end_ != '\0' || index_ < 0 || (size_t)index_ >= config_.listen_ports.size()) {
+            return false;
+        }
+        rule_ = (int)index_;
+        return true;
+    }
+    inline int                                              rule_index(listen_port& rule_) {
+        return (int)(&rule_ - config_.listen_ports.data());
+    }
+    /* Open descriptors, for spotting sockets that outlive their session; the directory handle itself is not counted. */
+    inline static int64_t                                   process_fds() {
+        DIR* dir_ = opendir("/proc/self/fd");
+        if (!dir_) {
+            return -1;
+        }
+        int64_t count_ = 0;
+        for (struct dirent* entry_ = readdir(dir_); entry_; entry_ = readdir(dir_)) {
+            if (entry_->d_name[0] != '.') {
+                count_++;
+            }
+        }
+        closedir(dir_);
+        return count_ - 1;
+    }
+    inline static int64_t                                   process_rss() {
+        FILE* file_ = fopen("/proc/self/statm", "r");
+        if (!file_) {
+            return -1;
+        }
+        unsigned long size_ = 0;
+        unsigned long resident_ = 0;
+        int count_ = fscanf(file_, "%lu %lu", &size_, &resident_);
+        fclose(file_);
+        return count_ == 2 ? (int64_t)resident_ * sysconf(_SC_PAGESIZE) : -1;
+    }
+    /* Bytes the application holds and bytes the allocator keeps resident, refreshed by advancing jemalloc's epoch. */
+    inline static bool                                      allocator_stats(uint64_t& allocated_, uint64_t& resident_) {
+        if (!mallctl) {
+            return false;
+        }
+        uint64_t epoch_ = 1;
+        size_t sz_ = sizeof(epoch_);
+        mallctl("epoch", &epoch_, &sz_, &epoch_, sz_);
+
+        size_t allocated_bytes_ = 0;
+        size_t resident_bytes_ = 0;
+        sz_ = sizeof(size_t);
+        if (mallctl("stats.allocated", &allocated_bytes_, &sz_, NULL, 0) != 0) {
+            return false;
+        }
+        sz_ = sizeof(size_t);
+        if (mallctl("stats.resident", &resident_bytes_, &sz_, NULL, 0) != 0) {
+            return false;
+        }
+        allocated_ = allocated_bytes_;
+        resident_ = resident_bytes_;
+        return true;
+    }
+
+private:
+    rinetd_worker&                                          worker_;
+    boost::asio::io_context&                                context_;
+    rinetd_config&                                          config_;
+    tcp_forward_list&                                       tcp_forwards_;
+    udp_forward_list&                                       udp_forwards_;
+    boost::asio::local::stream_protocol::acceptor           server_;
+};
+#endif
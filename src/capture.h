@@ -0,0 +1,42 @@
+#pragma once
+
+/* Framing of the traffic a rule mirrors (option "mirror="), shared with tools/rinetd-replay: keep it free of boost
+ * and bump RINETD_CAPTURE_VERSION on any incompatible change. A capture is a file header followed by records; every
+ * record is a fixed header plus length bytes of payload, integers in host byte order. Workers append whole records
+ * only, so a file several workers write to stays a valid capture, though not in timestamp order. */
+#include <stdint.h>
+#include <string.h>
+
+static char const RINETD_CAPTURE_MAGIC[8]               = { 'R', 'N', 'T', 'D', 'C', 'A', 'P', '\0' };
+static uint32_t const RINETD_CAPTURE_VERSION            = 1;
+
+enum {
+    RINETD_CAPTURE_OPEN,                                /* payload: "client backend" addresses as text */
+    RINETD_CAPTURE_UP,                                  /* payload: bytes the client sent */
+    RINETD_CAPTURE_DOWN,                                /* payload: bytes the backend sent */
+    RINETD_CAPTURE_CLOSE,                               /* no payload */
+    RINETD_CAPTURE_LOST,                                /* no payload, length counts bytes of the flow the sink dropped */
+};
+
+#pragma pack(push, 1)
+typedef struct {
+    char                                                magic[8];
+    uint32_t                                            version;
+    uint32_t                                            record_size;    /* sizeof(rinetd_capture_record) */
+} rinetd_capture_header;
+
+typedef struct {
+    uint64_t                                            timestamp;      /* microseconds since the epoch */
+    uint64_t                                            flow;           /* worker << 48 | connection serial */
+    uint32_t                                            length;
+    uint8_t                                             type;           /* RINETD_CAPTURE_* */
+    uint8_t                                             reserved[3];
+} rinetd_capture_record;
+#pragma pack(pop)
+
+inline void                                             capture_header_init(rinetd_capture_header& header_) {
+    memset(&header_, 0, sizeof(header_));
+    memcpy(header_.magic, RINETD_CAPTURE_MAGIC, sizeof(header_.magic));
+    header_.version = RINETD_CAPTURE_VERSION;
+    header_.record_size = sizeof(rinetd_capture_record);
+}
@@ -1,4 +1,39 @@
 #include <config.h>
+#include <memory_budget.hpp>
+
+#ifdef __linux__
+#include <linux/filter.h>
+#endif
+
+static bool
+read_file(const std::string& path, std::string& out_) {
+    FILE* f = fopen(path.data(), "rb");
+    if (!f) {
+        return false;
+    }
+
+    fseek(f, 0, SEEK_END);
+    size_t sz = ftell(f);
+    fseek(f, 0, SEEK_SET);
+
+    std::shared_ptr<char> buf = make_shared_alloc<char>(sz + 1);
+    if (sz != fread(buf.get(), 1, sz, f)) {
+        fclose(f);
+        throw std::runtime_error("Can't from the specified file path of the file object to read all of its data into memory.");
+    }
+    else {
+        fclose(f);
+    }
+    out_.assign(buf.get(), sz);
+    return true;
+}
+
+static std::string 
+read_file(const std::string& path) {
+    std::string str;
+    read_file(path, str);
+    return str;
+}
 
 static std::string 
 read_config(int argc, const char* argv[]) {
@@ -49,31 +84,497 @@ read_config(int argc, const char* argv[]) {
         path = "/etc/rinetd.conf";
         #endif
     }
+    return read_file(path);
+}
 
-    FILE* f = fopen(path.data(), "rb");
-    if (!f) {
-        return "";
+static bool
+parse_keyword(const std::string& line_, const char* keyword_, std::string& value_) {
+    size_t sz_ = strlen(keyword_);
+    std::string str = LTrim(line_);
+    if (str.size() <= sz_ || strncmp(str.data(), keyword_, sz_) != 0 || !isspace((unsigned char)str[sz_])) {
+        return false;
     }
+    value_ = RTrim(LTrim(str.substr(sz_)));
+    return !value_.empty();
+}
 
-    fseek(f, 0, SEEK_END);
-    size_t sz = ftell(f);
-    fseek(f, 0, SEEK_SET);
+static bool
+parse_cpu_list(std::vector<int>& out_, const std::string& str) {
+    std::vector<std::string> tokens_;
+    if (Tokenize(str, tokens_, " \t,") < 1) {
+        return false;
+    }
+    for (size_t i = 0, l = tokens_.size(); i < l; i++) {
+        int first_ = -1;
+        int last_ = -1;
+        int count_ = sscanf(tokens_[i].data(), "%d-%d", &first_, &last_);
+        if (count_ == 1) {
+            last_ = first_;
+        }
+        else if (count_ != 2) {
+            return false;
+        }
+        if (first_ < 0 || last_ < first_ || last_ >= RINETD_MAX_CPUS) {
+            return false;
+        }
+        for (int cpu_ = first_; cpu_ <= last_; cpu_++) {
+            out_.push_back(cpu_);
+        }
+    }
+    return true;
+}
 
-    std::shared_ptr<char> buf = make_shared_alloc<char>(sz + 1);
-    if (sz != fread(buf.get(), 1, sz, f)) {
-        fclose(f);
-        throw std::runtime_error("Can't from the specified file path of the file object to read all of its data into memory.");
+static bool
+parse_size(uint64_t& out_, const std::string& str) {
+    unsigned long long value_ = 0;
+    char unit_ = '\0';
+    char tail_ = '\0';
+    int count_ = sscanf(str.data(), "%llu%c%c", &value_, &unit_, &tail_);
+    if (count_ < 1 || count_ > 2) {
+        return false;
+    }
+    switch (tolower(unit_)) {
+    case '\0':
+        break;
+    case 'k':
+        value_ <<= 10;
+        break;
+    case 'm':
+        value_ <<= 20;
+        break;
+    case 'g':
+        value_ <<= 30;
+        break;
+    default:
+        return false;
+    }
+    out_ = value_;
+    return true;
+}
+
+static bool
+parse_duration(uint32_t& out_, const std::string& str) {
+    unsigned long value_ = 0;
+    char unit_[4] = { '\0' };
+    int count_ = sscanf(str.data(), "%lu%3s", &value_, unit_);
+    if (count_ < 1) {
+        return false;
+    }
+    if (unit_[0] == '\0' || strcmp(unit_, "s") == 0) {
+        value_ *= 1000;
+    }
+    else if (strcmp(unit_, "ms") != 0) {
+        return false;
+    }
+    if (value_ > UINT32_MAX) {
+        return false;
+    }
+    out_ = (uint32_t)value_;
+    return true;
+}
+
+static bool
+parse_hex(std::string& out_, const std::string& str) {
+    if (str.size() & 1) {
+        return false;
+    }
+    std::string bytes_;
+    for (size_t i = 0, l = str.size(); i < l; i += 2) {
+        unsigned int ch = 0;
+        if (!isxdigit((unsigned char)str[i]) || !isxdigit((unsigned char)str[i + 1]) || 
+            sscanf(str.data() + i, "%2x", &ch) < 1) {
+            return false;
+        }
+        bytes_.push_back((char)ch);
+    }
+    out_ = std::move(bytes_);
+    return true;
+}
+
+static bool
+parse_mirror(listen_port& listen_port_, const std::string& str) {
+    /* fmt: /path/to/file.cap, 10.0.0.9:9000 or [2001:db8::9]:9000 */
+    if (str.size() > 0 && str[0] == '/') {
+        listen_port_.mirror_file = str;
+        return true;
+    }
+    size_t sz_ = str.rfind(':');
+    if (sz_ == std::string::npos) {
+        return false;
+    }
+    std::string host_ = str.substr(0, sz_);
+    if (host_.size() > 1 && host_[0] == '[' && host_[host_.size() - 1] == ']') {
+        host_ = host_.substr(1, host_.size() - 2);
+    }
+    int port_ = atoi(str.data() + sz_ + 1);
+    if (port_ <= 0 || port_ > UINT16_MAX || !parse_address(listen_port_.mirror_host, host_.data())) {
+        return false;
+    }
+    listen_port_.mirror_port = (uint16_t)port_;
+    return true;
+}
+
+static bool
+parse_options(listen_port& listen_port_, const std::string& options_) {
+    std::vector<std::string> tokens_; // fmt: [max_tunnels=4096,tunnel_budget=64m]
+    Tokenize(options_, tokens_, ",");
+    for (size_t i = 0, l = tokens_.size(); i < l; i++) {
+        std::string& token_ = tokens_[i];
+        size_t sz_ = token_.find('=');
+        if (sz_ == std::string::npos) {
+            return false;
+        }
+        std::string key_ = RTrim(LTrim(token_.substr(0, sz_)));
+        std::string value_ = RTrim(LTrim(token_.substr(sz_ + 1)));
+        uint64_t number_ = 0;
+        if (key_ == "max_tunnels") {
+            if (!parse_size(number_, value_) || number_ > UINT32_MAX) {
+                return false;
+            }
+            listen_port_.max_tunnels = (uint32_t)number_;
+        }
+        else if (key_ == "tunnel_budget") {
+            if (!parse_size(number_, value_)) {
+                return false;
+            }
+            listen_port_.tunnel_budget = number_;
+        }
+        else if (key_ == "udp_timeout") {
+            if (!parse_duration(listen_port_.udp_timeout, value_) || listen_port_.udp_timeout < 1) {
+                return false;
+            }
+        }
+        else if (key_ == "conn_rate") {
+            if (!parse_size(number_, value_) || number_ > UINT32_MAX) {
+                return false;
+            }
+            listen_port_.conn_rate = (uint32_t)number_;
+        }
+        else if (key_ == "conn_rate_net") {
+            if (!parse_size(number_, value_) || number_ > UINT32_MAX) {
+                return false;
+            }
+            listen_port_.conn_rate_net = (uint32_t)number_;
+        }
+        else if (key_ == "transparent") {
+            if (value_ == "on" || value_ == "yes") {
+                listen_port_.transparent = true;
+            }
+            else if (value_ == "off" || value_ == "no") {
+                listen_port_.transparent = false;
+            }
+            else {
+                return false;
+            }
+        }
+        else if (key_ == "busy_poll") {
+            if (!parse_size(number_, value_) || number_ > INT32_MAX) {
+                return false;
+            }
+            listen_port_.busy_poll = (uint32_t)number_;
+        }
+        else if (key_ == "mptcp") {
+            if (value_ == "client") {
+                listen_port_.mptcp = RINETD_MPTCP_CLIENT;
+            }
+            else if (value_ == "backend") {
+                listen_port_.mptcp = RINETD_MPTCP_BACKEND;
+            }
+            else if (value_ == "both" || value_ == "on") {
+                listen_port_.mptcp = RINETD_MPTCP_CLIENT | RINETD_MPTCP_BACKEND;
+            }
+            else if (value_ == "off") {
+                listen_port_.mptcp = 0;
+            }
+            else {
+                return false;
+            }
+        }
+        else if (key_ == "quic") {
+            if (value_ == "on" || value_ == "yes") {
+                listen_port_.quic = true;
+            }
+            else if (value_ == "off" || value_ == "no") {
+                listen_port_.quic = false;
+            }
+            else {
+                return false;
+            }
+        }
+        else if (key_ == "mirror") {
+            if (!parse_mirror(listen_port_, value_)) {
+                return false;
+            }
+        }
+        else if (key_ == "balance") {
+            if (value_ == "failover") {
+                listen_port_.balance = RINETD_BALANCE_FAILOVER;
+            }
+            else if (value_ == "source" && listen_port_.remote_hosts.size() <= INT16_MAX) {
+                listen_port_.balance = RINETD_BALANCE_SOURCE;
+            }
+            else {
+                return false;
+            }
+        }
+        else if (key_ == "check") {
+            if (value_ == "tcp") {
+                listen_port_.health.check = RINETD_CHECK_TCP;
+            }
+            else if (value_ == "udp") {
+                listen_port_.health.check = RINETD_CHECK_UDP;
+            }
+            else if (value_ == "none") {
+                listen_port_.health.check = RINETD_CHECK_NONE;
+            }
+            else {
+                return false;
+            }
+        }
+        else if (key_ == "check_interval") {
+            if (!parse_duration(listen_port_.health.interval, value_) || listen_port_.health.interval < 1) {
+                return false;
+            }
+        }
+        else if (key_ == "check_timeout") {
+            if (!parse_duration(listen_port_.health.timeout, value_) || listen_port_.health.timeout < 1) {
+                return false;
+            }
+        }
+        else if (key_ == "check_fall") {
+            if (!parse_size(number_, value_) || number_ < 1 || number_ > UINT32_MAX) {
+                return false;
+            }
+            listen_port_.health.fall = (uint32_t)number_;
+        }
+        else if (key_ == "check_send") {
+            if (!parse_hex(listen_port_.health.send, value_)) {
+                return false;
+            }
+        }
+        else if (key_ == "check_expect") {
+            if (!parse_hex(listen_port_.health.expect, value_)) {
+                return false;
+            }
+        }
+        else if (key_ == "fail_threshold") {
+            if (!parse_size(number_, value_) || number_ > UINT32_MAX) {
+                return false;
+            }
+            listen_port_.health.fail_threshold = (uint32_t)number_;
+        }
+        else if (key_ == "eject_time") {
+            if (!parse_duration(listen_port_.health.eject_time, value_)) {
+                return false;
+            }
+        }
+        else {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool
+parse_cidr(acl_entry& out_, const std::string& str, bool allow) {
+    /* fmt: 10.0.0.0/8, 2001:db8::/32, a bare address, or the classic rinetd 192.168.*.* */
+    std::string host_ = str;
+    int prefix_ = -1;
+    size_t sz_ = str.find('/');
+    if (sz_ != std::string::npos) {
+        host_ = str.substr(0, sz_);
+        if (sscanf(str.data() + sz_ + 1, "%d", &prefix_) < 1 || prefix_ < 0) {
+            return false;
+        }
+    }
+    else if (str.find('*') != std::string::npos) {
+        std::vector<std::string> octets_;
+        if (Tokenize(str, octets_, ".") != 4) {
+            return false;
+        }
+        prefix_ = 0;
+        host_.clear();
+        for (int i = 0; i < 4; i++) {
+            bool wildcard_ = octets_[i] == "*";
+            if (!wildcard_ && prefix_ != i * 8) {
+                return false;
+            }
+            prefix_ += wildcard_ ? 0 : 8;
+            host_ += (i ? "." : "") + (wildcard_ ? std::string("0") : octets_[i]);
+        }
+    }
+
+    if (!parse_address(out_.address, host_.data())) {
+        return false;
+    }
+    int width_ = out_.address.bv6 ? 128 : 32;
+    if (prefix_ > width_) {
+        return false;
+    }
+    out_.prefix = prefix_ < 0 ? width_ : prefix_;
+    out_.allow = allow;
+    return true;
+}
+
+/* A list that cannot be read completely fails closed: error_ names the file or the first prefix that did not parse,
+ * and the caller refuses the rule rather than admitting clients the list was meant to sort out. */
+static bool
+parse_acl(std::vector<acl_entry>& out_, const std::string& line_, bool allow, std::string& error_) {
+    /* fmt: allow 10.0.0.0/8 192.168.1.0/24, or deny_file /etc/rinetd/blocklist with one prefix per line */
+    std::string value_;
+    std::string patterns_;
+    if (parse_keyword(line_, allow ? "allow_file" : "deny_file", value_)) {
+        std::string file_;
+        if (!read_file(value_, file_)) {
+            error_ = value_ + " can't be read";
+            return false;
+        }
+        std::vector<std::string> lines_;
+        Tokenize(file_, lines_, "\r\n");
+        for (size_t i = 0, l = lines_.size(); i < l; i++) {
+            patterns_ += lines_[i].substr(0, lines_[i].find('#')) + " ";
+        }
+    }
+    else if (parse_keyword(line_, allow ? "allow" : "deny", value_)) {
+        patterns_ = value_;
+    }
+
+    std::vector<std::string> tokens_;
+    Tokenize(patterns_, tokens_, " \t,;");
+    for (size_t i = 0, l = tokens_.size(); i < l; i++) {
+        acl_entry entry_;
+        if (!parse_cidr(entry_, tokens_[i], allow)) {
+            error_ = "bad prefix " + tokens_[i];
+            return false;
+        }
+        out_.push_back(entry_);
+    }
+    return true;
+}
+
+static bool
+parse_global(rinetd_config& config_, const std::string& line_) {
+    std::string value_;
+    if (parse_keyword(line_, "workers", value_)) {
+        int workers_ = 0;
+        if (value_ == "auto") {
+            workers_ = std::thread::hardware_concurrency();
+        }
+        else {
+            workers_ = atoi(value_.data());
+        }
+        config_.workers = std::max<int>(1, workers_);
+    }
+    else if (parse_keyword(line_, "scheduler", value_)) {
+        int nice_ = 0;
+        if (value_ == "normal") {
+            config_.scheduler = RINETD_SCHEDULER_NORMAL;
+        }
+        else if (value_ == "realtime") {
+            config_.scheduler = RINETD_SCHEDULER_REALTIME;
+        }
+        else if (sscanf(value_.data(), "nice %d", &nice_) >= 1) {
+            config_.scheduler = RINETD_SCHEDULER_NICE;
+            config_.scheduler_nice = std::max<int>(-20, std::min<int>(19, nice_));
+        }
+        else {
+            return false;
+        }
+    }
+    else if (parse_keyword(line_, "cpu_affinity", value_)) {
+        std::vector<int> cpus_;
+        if (!parse_cpu_list(cpus_, value_)) {
+            return false;
+        }
+        config_.cpu_affinity = std::move(cpus_);
+    }
+    else if (parse_keyword(line_, "incoming_cpu", value_)) {
+        config_.incoming_cpu = value_ == "on" || value_ == "yes" || value_ == "1";
+    }
+    else if (parse_keyword(line_, "udp_reuseport_bpf", value_)) {
+        config_.udp_reuseport_bpf = value_ == "on" || value_ == "yes" || value_ == "1";
+    }
+    else if (parse_keyword(line_, "memory_budget", value_)) {
+        if (!parse_size(config_.memory_budget, value_)) {
+            return false;
+        }
+    }
+    else if (parse_keyword(line_, "flight_recorder", value_)) {
+        uint64_t number_ = 0;
+        if (!parse_size(number_, value_) || number_ > UINT32_MAX) {
+            return false;
+        }
+        config_.flight_records = (uint32_t)number_;
+    }
+    else if (parse_keyword(line_, "flight_file", value_)) {
+        config_.flight_file = value_;
+    }
+    else if (parse_keyword(line_, "top_talkers", value_)) {
+        uint64_t number_ = 0;
+        if (!parse_size(number_, value_) || number_ > UINT16_MAX) {
+            return false;
+        }
+        config_.top_talkers = (uint32_t)number_;
+    }
+    else if (parse_keyword(line_, "top_prefix", value_)) {
+        std::vector<std::string> lengths_;
+        Tokenize(value_, lengths_, " \t");
+        if (lengths_.size() < 1 || lengths_.size() > 2) {
+            return false;
+        }
+        int v4_ = atoi(lengths_[0].data());
+        int v6_ = lengths_.size() > 1 ? atoi(lengths_[1].data()) : config_.top_prefix_v6;
+        if (v4_ < 0 || v4_ > 32 || v6_ < 0 || v6_ > 128) {
+            return false;
+        }
+        config_.top_prefix_v4 = v4_;
+        config_.top_prefix_v6 = v6_;
+    }
+    else if (parse_keyword(line_, "stats_file", value_)) {
+        config_.stats_file = value_;
+    }
+    else if (parse_keyword(line_, "admin_socket", value_)) {
+        config_.admin_socket = value_;
+    }
+    else if (parse_keyword(line_, "sockmap", value_)) {
+        if (value_ == "on" || value_ == "yes") {
+            config_.sockmap = RINETD_SOCKMAP_ENTRIES;
+        }
+        else if (value_ == "off" || value_ == "no") {
+            config_.sockmap = 0;
+        }
+        else {
+            config_.sockmap = (uint32_t)strtoul(value_.data(), NULL, 10);
+        }
     }
     else {
-        fclose(f);
+        return false;
     }
-    return std::string(buf.get(), sz);
+    return true;
 }
 
 static bool
-parse_config(std::vector<listen_port>& out_, std::string& log_path_, const std::string& config_str) {
+parse_config(rinetd_config& config_, const std::string& config_str) {
+    std::vector<listen_port>& out_ = config_.listen_ports;
+    std::string& log_path_ = config_.log_var;
     log_path_.clear();
     out_.clear();
+    config_.workers        = 1;
+    config_.scheduler      = RINETD_SCHEDULER_NORMAL;
+    config_.scheduler_nice = 0;
+    config_.incoming_cpu   = false;
+    config_.udp_reuseport_bpf = false;
+    config_.sockmap        = 0;
+    config_.admin_socket.clear();
+    config_.stats_file.clear();
+    config_.memory_budget  = 0;
+    config_.flight_records = RINETD_FLIGHT_RECORDS;
+    config_.flight_file    = RINETD_FLIGHT_DEFAULT_FILE;
+    config_.top_talkers    = RINETD_TOP_TALKERS;
+    config_.top_prefix_v4  = RINETD_TOP_PREFIX_V4;
+    config_.top_prefix_v6  = RINETD_TOP_PREFIX_V6;
+    config_.cpu_affinity.clear();
+    config_.acl.clear();
     if (config_str.empty()) {
         return false;
     }
@@ -81,6 +582,11 @@ parse_config(std::vector<listen_port>& out_, std::string& log_path_, const std::
     if (Tokenize(config_str, lines_, "\r\n") < 1) {
         return false;
     }
+    /* allow/deny lines before the first rule are global, later ones belong to the rule above them. */
+    std::vector<acl_entry>* acl_ = &config_.acl;
+    std::vector<acl_entry> ignored_acl_;
+    std::vector<std::string> errors_;
+    bool acl_failed_ = false;
     for (size_t i = 0, l = lines_.size(); i < l; i++) {
         std::string& line_ = lines_[i];
         if (line_.empty()) {
@@ -94,18 +600,19 @@ parse_config(std::vector<listen_port>& out_, std::string& log_path_, const std::
             line_ = line_.substr(0, sz_);
         }
         char     local_host[128]; // fmt: 0.0.0.0 11111/tcp 1.1.1.1 22222/tcp
-        char     remote_host[128];
+        char     remote_host[1024];
         uint32_t local_port        = 0;
         uint32_t remote_port       = 0;
         bool     tcp_or_udp        = false;
-        if (sscanf(line_.data(), "%s %u/tcp %s %u/tcp", local_host, &local_port, remote_host, &remote_port) >= 4) {
+        if (sscanf(line_.data(), "%127s %u/tcp %1023s %u/tcp", local_host, &local_port, remote_host, &remote_port) >= 4) {
             tcp_or_udp = true;
         }
-        else if (sscanf(line_.data(), "%s %u/udp %s %u/udp", local_host, &local_port, remote_host, &remote_port) >= 4) {
+        else if (sscanf(line_.data(), "%127s %u/udp %1023s %u/udp", local_host, &local_port, remote_host, &remote_port) >= 4) {
             tcp_or_udp = false;
         }
         else {
             char log_file[PATH_MAX + 1];
+            std::string value_;
             if (sscanf(line_.data(), "logfile %s", log_file) >= 1) {
                 uint32_t sz = strlen(log_file);
                 if (!sz) {
@@ -113,15 +620,93 @@ parse_config(std::vector<listen_port>& out_, std::string& log_path_, const std::
                 }
                 log_path_ = std::string(log_file, sz);
             }
+            else if (parse_keyword(line_, "allow", value_) || parse_keyword(line_, "allow_file", value_) ||
+                parse_keyword(line_, "deny", value_) || parse_keyword(line_, "deny_file", value_)) {
+                std::string error_;
+                bool allow_ = parse_keyword(line_, "allow", value_) || parse_keyword(line_, "allow_file", value_);
+                if (!parse_acl(*acl_, line_, allow_, error_)) {
+                    /* a broken global list stops rinetd, a broken rule list only that rule */
+                    if (acl_ == &config_.acl) {
+                        errors_.push_back("config: " + LTrim(line_) + ": " + error_ + ", not starting");
+                        acl_failed_ = true;
+                    }
+                    else if (acl_ != &ignored_acl_) {
+                        listen_port& rule_ = out_.back();
+                        errors_.push_back("config: " + LTrim(line_) + ": " + error_ + ", rule " +
+                            std::to_string(rule_.local_port) + (rule_.tcp_or_udp ? "/tcp" : "/udp") + " not started");
+                        out_.pop_back();
+                        ignored_acl_.clear();
+                        acl_ = &ignored_acl_;
+                    }
+                }
+            }
+            else if (!parse_global(config_, line_) && !LTrim(line_).empty()) {
+                errors_.push_back("config: rejected line: " + LTrim(line_));
+            }
             continue;
         }
+
+        /* A rule that fails to parse must not collect the allow/deny lines meant for it. */
+        ignored_acl_.clear();
+        acl_ = &ignored_acl_;
+        std::string rejected_ = "config: rejected rule: " + RTrim(LTrim(line_));
         if ((local_port == 0 || local_port > 65535) || (remote_port == 0 || remote_port > 65535)) {
+            errors_.push_back(rejected_);
             continue;
         }
 
         listen_port listen_port_;
-        if (!parse_address(listen_port_.local_host, local_host) ||
-            !parse_address(listen_port_.remote_host, remote_host)) {
+        if (!parse_address(listen_port_.local_host, local_host)) {
+            errors_.push_back(rejected_);
+            continue;
+        }
+
+        /* fmt: 1.1.1.1,2.2.2.2 -- backends in failover order, all on the remote port */
+        std::vector<std::string> remote_hosts_;
+        Tokenize(remote_host, remote_hosts_, ",");
+        for (size_t n = 0, m = remote_hosts_.size(); n < m; n++) {
+            ip_address host_;
+            if (!parse_address(host_, remote_hosts_[n].data())) {
+                listen_port_.remote_hosts.clear();
+                break;
+            }
+            listen_port_.remote_hosts.push_back(host_);
+        }
+        if (listen_port_.remote_hosts.empty()) {
+            errors_.push_back(rejected_);
+            continue;
+        }
+
+        listen_port_.remote_host           = listen_port_.remote_hosts[0];
+        listen_port_.max_tunnels           = 0;
+        listen_port_.tunnel_budget         = 0;
+        listen_port_.udp_timeout           = RINETD_DEFAULT_UDP_TIMEOUT * 1000;
+        listen_port_.balance               = RINETD_BALANCE_FAILOVER;
+        listen_port_.transparent           = false;
+        listen_port_.conn_rate             = 0;
+        listen_port_.conn_rate_net         = 0;
+        listen_port_.mirror_port           = 0;
+        listen_port_.busy_poll             = 0;
+        listen_port_.mptcp                 = 0;
+        listen_port_.quic                  = false;
+        listen_port_.health.check          = RINETD_CHECK_NONE;
+        listen_port_.health.interval       = 2000;
+        listen_port_.health.timeout        = 1000;
+        listen_port_.health.fall           = 2;
+        listen_port_.health.fail_threshold = 3;
+        listen_port_.health.eject_time     = 10000;
+
+        size_t options_begin_ = line_.find('[');
+        if (options_begin_ != std::string::npos) {
+            size_t options_end_ = line_.find(']', options_begin_);
+            if (options_end_ == std::string::npos || 
+                !parse_options(listen_port_, line_.substr(options_begin_ + 1, options_end_ - options_begin_ - 1))) {
+                errors_.push_back(rejected_);
+                continue;
+            }
+        }
+        if (!tcp_or_udp && (listen_port_.mirror_port || !listen_port_.mirror_file.empty())) {
+            errors_.push_back(rejected_ + " (only tcp rules are mirrored)");
             continue;
         }
         
@@ -130,8 +715,15 @@ parse_config(std::vector<listen_port>& out_, std::string& log_path_, const std::
         listen_port_.remote_port = remote_port;
 
         out_.push_back(std::move(listen_port_));
+        acl_ = &out_.back().acl;
+    }
+    /* logfile may come last, errors are written once its path is known; stderr, which daemon() leaves open, gets them
+     * too so that a refused start is explained even without a logfile. */
+    for (size_t i = 0, l = errors_.size(); i < l; i++) {
+        write_log(log_path_, errors_[i]);
+        fprintf(stderr, "rinetd: %s\n", errors_[i].data());
     }
-    return out_.size() > 0;
+    return !acl_failed_ && out_.size() > 0;
 }
 
 bool write_log(const std::string& path_, const std::string& msg_) {
@@ -150,12 +742,17 @@ bool write_log(const std::string& path_, const std::string& msg_) {
 }
 
 bool write_log(boost::asio::posix::stream_descriptor& log_, const std::string& msg_) {
-    if (!log_.is_open() || msg_.empty()) {
+    /* Log lines are the first thing shed under memory pressure. */
+    if (!log_.is_open() || msg_.empty() || memory_budget::pressure()) {
         return false; 
     }
     std::shared_ptr<std::string> line_ = make_shared_object<std::string>("[" + GetCurrentTimeText() + "]" + msg_ + "\r\n");
+    int64_t cost_ = (int64_t)line_->capacity();
+    memory_budget::charge(cost_);
     log_.async_write_some(boost::asio::buffer(line_->data(), line_->size()), 
-        [line_](const boost::system::error_code& ec, std::size_t sz){});
+        [line_, cost_](const boost::system::error_code& ec, std::size_t sz) {
+            memory_budget::release(cost_);
+        });
     return true;
 }
 
@@ -178,7 +775,7 @@ std::shared_ptr<boost::asio::posix::stream_descriptor> open_log(boost::asio::io_
     SetFilePointer(handle_, li_.LowPart, &li_.HighPart, FILE_END);
     return make_shared_object<boost::asio::posix::stream_descriptor>(context_, handle_);
     #else
-    int handle_ = open(path_.data(), O_RDWR | O_CREAT, S_IRWXU);
+    int handle_ = open(path_.data(), O_RDWR | O_CREAT | O_APPEND, S_IRWXU);
     if (handle_ == -1) {
         return NULL;
     }
@@ -192,7 +789,130 @@ bool load_config(rinetd_config& config_, int argc, const char* argv[]) {
     if (config_str.empty()) {
         return false;
     }
-    return parse_config(config_.listen_ports, config_.log_var, config_str);
+    return parse_config(config_, config_str);
+}
+
+bool syssocket_transparent(int sockfd, bool v4_or_v6, bool stream) {
+    #if defined(_WIN32) || !defined(__linux__)
+    return false;
+    #else
+    /* IP_TRANSPARENT lets the socket bind a foreign address (needs CAP_NET_ADMIN); policy routing has to hand the
+     * backend's replies to this host. The port is only picked at connect time, so a busy client address does not
+     * exhaust the ephemeral range at bind. */
+    int on = 1;
+    if (v4_or_v6) {
+        if (::setsockopt(sockfd, SOL_IP, IP_TRANSPARENT, &on, sizeof(on)) < 0) {
+            return false;
+        }
+        ::setsockopt(sockfd, SOL_IP, IP_FREEBIND, &on, sizeof(on));
+    }
+    else {
+        #ifndef IPV6_TRANSPARENT
+        #define IPV6_TRANSPARENT 75
+        #endif
+        #ifndef IPV6_FREEBIND
+        #define IPV6_FREEBIND 78
+        #endif
+        if (::setsockopt(sockfd, SOL_IPV6, IPV6_TRANSPARENT, &on, sizeof(on)) < 0) {
+            return false;
+        }
+        ::setsockopt(sockfd, SOL_IPV6, IPV6_FREEBIND, &on, sizeof(on));
+    }
+    #ifdef IP_BIND_ADDRESS_NO_PORT
+    if (stream) {
+        ::setsockopt(sockfd, SOL_IP, IP_BIND_ADDRESS_NO_PORT, &on, sizeof(on));
+    }
+    #endif
+    return true;
+    #endif
+}
+
+bool syssocket_reuseport_bpf(int sockfd, uint32_t sockets) {
+    #if defined(_WIN32) || !defined(__linux__)
+    return false;
+    #else
+    #ifndef SO_ATTACH_REUSEPORT_CBPF
+    #define SO_ATTACH_REUSEPORT_CBPF 51
+    #endif
+    /* Picks the socket of a reuseport group from the client's address and port: the words are folded, mixed with a
+     * multiplicative hash and reduced modulo the group size. The ip version is read from the packet, so a dual-stack
+     * socket hashes v4-mapped clients as ipv4; ports are assumed behind a header without options. */
+    struct sock_filter code_[] = {
+        BPF_STMT(BPF_LD | BPF_B | BPF_ABS, (uint32_t)SKF_NET_OFF),
+        BPF_STMT(BPF_ALU | BPF_RSH | BPF_K, 4),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 6, 0, 14),
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, (uint32_t)SKF_NET_OFF + 8),
+        BPF_STMT(BPF_MISC | BPF_TAX, 0),
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, (uint32_t)SKF_NET_OFF + 12),
+        BPF_STMT(BPF_ALU | BPF_XOR | BPF_X, 0),
+        BPF_STMT(BPF_MISC | BPF_TAX, 0),
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, (uint32_t)SKF_NET_OFF + 16),
+        BPF_STMT(BPF_ALU | BPF_XOR | BPF_X, 0),
+        BPF_STMT(BPF_MISC | BPF_TAX, 0),
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, (uint32_t)SKF_NET_OFF + 20),
+        BPF_STMT(BPF_ALU | BPF_XOR | BPF_X, 0),
+        BPF_STMT(BPF_MISC | BPF_TAX, 0),
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, (uint32_t)SKF_NET_OFF + 40),
+        BPF_STMT(BPF_ALU | BPF_XOR | BPF_X, 0),
+        BPF_JUMP(BPF_JMP | BPF_JA, 4, 0, 0),
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, (uint32_t)SKF_NET_OFF + 12),
+        BPF_STMT(BPF_MISC | BPF_TAX, 0),
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, (uint32_t)SKF_NET_OFF + 20),
+        BPF_STMT(BPF_ALU | BPF_XOR | BPF_X, 0),
+        BPF_STMT(BPF_MISC | BPF_TAX, 0),
+        BPF_STMT(BPF_ALU | BPF_RSH | BPF_K, 16),
+        BPF_STMT(BPF_ALU | BPF_XOR | BPF_X, 0),
+        BPF_STMT(BPF_ALU | BPF_MUL | BPF_K, 2654435761U),
+        BPF_STMT(BPF_ALU | BPF_RSH | BPF_K, 16),
+        BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, sockets),
+        BPF_STMT(BPF_RET | BPF_A, 0),
+    };
+    struct sock_fprog program_;
+    program_.len = sizeof(code_) / sizeof(*code_);
+    program_.filter = code_;
+    return sockets > 0 && ::setsockopt(sockfd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &program_, sizeof(program_)) == 0;
+    #endif
+}
+
+bool syssocket_busy_poll(int sockfd, uint32_t usec, bool stream) {
+    if (sockfd == -1) {
+        return false;
+    }
+    if (stream) {
+        int on = 1;
+        ::setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, (char*)&on, sizeof(on));
+    }
+    #if defined(_WIN32) || !defined(__linux__)
+    return false;
+    #else
+    #ifndef SO_BUSY_POLL
+    #define SO_BUSY_POLL 46
+    #endif
+    #ifndef SO_PREFER_BUSY_POLL
+    #define SO_PREFER_BUSY_POLL 69
+    #endif
+    /* A non-blocking receive on the socket then polls the device queue it was last fed from before giving up, and
+     * prefers that over interrupt driven processing (5.11+). Above net.core.busy_read it takes CAP_NET_ADMIN. */
+    int value = (int)usec;
+    if (::setsockopt(sockfd, SOL_SOCKET, SO_BUSY_POLL, &value, sizeof(value)) < 0) {
+        return false;
+    }
+    int on = 1;
+    ::setsockopt(sockfd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &on, sizeof(on));
+    return true;
+    #endif
+}
+
+int syssocket_mptcp(bool v4_or_v6) {
+    #if defined(_WIN32) || !defined(__linux__)
+    return -1;
+    #else
+    #ifndef IPPROTO_MPTCP
+    #define IPPROTO_MPTCP 262
+    #endif
+    /* Fails with EPROTONOSUPPORT on kernels before 5.6 and ENOPROTOOPT while net.mptcp.enabled is 0. */
+    return ::socket(v4_or_v6 ? AF_INET : AF_INET6, SOCK_STREAM | SOCK_CLOEXEC, IPPROTO_MPTCP);
+    #endif
 }
 
 std::string get_cmd_arg_str(const char* name, int argc, const char** argv) {
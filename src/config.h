@@ -8,23 +8,123 @@ static int const RINETD_BUFFER_SIZE                     = 65536;
 static int const RINETD_LISTEN_BACKLOG                  = 511;
 static int const RINETD_DEFAULT_UDP_TIMEOUT             = 72;
 static int const RINETD_TCP_CONNECT_TIMEOUT             = 5;
+static int const RINETD_MAX_CPUS                        = 1024;
+static int const RINETD_SOCKMAP_ENTRIES                 = 65536;
+static int const RINETD_SOCKMAP_ATTEMPTS                = 8;    /* splice retries per connection while bytes are queued */
+static int const RINETD_SOCKMAP_LINGER                  = 200;  /* ms the kernel gets to flush redirected bytes before close */
+static int const RINETD_ADMIN_BATCH                     = 256;  /* sessions listed per worker turn by the admin socket */
+static int const RINETD_HEALTH_CHECK_TICK               = 100;  /* ms between health scheduler passes */
+static int const RINETD_MAGLEV_TABLE_SIZE               = 65537;/* prime, well above any backend count */
+static int const RINETD_RATE_SKETCH_DEPTH               = 4;
+static int const RINETD_RATE_SKETCH_WIDTH               = 8192; /* power of two; 256k of counters per limited rule */
+static int const RINETD_RATE_WINDOW                     = 1000; /* ms, rate limits are new connections per window */
+static int const RINETD_MEMORY_HYSTERESIS               = 8;    /* reads resume once usage is 1/8 below the budget */
+static int const RINETD_MEMORY_RECHECK                  = 50;   /* ms between checks while reads are suspended */
+static int const RINETD_MEMORY_SUSPEND_MAX              = 1000; /* ms, suspended reads are let through once after this */
+static int const RINETD_MIRROR_QUEUE_BYTES              = 4 * 1024 * 1024; /* per rule and worker, mirror data beyond is dropped */
+static int const RINETD_MIRROR_CHUNK_SIZE               = 64 * 1024;
+static int const RINETD_MIRROR_RETRY                    = 5;    /* s between attempts to reach a tcp mirror sink */
+static int const RINETD_UDP_TUNNEL_OVERHEAD             = 2048; /* kernel socket, file and hash node behind each tunnel */
+static int const RINETD_UDP_RECEIVE_BATCH               = 64;
+static int const RINETD_UDP_TUNNEL_QUEUE_PACKETS        = 64;
+static int const RINETD_UDP_TUNNEL_QUEUE_BYTES          = 256 * 1024;
+static int const RINETD_UDP_LISTEN_QUEUE_PACKETS        = 1024;
+static int const RINETD_UDP_LISTEN_QUEUE_BYTES          = 4 * 1024 * 1024;
+static int const RINETD_FLIGHT_RECORDS                  = 4096; /* default lifecycle events kept per worker */
+static char const RINETD_FLIGHT_DEFAULT_FILE[]          = "/tmp/rinetd.flight";
+static int const RINETD_TOP_TALKERS                     = 64;   /* default clients tracked per rule and worker */
+static int const RINETD_TOP_HALF_LIFE                   = 10000;/* ms, top talker weights halve at every multiple */
+static int const RINETD_TOP_PREFIX_V4                   = 32;
+static int const RINETD_TOP_PREFIX_V6                   = 64;
+static int const RINETD_TOP_LISTED                      = 10;   /* clients listed per rule by the admin top command */
+static int const RINETD_QUIC_MAX_CID                    = 20;   /* longest connection id of QUIC version 1 */
+static int const RINETD_QUIC_TUNNEL_IDS                 = 4;    /* connection ids remembered per udp tunnel */
+static int const RINETD_QUIC_MIGRATE_DATAGRAMS          = 3;    /* sent from a new client address before a tunnel moves there */
+static int const RINETD_QUIC_MIGRATE_WINDOW             = 2000; /* ms those datagrams have to arrive in */
+static int const RINETD_UPGRADE_HANDOVER                = 30;   /* s a successor gets to take the listeners before it is killed */
+
+enum {
+    RINETD_CHECK_NONE,
+    RINETD_CHECK_TCP,
+    RINETD_CHECK_UDP,
+};
+enum {
+    RINETD_BALANCE_FAILOVER,
+    RINETD_BALANCE_SOURCE,
+};
+enum {
+    RINETD_MPTCP_CLIENT                                 = 1,
+    RINETD_MPTCP_BACKEND                                = 2,
+};
+enum {
+    RINETD_SCHEDULER_NORMAL,
+    RINETD_SCHEDULER_NICE,
+    RINETD_SCHEDULER_REALTIME,
+};
 
 typedef struct {
     bool                                                bv6;
     uint32_t                                            in4;
     uint8_t                                             in6[16];
 } ip_address;
+typedef struct {
+    int                                                 check;          /* active probe: RINETD_CHECK_* */
+    uint32_t                                            interval;       /* ms between probes */
+    uint32_t                                            timeout;        /* ms before a probe counts as failed */
+    uint32_t                                            fall;           /* failed probes before the backend is down */
+    uint32_t                                            fail_threshold; /* failed client connects before ejection, 0 = off */
+    uint32_t                                            eject_time;     /* ms an ejected backend stays out without probes */
+    std::string                                         send;
+    std::string                                         expect;
+} health_options;
+typedef struct {
+    ip_address                                          address;
+    int                                                 prefix;         /* leading bits that must match */
+    bool                                                allow;
+} acl_entry;
 typedef struct {
     bool                                                tcp_or_udp;
     ip_address                                          local_host;
     uint16_t                                            local_port;
     ip_address                                          remote_host;
     uint16_t                                            remote_port;
+    std::vector<ip_address>                             remote_hosts;
+    int                                                 balance;        /* RINETD_BALANCE_* */
+    bool                                                transparent;    /* upstream sockets use the client's address */
+    health_options                                      health;
+    uint32_t                                            conn_rate;      /* new connections/s per source address, 0 = off */
+    uint32_t                                            conn_rate_net;  /* the same per /24 (ipv4) or /64 (ipv6) */
+    std::vector<acl_entry>                              acl;            /* allow/deny lines following the rule */
+    uint32_t                                            max_tunnels;
+    uint64_t                                            tunnel_budget;
+    uint32_t                                            udp_timeout;    /* ms an idle udp tunnel is kept */
+    std::string                                         mirror_file;    /* capture file the traffic is copied to */
+    ip_address                                          mirror_host;    /* or a tcp sink, when mirror_port is set */
+    uint16_t                                            mirror_port;
+    uint32_t                                            busy_poll;      /* us of SO_BUSY_POLL, > 0 serves the rule from the polling worker */
+    int                                                 mptcp;          /* RINETD_MPTCP_* legs opened as multipath tcp */
+    bool                                                quic;           /* udp tunnels follow QUIC connection ids across client addresses */
 } listen_port;
 
 typedef struct {
     std::vector<listen_port>                            listen_ports;
+    std::vector<acl_entry>                              acl;            /* allow/deny lines before the first rule */
     std::string                                         log_var;
+    int                                                 workers;
+    int                                                 scheduler;
+    int                                                 scheduler_nice;
+    std::vector<int>                                    cpu_affinity;
+    bool                                                incoming_cpu;
+    bool                                                udp_reuseport_bpf; /* workers picked by a cbpf flow hash */
+    uint32_t                                            sockmap;        /* sockhash entries, 0 = userspace relay only */
+    std::string                                         admin_socket;
+    std::string                                         stats_file;
+    uint64_t                                            memory_budget;  /* bytes, 0 = unbounded */
+    uint32_t                                            flight_records; /* lifecycle events kept per worker, 0 = off */
+    std::string                                         flight_file;    /* where SIGUSR1 dumps them */
+    uint32_t                                            top_talkers;    /* heavy hitter entries per rule and worker, 0 = off */
+    int                                                 top_prefix_v4;  /* clients are grouped by these prefix lengths */
+    int                                                 top_prefix_v6;
 } rinetd_config;
 
 template<class TProtocol>
@@ -82,6 +182,27 @@ inline bool                                             parse_address(ip_address
     return true;
 }
 void                                                    syssocket_setsockopt(int sockfd, bool v4_or_v6);
+bool                                                    syssocket_transparent(int sockfd, bool v4_or_v6, bool stream);
+bool                                                    syssocket_reuseport_bpf(int sockfd, uint32_t sockets);
+bool                                                    syssocket_busy_poll(int sockfd, uint32_t usec, bool stream);
+int                                                     syssocket_mptcp(bool v4_or_v6);
+/* Source address of a transparent upstream socket: the client's own, provided the backend is of the same family
+ * (a v4-mapped client of a dual-stack listener counts as ipv4). */
+template<class TProtocol>
+inline bool                                             transparent_endpoint(
+    const boost::asio::ip::address&                     client_, 
+    const TProtocol&                                    protocol_, 
+    boost::asio::ip::basic_endpoint<TProtocol>&         endpoint_) {
+    boost::asio::ip::address address_ = client_;
+    if (address_.is_v6() && address_.to_v6().is_v4_mapped()) {
+        address_ = address_.to_v6().to_v4();
+    }
+    if (address_.is_v4() != (protocol_ == TProtocol::v4())) {
+        return false;
+    }
+    endpoint_ = boost::asio::ip::basic_endpoint<TProtocol>(address_, 0);
+    return true;
+}
 template<typename T>
 inline void                                             syssocket_setsockopt(T& socket) {
     boost::system::error_code ec_;
@@ -95,6 +216,20 @@ inline void                                             syssocket_setsockopt(T&
     int sockfd = socket.native_handle();
     return syssocket_setsockopt(sockfd, v4_or_v6);
 }
+/* Opens a tcp socket or acceptor as multipath tcp when asked and the kernel has it, plain tcp otherwise. A peer
+ * without MPTCP is served over plain tcp by the kernel itself, on the same socket. */
+template<typename T>
+inline void                                             syssocket_open(T& socket, const boost::asio::ip::tcp& protocol, bool mptcp, boost::system::error_code& ec) {
+    int sockfd = mptcp ? syssocket_mptcp(protocol == boost::asio::ip::tcp::v4()) : -1;
+    if (sockfd != -1) {
+        socket.assign(protocol, sockfd, ec);
+        if (!ec) {
+            return;
+        }
+        ::close(sockfd);
+    }
+    socket.open(protocol, ec);
+}
 bool                                                    write_log(const std::string& path_, const std::string& msg_);
 bool                                                    write_log(boost::asio::posix::stream_descriptor& log_, const std::string& msg_);
 std::shared_ptr<boost::asio::posix::stream_descriptor>  open_log(boost::asio::io_context& context_, const std::string& path_);
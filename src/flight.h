@@ -0,0 +1,86 @@
+#pragma once
+
+/* Layout of the flight recorder dump (options "flight_recorder", "flight_file", written on SIGUSR1), shared with
+ * tools/rinetd-flight: keep it free of boost and bump RINETD_FLIGHT_VERSION on any incompatible change. A dump is a
+ * file header, the rule names, then one chunk per worker: a chunk header followed by the records its ring still
+ * held, oldest first. Integers are in host byte order, addresses are ipv6 with ipv4 v4-mapped. */
+#include <stdint.h>
+#include <string.h>
+
+static char const RINETD_FLIGHT_MAGIC[8]                = { 'R', 'N', 'T', 'D', 'F', 'L', 'T', '\0' };
+static uint32_t const RINETD_FLIGHT_VERSION             = 1;
+static int const RINETD_FLIGHT_RULE_NAME                = 64;
+
+enum {
+    RINETD_FLIGHT_ACCEPT,                               /* tcp client accepted */
+    RINETD_FLIGHT_REFUSE,                               /* client turned away before a backend was tried, see reason */
+    RINETD_FLIGHT_CONNECT,                              /* backend connected, elapsed in us */
+    RINETD_FLIGHT_CONNECT_FAIL,                         /* one backend attempt failed, elapsed in us */
+    RINETD_FLIGHT_CLOSE,                                /* tcp connection closed, elapsed in ms since accept */
+    RINETD_FLIGHT_TUNNEL_OPEN,
+    RINETD_FLIGHT_TUNNEL_CLOSE,                         /* elapsed in ms since the tunnel was created */
+    RINETD_FLIGHT_TUNNEL_MIGRATE,                       /* tunnel moved to the client address recorded, by its QUIC id */
+    RINETD_FLIGHT_MAX,
+};
+
+enum {
+    RINETD_REASON_NONE,
+    RINETD_REASON_CLIENT_CLOSED,
+    RINETD_REASON_BACKEND_CLOSED,
+    RINETD_REASON_CLIENT_ERROR,                         /* error holds the errno */
+    RINETD_REASON_BACKEND_ERROR,
+    RINETD_REASON_TIMEOUT,
+    RINETD_REASON_NO_BACKEND,                           /* none up, or every one tried failed */
+    RINETD_REASON_DENIED,                               /* allow/deny lists */
+    RINETD_REASON_LIMITED,                              /* per-source rate limits */
+    RINETD_REASON_PRESSURE,                             /* memory budget exhausted */
+    RINETD_REASON_FULL,                                 /* udp tunnel table full */
+    RINETD_REASON_IDLE,                                 /* udp_timeout expired */
+    RINETD_REASON_EVICTED,                              /* least recently used tunnel recycled */
+    RINETD_REASON_KILLED,                               /* admin socket "kill" */
+    RINETD_REASON_DRAINING,                             /* new udp client on a draining rule */
+    RINETD_REASON_MAX,
+};
+
+#pragma pack(push, 1)
+typedef struct {
+    char                                                magic[8];
+    uint32_t                                            version;
+    uint32_t                                            record_size;    /* sizeof(rinetd_flight_record) */
+    int32_t                                             pid;
+    uint32_t                                            workers;        /* chunks that follow the rule names */
+    uint32_t                                            rules;          /* names of RINETD_FLIGHT_RULE_NAME bytes */
+    uint32_t                                            reserved;
+    uint64_t                                            dumped;         /* microseconds since the epoch */
+} rinetd_flight_header;
+
+typedef struct {
+    uint32_t                                            worker;
+    uint32_t                                            records;
+    uint64_t                                            events;         /* recorded since start, older ones were overwritten */
+} rinetd_flight_chunk;
+
+typedef struct {
+    uint64_t                                            timestamp;      /* microseconds since the epoch */
+    uint64_t                                            bytes_up;
+    uint64_t                                            bytes_down;
+    uint8_t                                             client[16];
+    uint8_t                                             backend[16];    /* zero before one was picked */
+    uint32_t                                            flow;           /* connection / tunnel serial on the worker, 0 if refused */
+    uint32_t                                            elapsed;
+    int32_t                                             error;
+    uint32_t                                            rule;           /* index into the rule names */
+    uint16_t                                            client_port;
+    uint16_t                                            backend_port;
+    uint8_t                                             type;           /* RINETD_FLIGHT_* */
+    uint8_t                                             reason;         /* RINETD_REASON_* */
+    uint8_t                                             reserved[2];
+} rinetd_flight_record;
+#pragma pack(pop)
+
+inline void                                             flight_header_init(rinetd_flight_header& header_) {
+    memset(&header_, 0, sizeof(header_));
+    memcpy(header_.magic, RINETD_FLIGHT_MAGIC, sizeof(header_.magic));
+    header_.version = RINETD_FLIGHT_VERSION;
+    header_.record_size = sizeof(rinetd_flight_record);
+}
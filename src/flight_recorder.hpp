@@ -0,0 +1,135 @@
+#pragma once
+
+#include <stdafx.h>
+#include <config.h>
+#include <flight.h>
+
+/* Per-worker ring of fixed-size binary records of connection and tunnel lifecycle events (flight.h). Recording is
+ * a handful of plain stores into the next slot, with no formatting, allocation or syscall besides the vdso clock;
+ * once the ring is full the oldest events are overwritten. On SIGUSR1 every worker copies its own ring and the
+ * copies are written to flight_file for tools/rinetd-flight to decode. */
+class flight_recorder {
+public:
+    inline flight_recorder()
+        : mask_(0)
+        , events_(0)
+        , flows_(0) {
+
+    }
+
+public:
+    /* Keeps the last capacity_ events, rounded up to a power of two; 0 leaves the recorder off. */
+    inline void                                             open(uint32_t capacity_) {
+        if (capacity_ < 1) {
+            return;
+        }
+        uint32_t size_ = 1;
+        while (size_ < capacity_ && size_ < (1U << 31)) {
+            size_ <<= 1;
+        }
+        records_.resize(size_);
+        mask_ = size_ - 1;
+    }
+    inline bool                                             enabled() {
+        return !records_.empty();
+    }
+    /* Serial of a new connection or tunnel on this worker, never 0. */
+    inline uint32_t                                         next_flow() {
+        if (++flows_ == 0) {
+            flows_ = 1;
+        }
+        return flows_;
+    }
+    /* Claims the next record and fills in what every event has, the caller adds the rest; NULL when off. */
+    inline rinetd_flight_record*                            add(int type_, int reason_, uint32_t rule_, uint32_t flow_) {
+        if (records_.empty()) {
+            return NULL;
+        }
+        rinetd_flight_record* record_ = &records_[events_++ & mask_];
+        memset(record_, 0, sizeof(*record_));
+        record_->timestamp = GetTickCount(true);
+        record_->flow = flow_;
+        record_->rule = rule_;
+        record_->type = (uint8_t)type_;
+        record_->reason = (uint8_t)reason_;
+        return record_;
+    }
+    template<class TProtocol>
+    inline static void                                      client(rinetd_flight_record* record_, const boost::asio::ip::basic_endpoint<TProtocol>& ep_) {
+        boost::asio::ip::address address_ = ep_.address();
+        if (address_.is_v6()) {
+            boost::asio::ip::address_v6::bytes_type bytes_ = address_.to_v6().to_bytes();
+            memcpy(record_->client, bytes_.data(), sizeof(record_->client));
+        }
+        else {
+            boost::asio::ip::address_v4::bytes_type bytes_ = address_.to_v4().to_bytes();
+            record_->client[10] = 0xff;
+            record_->client[11] = 0xff;
+            memcpy(record_->client + 12, bytes_.data(), 4);
+        }
+        record_->client_port = ep_.port();
+    }
+    inline static void                                      backend(rinetd_flight_record* record_, const ip_address& host_, uint16_t port_) {
+        if (host_.bv6) {
+            memcpy(record_->backend, host_.in6, sizeof(record_->backend));
+        }
+        else {
+            record_->backend[10] = 0xff;
+            record_->backend[11] = 0xff;
+            memcpy(record_->backend + 12, &host_.in4, 4);
+        }
+        record_->backend_port = port_;
+    }
+    /* Appends this ring as a dump chunk, oldest record first; runs on the worker owning the ring. */
+    inline void                                             snapshot(uint32_t worker_, std::string& out_) {
+        uint64_t records_held_ = std::min<uint64_t>(events_, records_.size());
+        rinetd_flight_chunk chunk_;
+        memset(&chunk_, 0, sizeof(chunk_));
+        chunk_.worker = worker_;
+        chunk_.records = (uint32_t)records_held_;
+        chunk_.events = events_;
+
+        out_.reserve(out_.size() + sizeof(chunk_) + records_held_ * sizeof(rinetd_flight_record));
+        out_.append((char*)&chunk_, sizeof(chunk_));
+        for (uint64_t i = events_ - records_held_; i < events_; i++) {
+            out_.append((char*)&records_[i & mask_], sizeof(rinetd_flight_record));
+        }
+    }
+    /* Written under a temporary name and renamed into place, a reader never opens a half written dump. */
+    inline static bool                                      write(const std::string& path_, rinetd_config& config_, const std::vector<std::string>& chunks_) {
+        std::string temp_ = path_ + ".tmp";
+        FILE* file_ = fopen(temp_.data(), "wb");
+        if (!file_) {
+            return false;
+        }
+
+        rinetd_flight_header header_;
+        flight_header_init(header_);
+        header_.pid = getpid();
+        header_.workers = (uint32_t)chunks_.size();
+        header_.rules = (uint32_t)config_.listen_ports.size();
+        header_.dumped = GetTickCount(true);
+        bool ok_ = fwrite(&header_, sizeof(header_), 1, file_) == 1;
+        for (size_t i = 0, l = config_.listen_ports.size(); ok_ && i < l; i++) {
+            listen_port& rule_ = config_.listen_ports[i];
+            char name_[RINETD_FLIGHT_RULE_NAME];
+            memset(name_, 0, sizeof(name_));
+            snprintf(name_, sizeof(name_), "%s %s", rule_.tcp_or_udp ? "tcp" : "udp", to_address(rule_.local_host, rule_.local_port).data());
+            ok_ = fwrite(name_, sizeof(name_), 1, file_) == 1;
+        }
+        for (size_t i = 0, l = chunks_.size(); ok_ && i < l; i++) {
+            ok_ = fwrite(chunks_[i].data(), 1, chunks_[i].size(), file_) == chunks_[i].size();
+        }
+        if (fclose(file_) != 0 || !ok_ || rename(temp_.data(), path_.data()) < 0) {
+            unlink(temp_.data());
+            return false;
+        }
+        return true;
+    }
+
+private:
+    std::vector<rinetd_flight_record>                       records_;
+    uint64_t                                                mask_;
+    uint64_t                                                events_;
+    uint32_t                                                flows_;
+};
@@ -0,0 +1,125 @@
+#pragma once
+
+#include <stdafx.h>
+
+static int const RINETD_HANDLER_SLOT_SIZE               = 256;
+
+/* Operations that missed their owner's slots, all owners together; it should stay flat while traffic flows. */
+inline std::atomic<int64_t>&                                handler_memory_heap() {
+    static std::atomic<int64_t> heap_(0);
+    return heap_;
+}
+
+/* Memory for the pending asynchronous operations of one connection, tunnel or listener. asio allocates each operation
+ * together with its completion handler and frees it just before the handler runs, so an owner keeping at most Slots
+ * operations in flight gets the same blocks back over and over and its steady state never reaches malloc. A block too
+ * large for a slot, or one more operation than there are slots, is served by the heap and counted. */
+template<int Slots>
+class handler_memory {
+public:
+    inline handler_memory()
+        : used_(0) {
+
+    }
+    handler_memory(const handler_memory&) = delete;
+    handler_memory&                                         operator=(const handler_memory&) = delete;
+
+public:
+    inline void*                                            allocate(size_t size_) {
+        if (size_ <= (size_t)RINETD_HANDLER_SLOT_SIZE) {
+            for (int i = 0; i < Slots; i++) {
+                if (!(used_ & (1U << i))) {
+                    used_ |= 1U << i;
+                    return &slots_[i];
+                }
+            }
+        }
+        handler_memory_heap().fetch_add(1, std::memory_order_relaxed);
+        return ::operator new(size_);
+    }
+    inline void                                             deallocate(void* p) {
+        for (int i = 0; i < Slots; i++) {
+            if (p == &slots_[i]) {
+                used_ &= ~(1U << i);
+                return;
+            }
+        }
+        ::operator delete(p);
+    }
+
+private:
+    typename std::aligned_storage<RINETD_HANDLER_SLOT_SIZE>::type slots_[Slots];
+    uint32_t                                                used_;
+};
+
+/* The allocator asio finds through the handler's get_allocator(), for the operation wrapping the handler. */
+template<typename T, typename Memory>
+class handler_allocator {
+    template<typename U, typename M> friend class handler_allocator;
+
+public:
+    typedef T                                               value_type;
+
+public:
+    inline explicit handler_allocator(Memory& memory_)
+        : memory_(memory_) {
+
+    }
+    template<typename U>
+    inline handler_allocator(const handler_allocator<U, Memory>& other_)
+        : memory_(other_.memory_) {
+
+    }
+
+public:
+    inline T*                                               allocate(size_t n) {
+        return static_cast<T*>(memory_.allocate(sizeof(T) * n));
+    }
+    inline void                                             deallocate(T* p, size_t) {
+        memory_.deallocate(p);
+    }
+    template<typename U>
+    inline bool                                             operator==(const handler_allocator<U, Memory>& other_) const {
+        return &memory_ == &other_.memory_;
+    }
+    template<typename U>
+    inline bool                                             operator!=(const handler_allocator<U, Memory>& other_) const {
+        return &memory_ != &other_.memory_;
+    }
+
+private:
+    Memory&                                                 memory_;
+};
+
+/* A completion handler bound to the memory its operation is allocated from. */
+template<typename Handler, typename Memory>
+class memory_handler {
+public:
+    typedef handler_allocator<Handler, Memory>              allocator_type;
+
+public:
+    inline memory_handler(Memory& memory_, Handler&& handler_)
+        : memory_(memory_)
+        , handler_(std::move(handler_)) {
+
+    }
+
+public:
+    inline allocator_type                                   get_allocator() const {
+        return allocator_type(memory_);
+    }
+    template<typename... Args>
+    inline void                                             operator()(Args&&... args) {
+        handler_(std::forward<Args>(args)...);
+    }
+
+private:
+    Memory&                                                 memory_;
+    Handler                                                 handler_;
+};
+
+template<typename Memory, typename Handler>
+inline memory_handler<typename std::decay<Handler>::type, Memory> with_memory(Memory& memory_, Handler&& handler_) {
+    typedef typename std::decay<Handler>::type handler_type;
+    return memory_handler<handler_type, Memory>(memory_, handler_type(std::forward<Handler>(handler_)));
+}
@@ -0,0 +1,283 @@
+#pragma once
+
+#include <stdafx.h>
+#include <config.h>
+#include <worker.hpp>
+
+/* Health of one backend, shared by every rule and worker forwarding to it. Workers read it lock-free on every new
+ * client; active probes (health_checker, worker 0) and passive connect failures from any worker update it. */
+class backend_state {
+    friend class health_checker;
+
+public:
+    inline backend_state(bool tcp_or_udp, const ip_address& host_, uint16_t port_, const health_options& options_)
+        : tcp_or_udp_(tcp_or_udp)
+        , host_(host_)
+        , port_(port_)
+        , options_(options_)
+        , up_(true)
+        , failures_(0)
+        , down_until_(0)
+        , probing_(false)
+        , probe_failures_(0)
+        , next_probe_(0)
+        , reported_up_(true) {
+
+    }
+
+public:
+    inline const ip_address&                                host() {
+        return host_;
+    }
+    inline uint16_t                                         port() {
+        return port_;
+    }
+    inline std::string                                      key() {
+        return (tcp_or_udp_ ? "tcp/" : "udp/") + to_address(host_, port_);
+    }
+    inline bool                                             is_up(uint64_t now) {
+        if (up_.load(std::memory_order_relaxed)) {
+            return true;
+        }
+        /* Without active probes an ejected backend is retried once its ejection expires; one more failure ejects it again. */
+        return options_.check == RINETD_CHECK_NONE && now >= down_until_.load(std::memory_order_relaxed);
+    }
+    inline void                                             report_success() {
+        if (failures_.load(std::memory_order_relaxed) != 0) {
+            failures_.store(0, std::memory_order_relaxed);
+        }
+        if (options_.check == RINETD_CHECK_NONE && !up_.load(std::memory_order_relaxed)) {
+            up_.store(true, std::memory_order_relaxed);
+        }
+    }
+    inline void                                             report_failure(uint64_t now) {
+        uint32_t failures = failures_.fetch_add(1, std::memory_order_relaxed) + 1;
+        if (options_.fail_threshold > 0 && failures >= options_.fail_threshold) {
+            down_until_.store(now + options_.eject_time, std::memory_order_relaxed);
+            up_.store(false, std::memory_order_relaxed);
+        }
+    }
+
+    /* Index of the first backend at or after start (wrapping) that may take new clients, -1 when all are down. */
+    inline static int                                       select(std::vector<std::shared_ptr<backend_state> >& backends_, size_t start_, size_t count_, uint64_t now) {
+        size_t size_ = backends_.size();
+        for (size_t i = 0; i < count_ && i < size_; i++) {
+            size_t index_ = (start_ + i) % size_;
+            if (backends_[index_]->is_up(now)) {
+                return (int)index_;
+            }
+        }
+        return -1;
+    }
+
+private:
+    bool                                                    tcp_or_udp_;
+    ip_address                                              host_;
+    uint16_t                                                port_;
+    health_options                                          options_;
+    std::atomic<bool>                                       up_;
+    std::atomic<uint32_t>                                   failures_;
+    std::atomic<uint64_t>                                   down_until_;
+    bool                                                    probing_;
+    uint32_t                                                probe_failures_;
+    uint64_t                                                next_probe_;
+    bool                                                    reported_up_;
+};
+typedef std::shared_ptr<backend_state>                      backend_state_ptr;
+typedef std::vector<backend_state_ptr>                      backend_state_list;
+
+/* One timer on one worker drives the probes of every backend, so thousands of rules cost a single wakeup per tick. */
+class health_checker : public std::enable_shared_from_this<health_checker> {
+    class health_probe : public std::enable_shared_from_this<health_probe> {
+    public:
+        inline health_probe(const std::shared_ptr<health_checker>& checker_, const backend_state_ptr& backend_)
+            : enable_shared_from_this()
+            , checker_(checker_)
+            , backend_(backend_)
+            , timeout_(checker_->context_)
+            , tcp_socket_(checker_->context_)
+            , udp_socket_(checker_->context_)
+            , completed_(false) {
+
+        }
+
+    public:
+        inline void                                         run() {
+            std::shared_ptr<health_probe> self = shared_from_this();
+            timeout_.expires_from_now(boost::posix_time::milliseconds(backend_->options_.timeout));
+            timeout_.async_wait([self, this](const boost::system::error_code& ec) {
+                if (ec != boost::system::errc::operation_canceled) {
+                    complete(false);
+                }
+            });
+
+            boost::system::error_code ec;
+            if (backend_->options_.check == RINETD_CHECK_UDP) {
+                boost::asio::ip::udp::endpoint remoteEP = to_endpoint<boost::asio::ip::udp>(backend_->host_, backend_->port_);
+                udp_socket_.open(remoteEP.protocol(), ec);
+                if (!ec) {
+                    udp_socket_.connect(remoteEP, ec);
+                }
+                if (!ec) {
+                    std::string& send_ = backend_->options_.send;
+                    udp_socket_.send(boost::asio::buffer(send_.data(), send_.size()), 0, ec);
+                }
+                if (ec) {
+                    complete(false);
+                    return;
+                }
+                udp_socket_.async_receive(boost::asio::buffer(buf_, sizeof(buf_)),
+                    [self, this](const boost::system::error_code& ec, std::size_t sz) {
+                        complete(!ec && is_expected(sz));
+                    });
+                return;
+            }
+
+            boost::asio::ip::tcp::endpoint remoteEP = to_endpoint<boost::asio::ip::tcp>(backend_->host_, backend_->port_);
+            tcp_socket_.async_connect(remoteEP, [self, this](const boost::system::error_code& ec) {
+                std::string& send_ = backend_->options_.send;
+                std::string& expect_ = backend_->options_.expect;
+                if (ec || (send_.empty() && expect_.empty())) {
+                    complete(!ec);
+                    return;
+                }
+                boost::asio::async_write(tcp_socket_, boost::asio::buffer(send_.data(), send_.size()),
+                    [self, this](const boost::system::error_code& ec, std::size_t sz) {
+                        std::string& expect_ = backend_->options_.expect;
+                        if (ec || expect_.empty()) {
+                            complete(!ec);
+                            return;
+                        }
+                        boost::asio::async_read(tcp_socket_, boost::asio::buffer(buf_, std::min<size_t>(sizeof(buf_), expect_.size())),
+                            [self, this](const boost::system::error_code& ec, std::size_t sz) {
+                                complete(!ec && is_expected(sz));
+                            });
+                    });
+            });
+        }
+
+    private:
+        inline bool                                         is_expected(std::size_t sz) {
+            std::string& expect_ = backend_->options_.expect;
+            return sz >= std::min<size_t>(sizeof(buf_), expect_.size()) && memcmp(buf_, expect_.data(), std::min<size_t>(sz, expect_.size())) == 0;
+        }
+        inline void                                         complete(bool success) {
+            if (completed_) {
+                return;
+            }
+            completed_ = true;
+
+            boost::system::error_code ec;
+            timeout_.cancel(ec);
+            tcp_socket_.close(ec);
+            udp_socket_.close(ec);
+            checker_->probe_completed(backend_, success);
+        }
+
+    private:
+        std::shared_ptr<health_checker>                     checker_;
+        backend_state_ptr                                   backend_;
+        boost::asio::deadline_timer                         timeout_;
+        boost::asio::ip::tcp::socket                        tcp_socket_;
+        boost::asio::ip::udp::socket                        udp_socket_;
+        bool                                                completed_;
+        char                                                buf_[512];
+    };
+
+public:
+    inline health_checker(rinetd_worker& worker_)
+        : enable_shared_from_this()
+        , worker_(worker_)
+        , context_(worker_.context())
+        , timer_(context_) {
+
+    }
+
+public:
+    /* Rules forwarding to the same backend share its state; the options of the first rule registering it apply. */
+    inline backend_state_ptr                                add(bool tcp_or_udp, const ip_address& host_, uint16_t port_, const health_options& options_) {
+        std::string key_ = (tcp_or_udp ? "tcp/" : "udp/") + to_address(host_, port_);
+        std::unordered_map<std::string, backend_state_ptr>::iterator it = backends_.find(key_);
+        if (it != backends_.end()) {
+            return it->second;
+        }
+        backend_state_ptr backend_ = make_shared_object<backend_state>(tcp_or_udp, host_, port_, options_);
+        backends_.insert(std::make_pair(key_, backend_));
+        return backend_;
+    }
+    inline backend_state_list                               add(listen_port& forward_) {
+        backend_state_list backends_;
+        for (size_t i = 0, l = forward_.remote_hosts.size(); i < l; i++) {
+            backends_.push_back(add(forward_.tcp_or_udp, forward_.remote_hosts[i], forward_.remote_port, forward_.health));
+        }
+        return backends_;
+    }
+    /* State derived from backend health (e.g. a rule's maglev table) is refreshed here after every tick's probes. */
+    inline void                                             watch(const std::function<void(uint64_t)>& watcher_) {
+        watchers_.push_back(watcher_);
+    }
+    inline void                                             run() {
+        std::shared_ptr<health_checker> self = shared_from_this();
+        timer_.expires_from_now(boost::posix_time::milliseconds(RINETD_HEALTH_CHECK_TICK));
+        timer_.async_wait([self, this](const boost::system::error_code& ec) {
+            if (!ec) {
+                next_tick(GetTickCount(false));
+                run();
+            }
+        });
+    }
+
+private:
+    inline void                                             next_tick(uint64_t now) {
+        std::unordered_map<std::string, backend_state_ptr>::iterator tail = backends_.begin();
+        std::unordered_map<std::string, backend_state_ptr>::iterator endl = backends_.end();
+        for (; tail != endl; tail++) {
+            backend_state_ptr& backend_ = tail->second;
+            report(backend_, backend_->up_.load(std::memory_order_relaxed));
+            if (backend_->options_.check == RINETD_CHECK_NONE || backend_->probing_ || now < backend_->next_probe_) {
+                continue;
+            }
+            backend_->probing_ = true;
+            backend_->next_probe_ = now + backend_->options_.interval;
+
+            std::shared_ptr<health_probe> probe_ = make_shared_object<health_probe>(shared_from_this(), backend_);
+            probe_->run();
+        }
+        for (size_t i = 0, l = watchers_.size(); i < l; i++) {
+            watchers_[i](now);
+        }
+    }
+    inline void                                             probe_completed(const backend_state_ptr& backend_, bool success) {
+        backend_->probing_ = false;
+        if (success) {
+            backend_->probe_failures_ = 0;
+            backend_->failures_.store(0, std::memory_order_relaxed);
+            backend_->up_.store(true, std::memory_order_relaxed);
+        }
+        else if (++backend_->probe_failures_ >= backend_->options_.fall) {
+            backend_->up_.store(false, std::memory_order_relaxed);
+        }
+        report(backend_, backend_->up_.load(std::memory_order_relaxed));
+    }
+    inline void                                             report(const backend_state_ptr& backend_, bool up) {
+        if (backend_->reported_up_ == up) {
+            return;
+        }
+        backend_->reported_up_ = up;
+
+        std::string sb = "backend " + backend_->key() + (up ? " up" : " down");
+        if (worker_.log()) {
+            write_log(*worker_.log().get(), sb);
+        }
+        else {
+            write_log(worker_.config().log_var, sb);
+        }
+    }
+
+private:
+    rinetd_worker&                                          worker_;
+    boost::asio::io_context&                                context_;
+    boost::asio::deadline_timer                             timer_;
+    std::unordered_map<std::string, backend_state_ptr>      backends_;
+    std::vector<std::function<void(uint64_t)> >             watchers_;
+};
\ No newline at end of file
@@ -0,0 +1,115 @@
+#pragma once
+
+#include <stdafx.h>
+
+/* Intrusive doubly linked list: elements derive from linked_list_node, so link/unlink/move never allocate. */
+struct linked_list_node {
+    linked_list_node*                                       prev;
+    linked_list_node*                                       next;
+    bool                                                    cursor;
+
+    inline linked_list_node()
+        : prev(NULL)
+        , next(NULL)
+        , cursor(false) {
+
+    }
+};
+
+/* A cursor is a placeholder node parked behind the last element visited, so a walk can be resumed later even if
+ * elements around it were unlinked meanwhile; cursors are skipped by every other traversal and not counted. */
+template<typename T>
+class linked_list {
+public:
+    inline linked_list()
+        : count_(0) {
+        head_.prev = &head_;
+        head_.next = &head_;
+    }
+
+public:
+    inline bool                                             empty() {
+        return count_ == 0;
+    }
+    inline size_t                                           size() {
+        return count_;
+    }
+    inline T*                                               front() {
+        return element(skip(head_.next));
+    }
+    inline T*                                               next(T* node) {
+        return element(skip(static_cast<linked_list_node*>(node)->next));
+    }
+    inline bool                                             contains(T* node) {
+        return static_cast<linked_list_node*>(node)->next != NULL;
+    }
+    inline void                                             push_back(T* node) {
+        link_before(&head_, static_cast<linked_list_node*>(node));
+        count_++;
+    }
+    inline void                                             remove(T* node) {
+        linked_list_node* node_ = static_cast<linked_list_node*>(node);
+        if (node_->next == NULL) {
+            return;
+        }
+        unlink(node_);
+        count_--;
+    }
+    inline void                                             move_to_back(T* node) {
+        linked_list_node* node_ = static_cast<linked_list_node*>(node);
+        if (node_->next == NULL || node_->next == &head_) {
+            return;
+        }
+        remove(node);
+        push_back(node);
+    }
+    inline void                                             cursor_begin(linked_list_node& cursor_) {
+        cursor_end(cursor_);
+        cursor_.cursor = true;
+        link_before(head_.next, &cursor_);
+    }
+    inline T*                                               cursor_next(linked_list_node& cursor_) {
+        if (cursor_.next == NULL) {
+            return NULL;
+        }
+        linked_list_node* node_ = skip(cursor_.next);
+        if (node_ == &head_) {
+            return NULL;
+        }
+        unlink(&cursor_);
+        link_before(node_->next, &cursor_);
+        return static_cast<T*>(node_);
+    }
+    inline void                                             cursor_end(linked_list_node& cursor_) {
+        if (cursor_.next != NULL) {
+            unlink(&cursor_);
+        }
+    }
+
+private:
+    inline linked_list_node*                                skip(linked_list_node* node_) {
+        while (node_ != &head_ && node_->cursor) {
+            node_ = node_->next;
+        }
+        return node_;
+    }
+    inline T*                                               element(linked_list_node* node_) {
+        return node_ == &head_ ? NULL : static_cast<T*>(node_);
+    }
+    inline static void                                      link_before(linked_list_node* at_, linked_list_node* node_) {
+        node_->prev = at_->prev;
+        node_->next = at_;
+        at_->prev->next = node_;
+        at_->prev = node_;
+    }
+    inline static void                                      unlink(linked_list_node* node_) {
+        node_->prev->next = node_->next;
+        node_->next->prev = node_->prev;
+        node_->prev = NULL;
+        node_->next = NULL;
+    }
+
+private:
+    linked_list_node                                        head_;
+    size_t                                                  count_;
+};
@@ -0,0 +1,128 @@
+#pragma once
+
+#include <stdafx.h>
+#include <config.h>
+#include <health_check.hpp>
+
+/* Maglev lookup table of one rule: a client address hashes to a slot and the slot names the backend, so the same
+ * client lands on the same backend from every worker and, since a backend's permutation depends on its address
+ * only, from every rule listing the same backends in the same order. Removing a backend only moves the clients
+ * that were on it (plus a small fraction of the rest); adding one moves about 1/N of the clients.
+ *
+ * The table is built over the backends that are up. Workers read it lock-free; the health checker (worker 0)
+ * rebuilds the spare buffer when the set of live backends changes and publishes it with one pointer store. A
+ * worker holds the pointer only for a single load, and rebuilds are at least one scheduler tick apart, so the
+ * buffer being overwritten is never the one a lookup can still be reading. */
+class maglev_table {
+public:
+    inline maglev_table(const backend_state_list& backends_)
+        : backends_(backends_)
+        , current_(0) {
+        for (size_t i = 0, l = backends_.size(); i < l; i++) {
+            uint64_t hash_ = hash(backends_[i]->host());
+            offsets_.push_back((uint32_t)(hash_ % RINETD_MAGLEV_TABLE_SIZE));
+            skips_.push_back((uint32_t)((hash_ >> 32) % (RINETD_MAGLEV_TABLE_SIZE - 1)) + 1);
+        }
+        rebuild(GetTickCount(false), true);
+    }
+
+public:
+    /* Backend index of the client; the caller still checks that backend, it may have gone down since the last rebuild. */
+    inline int                                              lookup(const boost::asio::ip::address& client_) {
+        const std::vector<int16_t>* entries_ = entries_ptr_.load(std::memory_order_acquire);
+        return (*entries_)[hash(client_) % RINETD_MAGLEV_TABLE_SIZE];
+    }
+    /* Called on the health checker's tick; returns true when a new table was published. */
+    inline bool                                             rebuild(uint64_t now, bool force = false) {
+        std::vector<bool> up_(backends_.size());
+        for (size_t i = 0, l = backends_.size(); i < l; i++) {
+            up_[i] = backends_[i]->is_up(now);
+        }
+        if (!force && up_ == up_mask_) {
+            return false;
+        }
+        up_mask_ = up_;
+
+        int spare_ = current_ ^ 1;
+        populate(entries_[spare_]);
+        entries_ptr_.store(&entries_[spare_], std::memory_order_release);
+        current_ = spare_;
+        return true;
+    }
+
+public:
+    inline static uint64_t                                  hash(const ip_address& host_) {
+        if (host_.bv6) {
+            return hash(host_.in6, sizeof(host_.in6));
+        }
+        return hash(&host_.in4, sizeof(host_.in4));
+    }
+    /* A v4-mapped client seen by a dual-stack listener hashes like the same client seen by a v4 listener. */
+    inline static uint64_t                                  hash(const boost::asio::ip::address& address_) {
+        if (address_.is_v6() && !address_.to_v6().is_v4_mapped()) {
+            boost::asio::ip::address_v6::bytes_type bytes_ = address_.to_v6().to_bytes();
+            return hash(bytes_.data(), bytes_.size());
+        }
+        boost::asio::ip::address_v4::bytes_type bytes_ = address_.is_v6() ?
+            address_.to_v6().to_v4().to_bytes() : address_.to_v4().to_bytes();
+        return hash(bytes_.data(), bytes_.size());
+    }
+
+private:
+    inline static uint64_t                                  hash(const void* data_, size_t size_) {
+        const uint8_t* p_ = (const uint8_t*)data_;
+        uint64_t h_ = 14695981039346656037ULL;
+        for (size_t i = 0; i < size_; i++) {
+            h_ = (h_ ^ p_[i]) * 1099511628211ULL;
+        }
+        h_ ^= h_ >> 33;
+        h_ *= 0xff51afd7ed558ccdULL;
+        h_ ^= h_ >> 33;
+        h_ *= 0xc4ceb9fe1a85ec53ULL;
+        h_ ^= h_ >> 33;
+        return h_;
+    }
+    /* Backends take turns claiming the next free slot of their own permutation until the table is full. With no
+     * backend up every backend is entered anyway, the workers then fail over from the slot like in failover mode. */
+    inline void                                             populate(std::vector<int16_t>& entries_) {
+        std::vector<size_t> members_;
+        for (size_t i = 0, l = backends_.size(); i < l; i++) {
+            if (up_mask_[i]) {
+                members_.push_back(i);
+            }
+        }
+        if (members_.empty()) {
+            for (size_t i = 0, l = backends_.size(); i < l; i++) {
+                members_.push_back(i);
+            }
+        }
+
+        entries_.assign(RINETD_MAGLEV_TABLE_SIZE, -1);
+        std::vector<uint32_t> next_(members_.size(), 0);
+        for (size_t filled_ = 0; ;) {
+            for (size_t n = 0, m = members_.size(); n < m; n++) {
+                size_t i = members_[n];
+                uint32_t slot_;
+                do {
+                    slot_ = (uint32_t)((offsets_[i] + (uint64_t)next_[n] * skips_[i]) % RINETD_MAGLEV_TABLE_SIZE);
+                    next_[n]++;
+                } while (entries_[slot_] >= 0);
+
+                entries_[slot_] = (int16_t)i;
+                if (++filled_ == (size_t)RINETD_MAGLEV_TABLE_SIZE) {
+                    return;
+                }
+            }
+        }
+    }
+
+private:
+    backend_state_list                                      backends_;
+    std::vector<uint32_t>                                   offsets_;
+    std::vector<uint32_t>                                   skips_;
+    std::vector<bool>                                       up_mask_;
+    std::vector<int16_t>                                    entries_[2];
+    std::atomic<const std::vector<int16_t>*>                entries_ptr_;
+    int                                                     current_;
+};
+typedef std::shared_ptr<maglev_table>                       maglev_table_ptr;
@@ -3,43 +3,448 @@
 #include <limits.h>
 #include <stdafx.h>
 #include <config.h>
+#include <upgrade.h>
+#include <worker.hpp>
+#include <sockmap.h>
+#include <stats.h>
+#include <admin.hpp>
+#include <health_check.hpp>
+#include <memory_budget.hpp>
 #include <tcp_forward.hpp>
 #include <udp_forward.hpp>
 
 static std::vector<std::shared_ptr<tcp_forward>> g_tcp_forwards;
 static std::vector<std::shared_ptr<udp_forward>> g_udp_forwards;
-static boost::asio::io_context context_;
+static std::vector<std::shared_ptr<rinetd_worker>> g_workers;
+static std::shared_ptr<health_checker> g_health_checker_;
+#ifndef _WIN32
+static std::shared_ptr<admin_server> g_admin_;
+#endif
+static rinetd_config* g_config_ = NULL;
+static std::shared_ptr<boost::asio::posix::stream_descriptor> g_log_;
+static std::string g_binary_path_;
+static const char** g_argv_ = NULL;
 
 #ifndef _WIN32
+static void
+do_exit(int code) {
+    /* Worker threads may still be inside handlers, leave without running static destructors underneath them. */
+    for (size_t i = 0, l = g_workers.size(); i < l; i++) {
+        g_workers[i]->stop();
+    }
+    _exit(code);
+}
+
 static void
 do_signal(int signo) {
     if (signo != SIGHUP) {
-        context_.stop();
-        exit(0);
+        do_exit(0);
+    }
+}
+#endif
+
+static void
+log_message(const std::string& msg_) {
+    if (g_log_) {
+        write_log(*g_log_.get(), msg_);
+    }
+    else if (g_config_) {
+        write_log(g_config_->log_var, msg_);
+    }
+}
+
+#ifndef _WIN32
+static std::shared_ptr<boost::asio::posix::stream_descriptor> g_upgrade_;
+static std::shared_ptr<boost::asio::deadline_timer>           g_upgrade_timeout_;
+static std::vector<inherited_listener>                        g_upgrade_listeners_;
+static size_t                                                 g_upgrade_next_ = 0;
+static int                                                    g_upgrade_pid_ = -1;
+
+static void
+do_drain(const std::shared_ptr<boost::asio::deadline_timer>& timer_) {
+    if (tcp_forward::connection_count() < 1 && udp_forward::tunnel_count() < 1) {
+        log_message("upgrade: all sessions drained, exiting");
+        do_exit(0);
+    }
+    timer_->expires_from_now(boost::posix_time::seconds(1));
+    timer_->async_wait([timer_](const boost::system::error_code& ec) {
+        if (!ec) {
+            do_drain(timer_);
+        }
+    });
+}
+
+static void
+abandon_upgrade(const std::string& why_) {
+    boost::system::error_code ec_;
+    g_upgrade_timeout_->cancel(ec_);
+    g_upgrade_->close(ec_);
+    g_upgrade_.reset();
+    g_upgrade_listeners_.clear();
+    if (g_upgrade_pid_ > 0) {
+        kill(g_upgrade_pid_, SIGKILL);
+    }
+    log_message("upgrade: " + why_ + ", keep serving");
+}
+
+static void
+wait_successor() {
+    /* Keep accepting until the successor reports that it serves every listener, so no SYN is left unanswered. */
+    static char ack_;
+    g_upgrade_->async_read_some(boost::asio::buffer(&ack_, 1), [](const boost::system::error_code& ec, std::size_t sz) {
+        boost::system::error_code ec_;
+        g_upgrade_->close(ec_);
+        if (ec || sz < 1) {
+            g_upgrade_.reset();
+            log_message("upgrade: successor exited before taking over, keep serving");
+            return;
+        }
+        for (size_t i = 0, l = g_tcp_forwards.size(); i < l; i++) {
+            std::shared_ptr<tcp_forward> forward_ = g_tcp_forwards[i];
+            boost::asio::post(forward_->context(), [forward_] {
+                forward_->drain();
+            });
+        }
+        for (size_t i = 0, l = g_udp_forwards.size(); i < l; i++) {
+            std::shared_ptr<udp_forward> forward_ = g_udp_forwards[i];
+            boost::asio::post(forward_->context(), [forward_] {
+                forward_->hand_over();
+            });
+        }
+        log_message("upgrade: successor is serving, draining existing sessions");
+        do_drain(make_shared_object<boost::asio::deadline_timer>(g_workers[0]->context()));
+    });
+}
+
+/* Worker 0 also checks health, answers the admin socket and relays, so the listeners go out whenever the channel takes
+ * them rather than in a blocking loop a slow successor could stall. */
+static void
+send_listeners() {
+    int sent_ = upgrade_send_listeners(g_upgrade_->native_handle(), g_upgrade_listeners_, g_upgrade_next_);
+    if (sent_ < 0) {
+        abandon_upgrade("unable to hand the listeners to " + g_binary_path_);
+        return;
+    }
+    if (sent_ == 0) {
+        g_upgrade_->async_wait(boost::asio::posix::stream_descriptor::wait_write, [](const boost::system::error_code& ec) {
+            if (!ec && g_upgrade_) {
+                send_listeners();
+            }
+        });
+        return;
+    }
+
+    boost::system::error_code ec_;
+    g_upgrade_timeout_->cancel(ec_);
+    log_message("upgrade: handed " + std::to_string(g_upgrade_listeners_.size()) + " listeners to " + g_binary_path_);
+    g_upgrade_listeners_.clear();
+    wait_successor();
+}
+
+static void
+do_upgrade() {
+    if (g_upgrade_ || g_binary_path_.empty()) {
+        return;
+    }
+    g_upgrade_listeners_.clear();
+    for (size_t i = 0, l = g_tcp_forwards.size(); i < l; i++) {
+        g_upgrade_listeners_.push_back(g_tcp_forwards[i]->listener());
     }
+    for (size_t i = 0, l = g_udp_forwards.size(); i < l; i++) {
+        g_upgrade_listeners_.push_back(g_udp_forwards[i]->listener());
+    }
+
+    int channel_ = upgrade_spawn(g_binary_path_, g_argv_, g_upgrade_pid_);
+    if (channel_ == -1) {
+        log_message("upgrade: unable to start " + g_binary_path_);
+        return;
+    }
+
+    boost::asio::io_context& context_ = g_workers[0]->context();
+    g_upgrade_ = make_shared_object<boost::asio::posix::stream_descriptor>(context_, channel_);
+    g_upgrade_next_ = 0;
+    g_upgrade_timeout_ = make_shared_object<boost::asio::deadline_timer>(context_);
+    g_upgrade_timeout_->expires_from_now(boost::posix_time::seconds(RINETD_UPGRADE_HANDOVER));
+    g_upgrade_timeout_->async_wait([](const boost::system::error_code& ec) {
+        if (!ec && g_upgrade_ && !g_upgrade_listeners_.empty()) {
+            abandon_upgrade("successor did not take the listeners within " + std::to_string(RINETD_UPGRADE_HANDOVER) + "s");
+        }
+    });
+    send_listeners();
+}
+
+static bool g_flight_dumping_ = false;
+
+/* Every worker copies its own ring on its own thread, worker 0 writes the copies out once all are in. */
+static void
+do_flight_dump() {
+    if (g_flight_dumping_ || g_config_->flight_records < 1) {
+        return;
+    }
+    g_flight_dumping_ = true;
+
+    size_t worker_count_ = g_workers.size();
+    std::shared_ptr<std::vector<std::string> > chunks_ = make_shared_object<std::vector<std::string> >(worker_count_);
+    std::shared_ptr<size_t> pending_ = make_shared_object<size_t>(worker_count_);
+    for (size_t i = 0; i < worker_count_; i++) {
+        std::shared_ptr<rinetd_worker> worker_ = g_workers[i];
+        boost::asio::post(worker_->context(), [worker_, i, chunks_, pending_] {
+            worker_->flight().snapshot((uint32_t)i, (*chunks_)[i]);
+            boost::asio::post(g_workers[0]->context(), [chunks_, pending_] {
+                if (--*pending_ > 0) {
+                    return;
+                }
+                g_flight_dumping_ = false;
+
+                std::string& path_ = g_config_->flight_file;
+                size_t records_ = 0;
+                for (size_t n = 0, l = chunks_->size(); n < l; n++) {
+                    records_ += ((*chunks_)[n].size() - sizeof(rinetd_flight_chunk)) / sizeof(rinetd_flight_record);
+                }
+                if (flight_recorder::write(path_, *g_config_, *chunks_)) {
+                    log_message("flight: " + std::to_string(records_) + " events written to " + path_);
+                }
+                else {
+                    log_message("flight: unable to write " + path_);
+                }
+            });
+        });
+    }
+}
+
+static void
+wait_signals(const std::shared_ptr<boost::asio::signal_set>& signals_) {
+    signals_->async_wait([signals_](const boost::system::error_code& ec, int signo) {
+        if (ec) {
+            return;
+        }
+        if (signo == SIGUSR1) {
+            do_flight_dump();
+        }
+        else {
+            do_upgrade();
+        }
+        wait_signals(signals_);
+    });
 }
 #endif
 
+static bool
+transparent_available(listen_port& listen_port_) {
+    #ifdef _WIN32
+    return false;
+    #else
+    bool v4_or_v6 = !listen_port_.remote_host.bv6;
+    int sockfd = socket(v4_or_v6 ? AF_INET : AF_INET6, listen_port_.tcp_or_udp ? SOCK_STREAM : SOCK_DGRAM, 0);
+    if (sockfd < 0) {
+        return false;
+    }
+    bool available_ = syssocket_transparent(sockfd, v4_or_v6, listen_port_.tcp_or_udp);
+    close(sockfd);
+    return available_;
+    #endif
+}
+
+/* Opens, binds and listens one worker's share of the listeners. */
+static void
+run_worker_ports(std::vector<std::shared_ptr<tcp_forward> >& tcp_forwards_, std::vector<char>& tcp_ok_,
+    std::vector<std::shared_ptr<udp_forward> >& udp_forwards_, std::vector<char>& udp_ok_) {
+    for (size_t i = 0, l = tcp_forwards_.size(); i < l; i++) {
+        tcp_ok_[i] = tcp_forwards_[i]->run();
+    }
+    for (size_t i = 0, l = udp_forwards_.size(); i < l; i++) {
+        udp_ok_[i] = udp_forwards_[i]->run();
+    }
+}
+
+static void
+report_port_failure(std::set<std::string>& reported_, listen_port& listen_port_, const std::string& error_) {
+    /* Every worker of a tcp rule fails the same way, one line per rule is enough. */
+    std::string key_ = listener_key(listen_port_.tcp_or_udp, listen_port_.local_host, listen_port_.local_port);
+    if (reported_.insert(key_).second) {
+        log_message("startup: unable to listen on " + key_ + (error_.empty() ? "" : " (" + error_ + ")"));
+    }
+}
+
 static void 
-run_all_ports(rinetd_config& config_, const std::shared_ptr<boost::asio::posix::stream_descriptor>& log_) {
+run_all_ports(rinetd_config& config_) {
     std::vector<listen_port>& list = config_.listen_ports;
+    uint64_t started_ = GetTickCount(false);
+    g_health_checker_ = make_shared_object<health_checker>(*g_workers[0]);
+    acl_table_ptr global_acl_;
+    if (!config_.acl.empty()) {
+        global_acl_ = acl_table::compile(config_.acl);
+    }
+
+    /* busy_poll rules get all their listeners on the polling worker, the last one, and the other workers never see them.
+     * A quic rule is served by a single worker as well, the reuseport hash would send a migrated client to another
+     * worker, whose tunnels do not know its connection ids, and so is a udp rule on a socket passed in without
+     * SO_REUSEPORT, which no other worker can bind next to; these rules are spread over the workers by index. */
+    size_t worker_count_ = g_workers.size();
+    size_t shared_count_ = (size_t)config_.workers;
+    size_t busy_rules_ = 0;
+    size_t mptcp_rules_ = 0;
+    std::vector<std::vector<std::shared_ptr<tcp_forward> > > tcp_forwards_(worker_count_);
+    std::vector<std::vector<std::shared_ptr<udp_forward> > > udp_forwards_(worker_count_);
     for (size_t i = 0, l = list.size(); i < l; i++) {
         listen_port& listen_port_ = list[i];
+        backend_state_list backends_ = g_health_checker_->add(listen_port_);
+        if (listen_port_.transparent && !transparent_available(listen_port_)) {
+            listen_port_.transparent = false;
+            log_message("transparent: " + to_address(listen_port_.local_host, listen_port_.local_port) + 
+                " forwards from the local address, IP_TRANSPARENT needs CAP_NET_ADMIN");
+        }
+        if (!listen_port_.mirror_file.empty() && !mirror_sink::prepare(listen_port_)) {
+            log_message("mirror: unable to create " + listen_port_.mirror_file + ", " + 
+                to_address(listen_port_.local_host, listen_port_.local_port) + " is not mirrored");
+            listen_port_.mirror_file.clear();
+        }
+        acl_table_ptr acl_ = global_acl_;
+        if (!listen_port_.acl.empty()) {
+            std::vector<acl_entry> entries_(config_.acl);
+            entries_.insert(entries_.end(), listen_port_.acl.begin(), listen_port_.acl.end());
+            acl_ = acl_table::compile(entries_);
+        }
+        rate_limiter_ptr limiter_;
+        if (listen_port_.conn_rate || listen_port_.conn_rate_net) {
+            limiter_ = make_shared_object<rate_limiter>(listen_port_.conn_rate, listen_port_.conn_rate_net);
+        }
+        maglev_table_ptr maglev_;
+        if (listen_port_.balance == RINETD_BALANCE_SOURCE) {
+            maglev_ = make_shared_object<maglev_table>(backends_);
+            g_health_checker_->watch([maglev_](uint64_t now) {
+                maglev_->rebuild(now);
+            });
+        }
+        size_t first_ = 0;
+        size_t workers_ = shared_count_;
+        if (listen_port_.busy_poll && worker_count_ > shared_count_) {
+            first_ = worker_count_ - 1;
+            workers_ = 1;
+            busy_rules_++;
+        }
+        else if (!listen_port_.tcp_or_udp && (listen_port_.quic || 
+            upgrade_listener_exclusive(listener_key(false, listen_port_.local_host, listen_port_.local_port)))) {
+            first_ = i % shared_count_;
+            workers_ = 1;
+        }
+        if (listen_port_.tcp_or_udp && listen_port_.mptcp) {
+            mptcp_rules_++;
+        }
         if (listen_port_.tcp_or_udp) {
-            std::shared_ptr<tcp_forward> forward_ = make_shared_object<tcp_forward>(context_, config_, listen_port_, log_);
-            if (!forward_->run()) {
-                continue;
+            /* One SO_REUSEPORT listener per worker, plus any extra listeners a predecessor with more workers handed over. */
+            std::string key_ = listener_key(true, listen_port_.local_host, listen_port_.local_port);
+            size_t listeners_ = std::max<size_t>(workers_, upgrade_count_listeners(key_));
+            for (size_t n = 0; n < listeners_; n++) {
+                size_t worker_ = first_ + n % workers_;
+                tcp_forwards_[worker_].push_back(
+                    make_shared_object<tcp_forward>(*g_workers[worker_], listen_port_, backends_, maglev_, limiter_, acl_));
             }
-            g_tcp_forwards.push_back(forward_);
         }
         else {
-            std::shared_ptr<udp_forward> forward_ = make_shared_object<udp_forward>(context_, config_, listen_port_);
-            if (!forward_->run()) {
+            /* Likewise for udp: the kernel keeps a client's datagrams on one socket, so every worker owns a shard of
+             * the rule's tunnels without sharing any state. */
+            std::string key_ = listener_key(false, listen_port_.local_host, listen_port_.local_port);
+            size_t listeners_ = std::max<size_t>(workers_, upgrade_count_listeners(key_));
+            for (size_t n = 0; n < listeners_; n++) {
+                size_t worker_ = first_ + n % workers_;
+                udp_forwards_[worker_].push_back(
+                    make_shared_object<udp_forward>(*g_workers[worker_], listen_port_, backends_, maglev_, limiter_, acl_));
+            }
+        }
+    }
+
+    /* The sockets themselves are set up by one thread per worker, with thousands of rules the syscalls dominate the
+     * restart time. Nothing runs on the io_contexts yet, the threads only register the first accepts. */
+    std::vector<std::vector<char> > tcp_ok_(worker_count_);
+    std::vector<std::vector<char> > udp_ok_(worker_count_);
+    std::vector<std::thread> threads_;
+    for (size_t n = 0; n < worker_count_; n++) {
+        tcp_ok_[n].resize(tcp_forwards_[n].size(), 0);
+        udp_ok_[n].resize(udp_forwards_[n].size(), 0);
+        if (n > 0) {
+            threads_.push_back(std::thread(run_worker_ports, std::ref(tcp_forwards_[n]), std::ref(tcp_ok_[n]), 
+                std::ref(udp_forwards_[n]), std::ref(udp_ok_[n])));
+        }
+    }
+    run_worker_ports(tcp_forwards_[0], tcp_ok_[0], udp_forwards_[0], udp_ok_[0]);
+    for (size_t n = 0, l = threads_.size(); n < l; n++) {
+        threads_[n].join();
+    }
+
+    size_t listening_ = 0;
+    size_t failed_ = 0;
+    std::set<std::string> reported_;
+    for (size_t n = 0; n < worker_count_; n++) {
+        for (size_t i = 0, l = tcp_forwards_[n].size(); i < l; i++) {
+            std::shared_ptr<tcp_forward>& forward_ = tcp_forwards_[n][i];
+            if (tcp_ok_[n][i]) {
+                g_tcp_forwards.push_back(forward_);
+                listening_++;
+            }
+            else {
+                report_port_failure(reported_, forward_->rule(), forward_->error());
+                failed_++;
+            }
+        }
+    }
+    std::map<listen_port*, int> udp_sockets_;
+    for (size_t n = 0; n < worker_count_; n++) {
+        for (size_t i = 0, l = udp_forwards_[n].size(); i < l; i++) {
+            std::shared_ptr<udp_forward>& forward_ = udp_forwards_[n][i];
+            if (udp_ok_[n][i]) {
+                g_udp_forwards.push_back(forward_);
+                udp_sockets_[&forward_->rule()]++;
+                listening_++;
+            }
+            else {
+                report_port_failure(reported_, forward_->rule(), forward_->error());
+                failed_++;
+            }
+        }
+    }
+    if (config_.udp_reuseport_bpf && shared_count_ > 1) {
+        /* The program belongs to the rule's reuseport group, attaching it through one of the sockets is enough. */
+        for (size_t i = 0, l = g_udp_forwards.size(); i < l; i++) {
+            std::shared_ptr<udp_forward>& forward_ = g_udp_forwards[i];
+            std::map<listen_port*, int>::iterator it = udp_sockets_.find(&forward_->rule());
+            if (it == udp_sockets_.end() || forward_->rule().busy_poll || forward_->rule().quic) {
                 continue;
             }
-            g_udp_forwards.push_back(forward_);
+            if (!syssocket_reuseport_bpf(forward_->listener().second, (uint32_t)it->second)) {
+                log_message("udp_reuseport_bpf: unable to attach to " + forward_->listener().first + ", the kernel picks the worker");
+            }
+            udp_sockets_.erase(it);
+        }
+    }
+    if (busy_rules_ > 0) {
+        /* Probed once on a scratch socket, every socket of the rules gets the same setting. */
+        int probe_ = socket(AF_INET, SOCK_DGRAM, 0);
+        bool busy_poll_ = syssocket_busy_poll(probe_, 1, false);
+        if (probe_ != -1) {
+            close(probe_);
+        }
+        log_message("busy_poll: " + std::to_string(busy_rules_) + " rules on polling worker " + std::to_string(worker_count_ - 1) + 
+            (busy_poll_ ? "" : ", SO_BUSY_POLL refused (CAP_NET_ADMIN above net.core.busy_read), spinning on the reactor only"));
+    }
+    if (mptcp_rules_ > 0) {
+        int probe_ = syssocket_mptcp(true);
+        if (probe_ != -1) {
+            close(probe_);
+        }
+        else {
+            log_message("mptcp: unavailable (kernel before 5.6 or net.mptcp.enabled=0), " + std::to_string(mptcp_rules_) + 
+                " rules use plain tcp");
         }
     }
+    std::vector<std::string> unclaimed_ = upgrade_unclaimed_listeners();
+    for (size_t i = 0, l = unclaimed_.size(); i < l; i++) {
+        log_message("startup: no rule for inherited listener " + unclaimed_[i] + ", closing it");
+    }
+    log_message("startup: " + std::to_string(list.size()) + " rules, " + std::to_string(listening_) + " listeners ready, " + 
+        std::to_string(failed_) + " failed on " + std::to_string(reported_.size()) + " rules, " + 
+        std::to_string(GetTickCount(false) - started_) + " ms");
+    g_health_checker_->run();
 }
 
 static bool 
@@ -67,6 +472,20 @@ do_cli(int argc, const char** argv) {
             "  -h, --help             display this help\n"
             "  -v, --version          display version number\n"
             "\n"
+            "Send SIGUSR2 to re-execute the rinetd binary in place: the\n"
+            "listening sockets are handed to the new process and this\n"
+            "one exits once its existing sessions are drained.\n"
+            "\n"
+            "Send SIGUSR1 to write the recent connection and tunnel\n"
+            "events (flight_recorder) to flight_file, rinetd-flight\n"
+            "decodes them.\n"
+            "\n"
+            "Sockets passed in by the service manager (LISTEN_FDS,\n"
+            "systemd socket activation) are used for the rules\n"
+            "listening on the same address instead of binding anew;\n"
+            "a udp rule is then served by one worker unless the\n"
+            "socket has SO_REUSEPORT (ReusePort=yes).\n"
+            "\n"
             "Most options are controlled through the\n"
             "configuration file. See the rinetd(8)\n"
             "manpage for more information.");
@@ -80,7 +499,19 @@ do_cli(int argc, const char** argv) {
 }
 
 static void
-adjust_2_max_priority() {
+adjust_scheduler(rinetd_config& config_) {
+    if (config_.scheduler == RINETD_SCHEDULER_NICE) {
+        #ifdef _WIN32
+        SetPriorityClass(GetCurrentProcess(), config_.scheduler_nice < 0 ? ABOVE_NORMAL_PRIORITY_CLASS : BELOW_NORMAL_PRIORITY_CLASS);
+        #else
+        setpriority(PRIO_PROCESS, 0, config_.scheduler_nice);
+        #endif
+        return;
+    }
+    if (config_.scheduler != RINETD_SCHEDULER_REALTIME) {
+        return;
+    }
+
     #ifdef _WIN32
     SetPriorityClass(GetCurrentProcess(), IDLE_PRIORITY_CLASS);
     SetThreadPriority(GetCurrentProcess(), THREAD_PRIORITY_LOWEST);
@@ -108,20 +539,34 @@ adjust_2_max_priority() {
 }
 
 int main(int argc, const char* argv[]) {
-    adjust_2_max_priority();
     if (do_cli(argc, argv)) {
         return 0;
     }
 
+    /* The configuration is loaded before daemonizing, so a refused one fails the command that started rinetd with its
+     * errors on stderr. */
+    rinetd_config config_;
+    if (!load_config(config_, argc, argv)) {
+        return -1;
+    }
+
+    /* A socket activated rinetd stays in the foreground: the service manager supervises the process it started, and
+     * LISTEN_PID names that process, not a forked child. */
     #if !(_DEBUG || _WIN32)
-    if (daemon(1, 1) < 0){
+    if (!upgrade_socket_activated() && daemon(1, 1) < 0){
         return 1;
     }
     #endif
+    adjust_scheduler(config_);
 
-    rinetd_config config_;
-    if (!load_config(config_, argc, argv)) {
-        return -1;
+    for (int i = 0; i < config_.workers; i++) {
+        g_workers.push_back(make_shared_object<rinetd_worker>(config_, i));
+    }
+    for (size_t i = 0, l = config_.listen_ports.size(); i < l; i++) {
+        if (config_.listen_ports[i].busy_poll) {
+            g_workers.push_back(make_shared_object<rinetd_worker>(config_, config_.workers, true));
+            break;
+        }
     }
     
     #ifndef _WIN32
@@ -130,13 +575,62 @@ int main(int argc, const char* argv[]) {
     signal(SIGABRT, do_signal);
     signal(SIGKILL, do_signal);
     signal(SIGTERM, do_signal);
+    signal(SIGCHLD, SIG_IGN);
+
+    char path_[PATH_MAX + 1];
+    ssize_t path_sz_ = readlink("/proc/self/exe", path_, PATH_MAX);
+    if (path_sz_ > 0) {
+        g_binary_path_ = std::string(path_, path_sz_);
+    }
+    g_argv_ = argv;
+
+    std::shared_ptr<boost::asio::signal_set> signals_ = make_shared_object<boost::asio::signal_set>(g_workers[0]->context(), SIGUSR1, SIGUSR2);
+    wait_signals(signals_);
+    upgrade_receive_listeners();
     #endif
-    run_all_ports(config_, open_log(context_, config_.log_var));
 
-    boost::asio::io_context::work work_(context_);
-    boost::system::error_code ec_;
-    context_.run(ec_);
-    return ec_.value();
+    g_config_ = &config_;
+    g_log_ = g_workers[0]->log();
+    int activated_ = upgrade_receive_activated(config_.workers);
+    if (activated_ > 0) {
+        log_message("startup: " + std::to_string(activated_) + " listeners passed in by the service manager");
+    }
+    memory_budget::set(config_.memory_budget);
+    if (config_.memory_budget > 0) {
+        log_message("memory: budget " + std::to_string(config_.memory_budget) + " bytes");
+    }
+    if (config_.sockmap > 0) {
+        std::string error_;
+        if (sockmap_open(config_.sockmap, error_)) {
+            log_message("sockmap: established tcp flows are relayed in the kernel");
+        }
+        else {
+            log_message("sockmap: unavailable, relaying in userspace (" + error_ + ")");
+        }
+    }
+    if (!config_.stats_file.empty()) {
+        /* One slot per forward: a rule has one per worker, extra room covers listeners handed over by a predecessor with more workers. */
+        uint32_t capacity_ = (uint32_t)std::max<size_t>(1, config_.listen_ports.size()) * (config_.workers * 2 + 1);
+        if (!stats_open(config_.stats_file.data(), capacity_, (uint32_t)g_workers.size())) {
+            log_message("stats: unable to create " + config_.stats_file);
+        }
+    }
+    run_all_ports(config_);
+    upgrade_notify_ready();
+
+    #ifndef _WIN32
+    if (!config_.admin_socket.empty()) {
+        g_admin_ = make_shared_object<admin_server>(*g_workers[0], g_tcp_forwards, g_udp_forwards);
+        if (!g_admin_->run(config_.admin_socket)) {
+            log_message("admin: unable to listen on " + config_.admin_socket);
+        }
+    }
+    #endif
+
+    for (size_t i = 1, l = g_workers.size(); i < l; i++) {
+        g_workers[i]->start();
+    }
+    return g_workers[0]->run();
 }
 
 #pragma warning(disable: 5043)
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <stdafx.h>
+#include <config.h>
+
+/* Process-wide memory budget. Relay buffers, udp tunnels, queued datagrams and pending log lines are charged when
+ * they are created and released when they go away; once the charged total reaches the budget, workers stop reading
+ * from tcp peers (the kernel's flow control pushes back on the senders), stop accepting and stop creating udp
+ * tunnels, and pick up again when usage falls below the low watermark. The charged figure tracks what the load
+ * holds, not the allocator's footprint, so the budget should leave headroom for caches and the kernel. */
+class memory_budget {
+public:
+    inline static void                                      set(uint64_t budget_) {
+        limit() = budget_;
+        low_watermark() = budget_ - budget_ / RINETD_MEMORY_HYSTERESIS;
+    }
+    inline static uint64_t                                  budget() {
+        return limit();
+    }
+    inline static int64_t                                   used() {
+        return used_bytes().load(std::memory_order_relaxed);
+    }
+    inline static void                                      charge(int64_t size_) {
+        used_bytes().fetch_add(size_, std::memory_order_relaxed);
+    }
+    inline static void                                      release(int64_t size_) {
+        used_bytes().fetch_sub(size_, std::memory_order_relaxed);
+    }
+    /* True from the moment usage reaches the budget until it drops below the low watermark. */
+    inline static bool                                      pressure() {
+        uint64_t budget_ = limit();
+        if (budget_ == 0) {
+            return false;
+        }
+        std::atomic<bool>& pressure_ = under_pressure();
+        int64_t used_ = used();
+        if (pressure_.load(std::memory_order_relaxed)) {
+            if (used_ < (int64_t)low_watermark()) {
+                pressure_.store(false, std::memory_order_relaxed);
+                return false;
+            }
+            return true;
+        }
+        if (used_ >= (int64_t)budget_) {
+            pressure_.store(true, std::memory_order_relaxed);
+            return true;
+        }
+        return false;
+    }
+
+private:
+    inline static uint64_t&                                 limit() {
+        static uint64_t limit_ = 0;
+        return limit_;
+    }
+    inline static uint64_t&                                 low_watermark() {
+        static uint64_t low_watermark_ = 0;
+        return low_watermark_;
+    }
+    inline static std::atomic<int64_t>&                     used_bytes() {
+        static std::atomic<int64_t> used_(0);
+        return used_;
+    }
+    inline static std::atomic<bool>&                        under_pressure() {
+        static std::atomic<bool> pressure_(false);
+        return pressure_;
+    }
+};
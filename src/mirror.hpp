@@ -0,0 +1,215 @@
+#pragma once
+
+#include <stdafx.h>
+#include <config.h>
+#include <capture.h>
+#include <memory_budget.hpp>
+#include <worker.hpp>
+#include <health_check.hpp>
+
+/* Copy of one rule's traffic on one worker, framed as a capture (capture.h) and appended to a file or streamed to a
+ * tcp sink. Relay buffers are reused as soon as their write completes, so records are copied into a chunked queue
+ * instead of holding the relay up; the queue is bounded, and once the sink falls behind new records are dropped and
+ * a RINETD_CAPTURE_LOST record tells the reader where a flow has a gap. Mirroring never delays or drops relay data. */
+class mirror_sink : public std::enable_shared_from_this<mirror_sink> {
+public:
+    inline mirror_sink(rinetd_worker& worker_, listen_port& rule_)
+        : enable_shared_from_this()
+        , worker_(worker_)
+        , context_(worker_.context())
+        , rule_(rule_)
+        , socket_(context_)
+        , retry_timer_(context_)
+        , connected_(false)
+        , writing_(false)
+        , queued_(0)
+        , next_flow_(0)
+        , dropped_(0) {
+
+    }
+    inline ~mirror_sink() {
+        clear();
+    }
+
+public:
+    /* Creates the capture file and writes its header once, before the workers open it for appending. */
+    inline static bool                                      prepare(listen_port& rule_) {
+        if (rule_.mirror_file.empty()) {
+            return true;
+        }
+        FILE* file_ = fopen(rule_.mirror_file.data(), "ab");
+        if (!file_) {
+            return false;
+        }
+        bool ok_ = true;
+        fseek(file_, 0, SEEK_END);
+        if (ftell(file_) == 0) {
+            rinetd_capture_header header_;
+            capture_header_init(header_);
+            ok_ = fwrite(&header_, sizeof(header_), 1, file_) == 1;
+        }
+        return fclose(file_) == 0 && ok_;
+    }
+    inline bool                                             run() {
+        if (!rule_.mirror_file.empty()) {
+            file_ = open_log(context_, rule_.mirror_file);
+            connected_ = file_ != NULL;
+            return connected_;
+        }
+        connect();
+        return true;
+    }
+    inline void                                             close() {
+        boost::system::error_code ec;
+        retry_timer_.cancel(ec);
+        socket_.close(ec);
+        if (file_) {
+            file_->close(ec);
+        }
+        connected_ = false;
+    }
+    inline uint64_t                                         open_flow(const boost::asio::ip::tcp::endpoint& client_, const backend_state_ptr& backend_) {
+        uint64_t flow_ = ((uint64_t)worker_.index() << 48) | (++next_flow_ & ((1ULL << 48) - 1));
+        std::string endpoints_ = to_address(client_) + " " + to_address(backend_->host(), backend_->port());
+        append(flow_, RINETD_CAPTURE_OPEN, endpoints_.data(), (uint32_t)endpoints_.size());
+        return flow_;
+    }
+    /* False when the record was dropped; the caller adds it to the flow's gap and reports that with lost(). */
+    inline bool                                             append(uint64_t flow_, int type_, const char* data_, uint32_t length_) {
+        bool payload_ = type_ != RINETD_CAPTURE_LOST;
+        size_t size_ = sizeof(rinetd_capture_record) + (payload_ ? length_ : 0);
+        if (!connected_ || queued_ + size_ > RINETD_MIRROR_QUEUE_BYTES || memory_budget::pressure()) {
+            dropped_ += payload_ ? length_ : 0;
+            return false;
+        }
+        /* The front chunk is not touched while it is being written. */
+        if (chunks_.empty() || (writing_ && chunks_.size() == 1) || chunks_.back().size() + size_ > RINETD_MIRROR_CHUNK_SIZE) {
+            chunks_.push_back(std::string());
+            chunks_.back().reserve(std::max<size_t>(size_, RINETD_MIRROR_CHUNK_SIZE));
+        }
+
+        rinetd_capture_record record_;
+        memset(&record_, 0, sizeof(record_));
+        record_.timestamp = GetTickCount(true);
+        record_.flow = flow_;
+        record_.length = length_;
+        record_.type = (uint8_t)type_;
+
+        std::string& chunk_ = chunks_.back();
+        chunk_.append((char*)&record_, sizeof(record_));
+        if (payload_ && length_ > 0) {
+            chunk_.append(data_, length_);
+        }
+        queued_ += size_;
+        memory_budget::charge(size_);
+        flush();
+        return true;
+    }
+    inline bool                                             lost(uint64_t flow_, uint32_t length_) {
+        return append(flow_, RINETD_CAPTURE_LOST, NULL, length_);
+    }
+    inline uint64_t                                         dropped() {
+        return dropped_;
+    }
+
+private:
+    inline void                                             flush() {
+        if (writing_ || chunks_.empty()) {
+            return;
+        }
+        writing_ = true;
+
+        std::shared_ptr<mirror_sink> self = shared_from_this();
+        std::string& chunk_ = chunks_.front();
+        auto handler_ = [self, this](const boost::system::error_code& ec, std::size_t sz) {
+            writing_ = false;
+            if (chunks_.empty()) {
+                return;
+            }
+            release(chunks_.front().size());
+            chunks_.pop_front();
+            if (ec) {
+                disconnect();
+                return;
+            }
+            flush();
+        };
+        if (file_) {
+            boost::asio::async_write(*file_, boost::asio::buffer(chunk_.data(), chunk_.size()), handler_);
+        }
+        else {
+            boost::asio::async_write(socket_, boost::asio::buffer(chunk_.data(), chunk_.size()), handler_);
+        }
+    }
+    inline void                                             connect() {
+        std::shared_ptr<mirror_sink> self = shared_from_this();
+        boost::asio::ip::tcp::endpoint sinkEP = to_endpoint<boost::asio::ip::tcp>(rule_.mirror_host, rule_.mirror_port);
+        boost::system::error_code ec;
+        socket_.close(ec);
+        socket_.open(sinkEP.protocol(), ec);
+        if (ec) {
+            retry();
+            return;
+        }
+        socket_.async_connect(sinkEP, [self, this](const boost::system::error_code& ec) {
+            if (ec) {
+                retry();
+                return;
+            }
+            boost::system::error_code ec_;
+            socket_.set_option(boost::asio::ip::tcp::no_delay(true), ec_);
+
+            /* Each connection to the sink is a capture of its own. */
+            rinetd_capture_header header_;
+            capture_header_init(header_);
+            chunks_.push_front(std::string((char*)&header_, sizeof(header_)));
+            queued_ += sizeof(header_);
+            memory_budget::charge(sizeof(header_));
+            connected_ = true;
+            flush();
+        });
+    }
+    inline void                                             retry() {
+        std::shared_ptr<mirror_sink> self = shared_from_this();
+        retry_timer_.expires_from_now(boost::posix_time::seconds(RINETD_MIRROR_RETRY));
+        retry_timer_.async_wait([self, this](const boost::system::error_code& ec) {
+            if (!ec) {
+                connect();
+            }
+        });
+    }
+    /* A sink that fails loses what was queued for it; a tcp sink is dialled again, a file is given up. */
+    inline void                                             disconnect() {
+        connected_ = false;
+        clear();
+        if (!file_) {
+            retry();
+        }
+    }
+    inline void                                             clear() {
+        for (size_t i = writing_ ? 1 : 0; i < chunks_.size(); i++) {
+            dropped_ += chunks_[i].size();
+            release(chunks_[i].size());
+        }
+        chunks_.resize(writing_ && !chunks_.empty() ? 1 : 0);
+    }
+    inline void                                             release(size_t size_) {
+        queued_ -= size_;
+        memory_budget::release(size_);
+    }
+
+private:
+    rinetd_worker&                                          worker_;
+    boost::asio::io_context&                                context_;
+    listen_port&                                            rule_;
+    std::shared_ptr<boost::asio::posix::stream_descriptor>  file_;
+    boost::asio::ip::tcp::socket                            socket_;
+    boost::asio::deadline_timer                             retry_timer_;
+    bool                                                    connected_;
+    bool                                                    writing_;
+    std::deque<std::string>                                 chunks_;
+    size_t                                                  queued_;
+    uint64_t                                                next_flow_;
+    uint64_t                                                dropped_;
+};
+typedef std::shared_ptr<mirror_sink>                        mirror_sink_ptr;
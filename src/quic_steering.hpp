@@ -0,0 +1,103 @@
+#pragma once
+
+#include <stdafx.h>
+#include <config.h>
+
+/* Connection ids of the QUIC flows of one udp rule, mapped to the tunnel carrying them. Only the invariant parts of
+ * the header are read (RFC 8999): a long header (first bit set) carries both ids with their lengths, a short header
+ * only the destination id, right after the first byte, without its length. The ids a client sends to are the ones
+ * its server picked, learnt from the source id of the server's long header packets during the handshake; their
+ * lengths are remembered so that short headers can be looked up too. A migrating client that switches to an id the
+ * server handed out inside the encrypted payload is not recognised and gets a tunnel of its own. */
+template<class T>
+class quic_steering {
+public:
+    typedef std::unordered_map<std::string, T*>             cid_map;
+
+public:
+    inline quic_steering()
+        : lengths_(0) {
+
+    }
+
+public:
+    /* Server id of a long header packet the backend sent, false on anything else. */
+    inline static bool                                      source_id(const char* buf, size_t size, std::string& cid_) {
+        if (size < 7 || !(buf[0] & 0x80)) {
+            return false;
+        }
+        size_t dcid_ = (uint8_t)buf[5];
+        if (dcid_ > RINETD_QUIC_MAX_CID || 7 + dcid_ > size) {
+            return false;
+        }
+        size_t scid_ = (uint8_t)buf[6 + dcid_];
+        if (scid_ < 1 || scid_ > RINETD_QUIC_MAX_CID || 7 + dcid_ + scid_ > size) {
+            return false;
+        }
+        cid_.assign(buf + 7 + dcid_, scid_);
+        return true;
+    }
+    /* Tunnel of the id a client datagram is sent to, NULL when it is none of the learnt ones. */
+    inline T*                                               find(const char* buf, size_t size) {
+        if (size < 1 || map_.empty()) {
+            return NULL;
+        }
+        if (buf[0] & 0x80) {
+            size_t dcid_ = size > 5 ? (uint8_t)buf[5] : 0;
+            if (dcid_ < 1 || dcid_ > RINETD_QUIC_MAX_CID || 6 + dcid_ > size) {
+                return NULL;
+            }
+            return lookup(buf + 6, dcid_);
+        }
+        for (int i = RINETD_QUIC_MAX_CID; i > 0; i--) {
+            if ((lengths_ & (1U << i)) && 1 + (size_t)i <= size) {
+                T* tunnel_ = lookup(buf + 1, i);
+                if (tunnel_) {
+                    return tunnel_;
+                }
+            }
+        }
+        return NULL;
+    }
+    /* cids_ lists the ids of the tunnel, the oldest is forgotten past RINETD_QUIC_TUNNEL_IDS. An id another tunnel
+     * held moves to this one. */
+    inline void                                             add(const std::string& cid_, T* tunnel_, std::vector<std::string>& cids_) {
+        for (size_t i = 0, l = cids_.size(); i < l; i++) {
+            if (cids_[i] == cid_) {
+                return;
+            }
+        }
+        if (cids_.size() >= (size_t)RINETD_QUIC_TUNNEL_IDS) {
+            erase(cids_.front(), tunnel_);
+            cids_.erase(cids_.begin());
+        }
+        cids_.push_back(cid_);
+        map_[cid_] = tunnel_;
+        lengths_ |= 1U << cid_.size();
+    }
+    inline void                                             remove(std::vector<std::string>& cids_, T* tunnel_) {
+        for (size_t i = 0, l = cids_.size(); i < l; i++) {
+            erase(cids_[i], tunnel_);
+        }
+        cids_.clear();
+    }
+    inline size_t                                           size() {
+        return map_.size();
+    }
+
+private:
+    inline T*                                               lookup(const char* cid_, size_t length_) {
+        typename cid_map::iterator it = map_.find(std::string(cid_, length_));
+        return it != map_.end() ? it->second : NULL;
+    }
+    inline void                                             erase(const std::string& cid_, T* tunnel_) {
+        typename cid_map::iterator it = map_.find(cid_);
+        if (it != map_.end() && it->second == tunnel_) {
+            map_.erase(it);
+        }
+    }
+
+private:
+    cid_map                                                 map_;
+    uint32_t                                                lengths_;       /* bit n set once an id of n bytes was learnt */
+};
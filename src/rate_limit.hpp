@@ -0,0 +1,147 @@
+#pragma once
+
+#include <stdafx.h>
+#include <config.h>
+#include <random>
+
+/* New-connection rate limits of one rule, per source address and per source network (/24 for ipv4, /64 for ipv6).
+ * Counts live in a count-min sketch of fixed size shared by every worker of the rule, so the memory stays the same
+ * however many sources show up; a collision can only overestimate a source, never let one through above its limit.
+ *
+ * Each cell packs the window it was last touched in with the counts of that window and the one before, the rate is
+ * the sliding estimate cur + prev * (unelapsed part of the window). Stale cells reset themselves on their next update,
+ * so nothing ever sweeps the table. */
+class rate_limiter {
+    static int const        WINDOW_BITS                     = 24;
+    static int const        COUNT_BITS                      = 20;
+    static uint64_t const   COUNT_MASK                      = (1ULL << COUNT_BITS) - 1;
+    static uint64_t const   WINDOW_MASK                     = (1ULL << WINDOW_BITS) - 1;
+
+public:
+    inline rate_limiter(uint32_t host_rate_, uint32_t network_rate_)
+        : host_rate_(host_rate_)
+        , network_rate_(network_rate_)
+        , cells_(new std::atomic<uint64_t>[RINETD_RATE_SKETCH_DEPTH * RINETD_RATE_SKETCH_WIDTH]) {
+        /* A per-process key keeps sources from precomputing addresses that collide with a victim's cells. */
+        std::random_device random_;
+        seed_ = ((uint64_t)random_() << 32) | random_();
+        for (int i = 0; i < RINETD_RATE_SKETCH_DEPTH * RINETD_RATE_SKETCH_WIDTH; i++) {
+            cells_[i].store(0, std::memory_order_relaxed);
+        }
+    }
+
+public:
+    /* Counts a new connection of the client, false (and nothing counted) when a limit is already reached. */
+    inline bool                                             admit(const boost::asio::ip::address& client_, uint64_t now) {
+        uint8_t key_[17];
+        size_t host_size_ = 0;
+        size_t network_size_ = 0;
+        if (client_.is_v6() && !client_.to_v6().is_v4_mapped()) {
+            boost::asio::ip::address_v6::bytes_type bytes_ = client_.to_v6().to_bytes();
+            memcpy(key_ + 1, bytes_.data(), bytes_.size());
+            host_size_ = 17;
+            network_size_ = 9;
+        }
+        else {
+            boost::asio::ip::address_v4::bytes_type bytes_ = client_.is_v6() ?
+                client_.to_v6().to_v4().to_bytes() : client_.to_v4().to_bytes();
+            memcpy(key_ + 1, bytes_.data(), bytes_.size());
+            host_size_ = 5;
+            network_size_ = 4;
+        }
+
+        uint64_t host_hash_ = 0;
+        uint64_t network_hash_ = 0;
+        if (host_rate_) {
+            key_[0] = 'h';
+            host_hash_ = hash(key_, host_size_);
+            if (estimate(host_hash_, now) >= host_rate_) {
+                return false;
+            }
+        }
+        if (network_rate_) {
+            key_[0] = 'n';
+            network_hash_ = hash(key_, network_size_);
+            if (estimate(network_hash_, now) >= network_rate_) {
+                return false;
+            }
+        }
+        if (host_rate_) {
+            increment(host_hash_, now);
+        }
+        if (network_rate_) {
+            increment(network_hash_, now);
+        }
+        return true;
+    }
+
+private:
+    inline uint64_t                                         hash(const uint8_t* data_, size_t size_) {
+        uint64_t h_ = seed_ ^ 14695981039346656037ULL;
+        for (size_t i = 0; i < size_; i++) {
+            h_ = (h_ ^ data_[i]) * 1099511628211ULL;
+        }
+        h_ ^= h_ >> 33;
+        h_ *= 0xff51afd7ed558ccdULL;
+        h_ ^= h_ >> 33;
+        h_ *= 0xc4ceb9fe1a85ec53ULL;
+        h_ ^= h_ >> 33;
+        return h_;
+    }
+    inline std::atomic<uint64_t>&                           cell(uint64_t hash_, int row_) {
+        /* Double hashing: row i probes h1 + i * h2, the odd step keeps the rows independent. */
+        uint64_t index_ = ((uint32_t)hash_ + (uint64_t)row_ * ((hash_ >> 32) | 1)) & (RINETD_RATE_SKETCH_WIDTH - 1);
+        return cells_[row_ * RINETD_RATE_SKETCH_WIDTH + index_];
+    }
+    inline uint64_t                                         estimate(uint64_t hash_, uint64_t now) {
+        uint64_t window_ = (now / RINETD_RATE_WINDOW) & WINDOW_MASK;
+        uint64_t elapsed_ = now % RINETD_RATE_WINDOW;
+        uint64_t min_ = UINT64_MAX;
+        for (int i = 0; i < RINETD_RATE_SKETCH_DEPTH; i++) {
+            uint64_t value_ = cell(hash_, i).load(std::memory_order_relaxed);
+            uint64_t cell_window_ = value_ >> (COUNT_BITS * 2);
+            uint64_t prev_ = 0;
+            uint64_t cur_ = 0;
+            if (cell_window_ == window_) {
+                prev_ = (value_ >> COUNT_BITS) & COUNT_MASK;
+                cur_ = value_ & COUNT_MASK;
+            }
+            else if (cell_window_ == ((window_ - 1) & WINDOW_MASK)) {
+                prev_ = value_ & COUNT_MASK;
+            }
+            min_ = std::min<uint64_t>(min_, cur_ + prev_ * (RINETD_RATE_WINDOW - elapsed_) / RINETD_RATE_WINDOW);
+        }
+        return min_;
+    }
+    inline void                                             increment(uint64_t hash_, uint64_t now) {
+        uint64_t window_ = (now / RINETD_RATE_WINDOW) & WINDOW_MASK;
+        for (int i = 0; i < RINETD_RATE_SKETCH_DEPTH; i++) {
+            std::atomic<uint64_t>& cell_ = cell(hash_, i);
+            uint64_t value_ = cell_.load(std::memory_order_relaxed);
+            uint64_t next_;
+            do {
+                uint64_t cell_window_ = value_ >> (COUNT_BITS * 2);
+                uint64_t prev_ = 0;
+                uint64_t cur_ = 0;
+                if (cell_window_ == window_) {
+                    prev_ = (value_ >> COUNT_BITS) & COUNT_MASK;
+                    cur_ = value_ & COUNT_MASK;
+                }
+                else if (cell_window_ == ((window_ - 1) & WINDOW_MASK)) {
+                    prev_ = value_ & COUNT_MASK;
+                }
+                if (cur_ < COUNT_MASK) {
+                    cur_++;
+                }
+                next_ = (window_ << (COUNT_BITS * 2)) | (prev_ << COUNT_BITS) | cur_;
+            } while (!cell_.compare_exchange_weak(value_, next_, std::memory_order_relaxed));
+        }
+    }
+
+private:
+    uint32_t                                                host_rate_;
+    uint32_t                                                network_rate_;
+    uint64_t                                                seed_;
+    std::unique_ptr<std::atomic<uint64_t>[]>                cells_;
+};
+typedef std::shared_ptr<rate_limiter>                       rate_limiter_ptr;
@@ -0,0 +1,130 @@
+#pragma once
+
+#include <stdafx.h>
+#include <boost/intrusive_ptr.hpp>
+
+static int const RINETD_SLAB_CACHE_SIZE                 = 256;
+
+/* Per-thread recycling slab for fixed-size objects. Released cells are kept on a thread-local free list
+ * and handed out again on the next allocation, so steady-state object churn never reaches malloc. */
+template<typename T>
+class slab_allocator {
+    struct slab_cell {
+        slab_cell*                                          next;
+    };
+    struct slab_cache {
+        slab_cell*                                          head;
+        int                                                 count;
+
+        inline slab_cache()
+            : head(NULL)
+            , count(0) {
+
+        }
+        inline ~slab_cache() {
+            while (NULL != head) {
+                slab_cell* cell = head;
+                head = cell->next;
+                Mfree(cell);
+                cached_count().fetch_sub(1, std::memory_order_relaxed);
+            }
+        }
+    };
+
+public:
+    inline static void*                                     allocate() {
+        slab_cache& cache_ = cache();
+        slab_cell* cell = cache_.head;
+        if (NULL != cell) {
+            cache_.head = cell->next;
+            cache_.count--;
+            cached_count().fetch_sub(1, std::memory_order_relaxed);
+        }
+        else {
+            cell = (slab_cell*)Malloc(sizeof(T) > sizeof(slab_cell) ? sizeof(T) : sizeof(slab_cell));
+            if (NULL == cell) {
+                return NULL;
+            }
+        }
+        live_count().fetch_add(1, std::memory_order_relaxed);
+        return cell;
+    }
+    inline static void                                      deallocate(void* p) {
+        if (NULL == p) {
+            return;
+        }
+        slab_cache& cache_ = cache();
+        live_count().fetch_sub(1, std::memory_order_relaxed);
+        if (cache_.count >= RINETD_SLAB_CACHE_SIZE) {
+            Mfree(p);
+            return;
+        }
+        slab_cell* cell = (slab_cell*)p;
+        cell->next = cache_.head;
+        cache_.head = cell;
+        cache_.count++;
+        cached_count().fetch_add(1, std::memory_order_relaxed);
+    }
+    inline static int64_t                                   live() {
+        return live_count().load(std::memory_order_relaxed);
+    }
+    /* Released cells held on the free lists of all threads, at most RINETD_SLAB_CACHE_SIZE per thread. */
+    inline static int64_t                                   cached() {
+        return cached_count().load(std::memory_order_relaxed);
+    }
+
+private:
+    inline static std::atomic<int64_t>&                     live_count() {
+        static std::atomic<int64_t> live_(0);
+        return live_;
+    }
+    inline static std::atomic<int64_t>&                     cached_count() {
+        static std::atomic<int64_t> cached_(0);
+        return cached_;
+    }
+    inline static slab_cache&                               cache() {
+        static thread_local slab_cache cache_;
+        return cache_;
+    }
+};
+
+/* Base of slab-carved objects with a non-atomic intrusive reference count; the object must only be
+ * referenced from the thread (io_context) that created it. */
+template<typename T>
+class slab_object {
+public:
+    inline slab_object()
+        : references_(0) {
+
+    }
+
+public:
+    inline friend void                                      intrusive_ptr_add_ref(T* p) {
+        ++static_cast<slab_object<T>*>(p)->references_;
+    }
+    inline friend void                                      intrusive_ptr_release(T* p) {
+        if (--static_cast<slab_object<T>*>(p)->references_ == 0) {
+            p->~T();
+            slab_allocator<T>::deallocate(p);
+        }
+    }
+
+private:
+    uint32_t                                                references_;
+};
+
+template<typename T, typename... A>
+inline boost::intrusive_ptr<T>                              make_slab_object(A&&... args) {
+    static_assert(sizeof(T) > 0, "can't make pointer to incomplete type");
+    void* p = slab_allocator<T>::allocate();
+    if (NULL == p) {
+        return boost::intrusive_ptr<T>();
+    }
+    try {
+        return boost::intrusive_ptr<T>(new (p) T(std::forward<A&&>(args)...));
+    }
+    catch (...) {
+        slab_allocator<T>::deallocate(p);
+        throw;
+    }
+}
\ No newline at end of file
@@ -0,0 +1,245 @@
+#include <sockmap.h>
+
+#if !defined(_WIN32) && defined(__linux__)
+#include <linux/bpf.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <netinet/tcp.h>
+
+#ifndef SO_COOKIE
+#define SO_COOKIE 57
+#endif
+
+static int                                              s_map_ = -1;
+
+/* The tail of the kernel's struct tcp_info that glibc does not declare; linux/tcp.h clashes with netinet/tcp.h. */
+struct tcp_info_received {
+    struct tcp_info                                     base;
+    uint64_t                                            pacing_rate;
+    uint64_t                                            max_pacing_rate;
+    uint64_t                                            bytes_acked;
+    uint64_t                                            bytes_received;     /* linux 4.1 */
+    uint32_t                                            segs_out;
+    uint32_t                                            segs_in;
+    uint32_t                                            notsent_bytes;
+    uint32_t                                            min_rtt;
+    uint32_t                                            data_segs_in;       /* linux 4.6 */
+    uint32_t                                            data_segs_out;
+};
+
+static int
+sys_bpf(int cmd_, union bpf_attr& attr_) {
+    return (int)syscall(SYS_bpf, cmd_, &attr_, sizeof(attr_));
+}
+
+static struct bpf_insn
+bpf_insn_of(uint8_t code_, uint8_t dst_, uint8_t src_, int16_t off_, int32_t imm_) {
+    struct bpf_insn insn_;
+    memset(&insn_, 0, sizeof(insn_));
+    insn_.code = code_;
+    insn_.dst_reg = dst_;
+    insn_.src_reg = src_;
+    insn_.off = off_;
+    insn_.imm = imm_;
+    return insn_;
+}
+
+static int
+load_program(const std::vector<struct bpf_insn>& insns_, std::string& error_) {
+    static char license_[] = "GPL";
+    char log_[4096];
+
+    union bpf_attr attr_;
+    memset(&attr_, 0, sizeof(attr_));
+    memset(log_, 0, sizeof(log_));
+    attr_.prog_type = BPF_PROG_TYPE_SK_SKB;
+    attr_.insns = (uint64_t)(uintptr_t)insns_.data();
+    attr_.insn_cnt = (uint32_t)insns_.size();
+    attr_.license = (uint64_t)(uintptr_t)license_;
+    attr_.log_buf = (uint64_t)(uintptr_t)log_;
+    attr_.log_size = sizeof(log_);
+    attr_.log_level = 1;
+
+    int fd_ = sys_bpf(BPF_PROG_LOAD, attr_);
+    if (fd_ < 0) {
+        error_ = std::string("load sk_skb program: ") + strerror(errno) + (log_[0] ? std::string(", ") + log_ : std::string());
+    }
+    return fd_;
+}
+
+static bool
+attach_program(int prog_fd, int attach_type_, std::string& error_) {
+    union bpf_attr attr_;
+    memset(&attr_, 0, sizeof(attr_));
+    attr_.target_fd = (uint32_t)s_map_;
+    attr_.attach_bpf_fd = (uint32_t)prog_fd;
+    attr_.attach_type = (uint32_t)attach_type_;
+    if (sys_bpf(BPF_PROG_ATTACH, attr_) < 0) {
+        error_ = std::string("attach sk_skb program: ") + strerror(errno);
+        return false;
+    }
+    return true;
+}
+
+static bool
+map_update(uint64_t key_, int fd_) {
+    uint32_t value_ = (uint32_t)fd_;
+    union bpf_attr attr_;
+    memset(&attr_, 0, sizeof(attr_));
+    attr_.map_fd = (uint32_t)s_map_;
+    attr_.key = (uint64_t)(uintptr_t)&key_;
+    attr_.value = (uint64_t)(uintptr_t)&value_;
+    attr_.flags = BPF_NOEXIST;
+    return sys_bpf(BPF_MAP_UPDATE_ELEM, attr_) == 0;
+}
+
+static void
+map_delete(uint64_t key_) {
+    union bpf_attr attr_;
+    memset(&attr_, 0, sizeof(attr_));
+    attr_.map_fd = (uint32_t)s_map_;
+    attr_.key = (uint64_t)(uintptr_t)&key_;
+    sys_bpf(BPF_MAP_DELETE_ELEM, attr_);
+}
+
+static bool
+socket_cookie(int fd_, uint64_t& cookie_) {
+    socklen_t len_ = sizeof(cookie_);
+    return getsockopt(fd_, SOL_SOCKET, SO_COOKIE, &cookie_, &len_) == 0 && len_ == sizeof(cookie_);
+}
+
+static bool
+socket_pending(int fd_) {
+    int pending_ = 0;
+    return ioctl(fd_, FIONREAD, &pending_) != 0 || pending_ > 0;
+}
+#endif
+
+/* Payload bytes the socket received from its peer and the segments carrying them, whether userspace read them or the
+ * verdict redirected them; spliced connections account for their traffic with it. */
+bool sockmap_received(int fd, uint64_t& bytes, uint64_t& segments) {
+    #if defined(_WIN32) || !defined(__linux__)
+    return false;
+    #else
+    struct tcp_info_received info_;
+    socklen_t length_ = sizeof(info_);
+    memset(&info_, 0, sizeof(info_));
+    if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info_, &length_) != 0 || 
+        length_ < offsetof(struct tcp_info_received, data_segs_in) + sizeof(info_.data_segs_in)) {
+        return false;
+    }
+    /* the peer's FIN takes a sequence number too */
+    uint8_t state_ = info_.base.tcpi_state;
+    bool fin_ = state_ == TCP_CLOSE_WAIT || state_ == TCP_LAST_ACK || state_ == TCP_CLOSING || state_ == TCP_TIME_WAIT;
+    bytes = info_.bytes_received - (fin_ && info_.bytes_received > 0 ? 1 : 0);
+    segments = info_.data_segs_in;
+    return true;
+    #endif
+}
+
+bool sockmap_open(uint32_t max_entries, std::string& error_) {
+    #if defined(_WIN32) || !defined(__linux__)
+    error_ = "sockmap requires linux";
+    return false;
+    #else
+    if (s_map_ != -1) {
+        return true;
+    }
+
+    union bpf_attr attr_;
+    memset(&attr_, 0, sizeof(attr_));
+    attr_.map_type = BPF_MAP_TYPE_SOCKHASH;
+    attr_.key_size = sizeof(uint64_t);
+    attr_.value_size = sizeof(uint32_t);
+    attr_.max_entries = max_entries;
+
+    int map_ = sys_bpf(BPF_MAP_CREATE, attr_);
+    if (map_ < 0) {
+        error_ = std::string("create sockhash: ") + strerror(errno);
+        return false;
+    }
+
+    /* Parser: every skb is one complete message. */
+    std::vector<struct bpf_insn> parser_;
+    parser_.push_back(bpf_insn_of(BPF_LDX | BPF_W | BPF_MEM, BPF_REG_0, BPF_REG_1, offsetof(struct __sk_buff, len), 0));
+    parser_.push_back(bpf_insn_of(BPF_JMP | BPF_EXIT, 0, 0, 0, 0));
+
+    /* Verdict: each socket is stored under its peer's cookie, so the receiving socket's own cookie names the socket
+     * to transmit on. A failed lookup leaves no redirect behind and SK_PASS then queues the data for userspace. */
+    std::vector<struct bpf_insn> verdict_;
+    verdict_.push_back(bpf_insn_of(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_6, BPF_REG_1, 0, 0));
+    verdict_.push_back(bpf_insn_of(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_get_socket_cookie));
+    verdict_.push_back(bpf_insn_of(BPF_STX | BPF_DW | BPF_MEM, BPF_REG_10, BPF_REG_0, -8, 0));
+    verdict_.push_back(bpf_insn_of(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_1, BPF_REG_6, 0, 0));
+    verdict_.push_back(bpf_insn_of(BPF_LD | BPF_DW | BPF_IMM, BPF_REG_2, BPF_PSEUDO_MAP_FD, 0, map_));
+    verdict_.push_back(bpf_insn_of(0, 0, 0, 0, 0));
+    verdict_.push_back(bpf_insn_of(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_3, BPF_REG_10, 0, 0));
+    verdict_.push_back(bpf_insn_of(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_3, 0, 0, -8));
+    verdict_.push_back(bpf_insn_of(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_4, 0, 0, 0));
+    verdict_.push_back(bpf_insn_of(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_sk_redirect_hash));
+    verdict_.push_back(bpf_insn_of(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_0, 0, 0, SK_PASS));
+    verdict_.push_back(bpf_insn_of(BPF_JMP | BPF_EXIT, 0, 0, 0, 0));
+
+    s_map_ = map_;
+    int parser_fd_ = load_program(parser_, error_);
+    int verdict_fd_ = parser_fd_ < 0 ? -1 : load_program(verdict_, error_);
+    bool success_ = verdict_fd_ >= 0 &&
+        attach_program(parser_fd_, BPF_SK_SKB_STREAM_PARSER, error_) &&
+        attach_program(verdict_fd_, BPF_SK_SKB_STREAM_VERDICT, error_);
+
+    /* The map holds the attached programs, their descriptors are not needed any more. */
+    if (parser_fd_ >= 0) {
+        close(parser_fd_);
+    }
+    if (verdict_fd_ >= 0) {
+        close(verdict_fd_);
+    }
+    if (!success_) {
+        close(map_);
+        s_map_ = -1;
+    }
+    return success_;
+    #endif
+}
+
+bool sockmap_available() {
+    #if defined(_WIN32) || !defined(__linux__)
+    return false;
+    #else
+    return s_map_ != -1;
+    #endif
+}
+
+bool sockmap_splice(int local_fd, int remote_fd) {
+    #if defined(_WIN32) || !defined(__linux__)
+    return false;
+    #else
+    uint64_t local_cookie_ = 0;
+    uint64_t remote_cookie_ = 0;
+    if (s_map_ == -1 || !socket_cookie(local_fd, local_cookie_) || !socket_cookie(remote_fd, remote_cookie_)) {
+        return false;
+    }
+
+    /* Bytes already queued stay with userspace, splicing now would let later bytes overtake them. */
+    if (socket_pending(local_fd) || socket_pending(remote_fd)) {
+        return false;
+    }
+    if (!map_update(local_cookie_, remote_fd)) {
+        return false;
+    }
+    if (!map_update(remote_cookie_, local_fd)) {
+        map_delete(local_cookie_);
+        return false;
+    }
+
+    /* Bytes that slipped in between the check and the insertion are not redirected until more data arrives,
+     * so give the pair back to userspace; the kernel drains a socket's queue in order, nothing is reordered. */
+    if (socket_pending(local_fd) || socket_pending(remote_fd)) {
+        map_delete(local_cookie_);
+        map_delete(remote_cookie_);
+        return false;
+    }
+    return true;
+    #endif
+}
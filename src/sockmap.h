@@ -0,0 +1,10 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdafx.h>
+#include <config.h>
+
+bool                                                    sockmap_open(uint32_t max_entries, std::string& error_);
+bool                                                    sockmap_available();
+bool                                                    sockmap_splice(int local_fd, int remote_fd);
+bool                                                    sockmap_received(int fd, uint64_t& bytes, uint64_t& segments);
@@ -0,0 +1,80 @@
+#include <stdafx.h>
+#include <stats.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static rinetd_stats_header*                             s_header_ = NULL;
+#endif
+
+bool stats_open(const char* path_, uint32_t capacity_, uint32_t workers_) {
+    #ifdef _WIN32
+    return false;
+    #else
+    /* Built under a temporary name and renamed into place, a reader never maps a half initialized file; after an
+     * upgrade the successor's file replaces ours while we keep writing to the unlinked one until we exit. */
+    std::string temp_ = std::string(path_) + ".tmp";
+    int fd_ = open(temp_.data(), O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    if (fd_ < 0) {
+        return false;
+    }
+
+    size_t size_ = sizeof(rinetd_stats_header) + (size_t)capacity_ * sizeof(rinetd_stats_slot);
+    if (ftruncate(fd_, size_) < 0) {
+        close(fd_);
+        unlink(temp_.data());
+        return false;
+    }
+
+    void* map_ = mmap(NULL, size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+    close(fd_);
+    if (map_ == MAP_FAILED) {
+        unlink(temp_.data());
+        return false;
+    }
+
+    rinetd_stats_header* header_ = (rinetd_stats_header*)map_;
+    header_->version = RINETD_STATS_VERSION;
+    header_->header_size = sizeof(rinetd_stats_header);
+    header_->slot_size = sizeof(rinetd_stats_slot);
+    header_->slot_capacity = capacity_;
+    header_->slot_count.store(0, std::memory_order_relaxed);
+    header_->pid = getpid();
+    header_->workers = workers_;
+    header_->started = (uint64_t)time(NULL);
+    std::atomic_thread_fence(std::memory_order_release);
+    header_->magic = RINETD_STATS_MAGIC;
+
+    if (rename(temp_.data(), path_) < 0) {
+        munmap(map_, size_);
+        unlink(temp_.data());
+        return false;
+    }
+    s_header_ = header_;
+    return true;
+    #endif
+}
+
+rinetd_stats_slot* stats_attach(uint32_t rule_, uint32_t worker_, bool tcp_or_udp, const char* name_) {
+    #ifdef _WIN32
+    return NULL;
+    #else
+    if (!s_header_) {
+        return NULL;
+    }
+    uint32_t index_ = s_header_->slot_count.load(std::memory_order_relaxed);
+    if (index_ >= s_header_->slot_capacity) {
+        return NULL;
+    }
+
+    rinetd_stats_slot* slot_ = (rinetd_stats_slot*)((char*)s_header_ + s_header_->header_size) + index_;
+    slot_->rule = rule_;
+    slot_->worker = worker_;
+    slot_->tcp_or_udp = tcp_or_udp ? 1 : 0;
+    strncpy(slot_->name, name_, sizeof(slot_->name) - 1);
+    s_header_->slot_count.store(index_ + 1, std::memory_order_release);
+    return slot_;
+    #endif
+}
@@ -0,0 +1,100 @@
+#pragma once
+
+/* Layout of the memory mapped stats file, shared with tools/rinetd-stat: keep it free of boost and bump
+ * RINETD_STATS_VERSION on any incompatible change. Each slot belongs to one forward and is written only by the
+ * worker owning it, readers take a consistent copy through the slot's sequence counter (odd while writing). */
+#include <stdint.h>
+#include <string.h>
+#include <atomic>
+
+static uint32_t const RINETD_STATS_MAGIC                = 0x53544e52; /* "RNTS" */
+static uint32_t const RINETD_STATS_VERSION              = 2;
+static int const RINETD_STATS_COUNTERS                  = 24;
+
+enum {
+    RINETD_STAT_ACCEPTED,                               /* tcp connections / udp tunnels created */
+    RINETD_STAT_REJECTED,                               /* clients refused: no healthy backend, table full */
+    RINETD_STAT_ACTIVE,                                 /* live connections / tunnels (gauge) */
+    RINETD_STAT_SPLICED,                                /* tcp pairs handed to the sockmap */
+    RINETD_STAT_BYTES_UP,                               /* client to backend */
+    RINETD_STAT_BYTES_DOWN,                             /* backend to client */
+    RINETD_STAT_PACKETS_UP,
+    RINETD_STAT_PACKETS_DOWN,
+    RINETD_STAT_EVICTIONS,
+    RINETD_STAT_DROPS,
+    RINETD_STAT_SEND_ERRORS,
+    RINETD_STAT_LIMITED,                                /* new clients refused by the per-source rate limits */
+    RINETD_STAT_DENIED,                                 /* new clients refused by the allow/deny lists */
+    RINETD_STAT_SUSPENDED,                              /* tcp reads put off by the memory budget */
+    RINETD_STAT_MIRROR_DROPPED,                         /* bytes the mirror sink could not take */
+    RINETD_STAT_MIGRATIONS,                             /* udp tunnels moved to a new client address by their QUIC id */
+    RINETD_STAT_RECEIVE_ERRORS,                         /* failed reads on udp tunnels, mostly backends answering icmp unreachable */
+    RINETD_STAT_MIGRATIONS_REFUSED,                     /* QUIC migrations denied, rate limited or given up for a live old address */
+    RINETD_STAT_MAX,
+};
+
+typedef struct {
+    uint32_t                                            magic;
+    uint32_t                                            version;
+    uint32_t                                            header_size;
+    uint32_t                                            slot_size;
+    uint32_t                                            slot_capacity;
+    std::atomic<uint32_t>                               slot_count;
+    int32_t                                             pid;
+    uint32_t                                            workers;
+    uint64_t                                            started;        /* unix time in seconds */
+    uint8_t                                             reserved[24];
+} rinetd_stats_header;
+
+typedef struct {
+    std::atomic<uint32_t>                               seq;
+    uint32_t                                            rule;
+    uint32_t                                            worker;
+    uint32_t                                            tcp_or_udp;
+    char                                                name[48];       /* local address of the rule */
+    uint64_t                                            counters[RINETD_STATS_COUNTERS];
+} rinetd_stats_slot;
+
+inline void                                             stats_add(rinetd_stats_slot* slot_, int index_, int64_t value_) {
+    uint32_t seq_ = slot_->seq.load(std::memory_order_relaxed);
+    slot_->seq.store(seq_ + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    slot_->counters[index_] += value_;
+    slot_->seq.store(seq_ + 2, std::memory_order_release);
+}
+
+inline void                                             stats_set(rinetd_stats_slot* slot_, int index_, uint64_t value_) {
+    uint32_t seq_ = slot_->seq.load(std::memory_order_relaxed);
+    slot_->seq.store(seq_ + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    slot_->counters[index_] = value_;
+    slot_->seq.store(seq_ + 2, std::memory_order_release);
+}
+
+inline void                                             stats_add2(rinetd_stats_slot* slot_, int bytes_index_, uint64_t bytes_, int packets_index_) {
+    uint32_t seq_ = slot_->seq.load(std::memory_order_relaxed);
+    slot_->seq.store(seq_ + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    slot_->counters[bytes_index_] += bytes_;
+    slot_->counters[packets_index_]++;
+    slot_->seq.store(seq_ + 2, std::memory_order_release);
+}
+
+inline bool                                             stats_read(const rinetd_stats_slot* slot_, uint64_t* counters_) {
+    for (int i = 0; i < 1000; i++) {
+        uint32_t seq_ = slot_->seq.load(std::memory_order_acquire);
+        if (seq_ & 1) {
+            continue;
+        }
+        memcpy(counters_, (const void*)slot_->counters, sizeof(slot_->counters));
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (slot_->seq.load(std::memory_order_relaxed) == seq_) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Daemon side (stats.cpp): slots are handed out at startup, before any worker runs. */
+bool                                                    stats_open(const char* path_, uint32_t capacity_, uint32_t workers_);
+rinetd_stats_slot*                                      stats_attach(uint32_t rule_, uint32_t worker_, bool tcp_or_udp, const char* name_);
@@ -17,6 +17,7 @@
 #include <sys/file.h>
 #endif
 
+#include <atomic>
 #include <functional>
 #include <mutex>
 #include <utility>
@@ -25,6 +26,7 @@
 #include <map>
 #include <set>
 #include <list>
+#include <deque>
 #include <vector>
 #include <unordered_set>
 #include <unordered_map>
@@ -2,59 +2,219 @@
 
 #include <stdafx.h>
 #include <config.h>
+#include <slab.hpp>
+#include <handler_memory.hpp>
+#include <health_check.hpp>
+#include <maglev.hpp>
+#include <rate_limit.hpp>
+#include <top_talkers.hpp>
+#include <acl.h>
+#include <memory_budget.hpp>
+#include <mirror.hpp>
+#include <upgrade.h>
+#include <sockmap.h>
+#include <worker.hpp>
+#include <linked_list.hpp>
+#include <stats.h>
 
 class tcp_forward : public std::enable_shared_from_this<tcp_forward> {
 public:
-    class tcp_connection : public std::enable_shared_from_this<tcp_connection> {
+    /* The accept, the connect and its timer, then a read or a write per direction while the cancelled timer completes. */
+    typedef handler_memory<4>                               connection_memory;
+
+    class tcp_connection : public slab_object<tcp_connection>, public linked_list_node {
+        friend class tcp_forward;
+
     public:
-        inline tcp_connection(const std::shared_ptr<tcp_forward>& forward_, const std::shared_ptr<boost::asio::ip::tcp::socket>& socket_) 
-            : enable_shared_from_this()
+        inline tcp_connection(const std::shared_ptr<tcp_forward>& forward_, boost::asio::io_context& context_) 
+            : slab_object()
+            , linked_list_node()
             , forward_(forward_)
-            , timeout_(socket_->get_executor())
-            , local_socket_(socket_)
-            , remote_socket_(socket_->get_executor()) {
-            syssocket_setsockopt(*socket_);
+            , timeout_(context_)
+            , local_socket_(context_)
+            , remote_socket_(context_)
+            , tried_(0)
+            , next_(0)
+            , writing_(0)
+            , splice_attempts_(0)
+            , spliced_(false)
+            , bytes_up_(0)
+            , bytes_down_(0)
+            , spliced_up_(0)
+            , spliced_up_segments_(0)
+            , spliced_down_(0)
+            , spliced_down_segments_(0)
+            , created_(GetTickCount(false))
+            , mirror_flow_(0)
+            , mirror_lost_(0)
+            , flow_(0)
+            , close_reason_(RINETD_REASON_NONE)
+            , close_error_(0)
+            , connect_started_(0)
+            , backend_index_(-1) {
+            memset(&top_key_, 0, sizeof(top_key_));
+            memory_budget::charge(sizeof(tcp_connection));
         }
         inline ~tcp_connection() {
             abort();
+            memory_budget::release(sizeof(tcp_connection));
         }
 
     public:
         inline bool                                         run() {
-            std::shared_ptr<tcp_connection> self = shared_from_this();
+            created_ = GetTickCount(false);
+            flow_ = forward_->worker_.flight().next_flow();
+            flight(RINETD_FLIGHT_ACCEPT, RINETD_REASON_NONE);
+            syssocket_setsockopt(local_socket_);
+            if (forward_->forward_.busy_poll) {
+                syssocket_busy_poll(local_socket_.native_handle(), forward_->forward_.busy_poll, true);
+            }
+            if (forward_->maglev_) {
+                next_ = forward_->maglev_->lookup(client_ep_.address());
+            }
+            forward_->connections_.push_back(this);
+            stats_set(forward_->stats_, RINETD_STAT_ACTIVE, forward_->connections_.size());
+            return connect_backend();
+        }   
+        inline void                                         abort() {
+            boost::system::error_code ec_;
+            timeout_.cancel(ec_);
+            if (mirror_flow_) {
+                mirror(RINETD_CAPTURE_CLOSE, NULL, 0);
+                mirror_flow_ = 0;
+            }
+            if (local_socket_.is_open() && remote_socket_.is_open()) {
+                account_spliced();
+            }
+            if (flow_) {
+                rinetd_flight_record* record_ = flight(RINETD_FLIGHT_CLOSE, close_reason_);
+                if (record_) {
+                    record_->elapsed = (uint32_t)std::min<uint64_t>(GetTickCount(false) - created_, UINT32_MAX);
+                    record_->error = close_error_;
+                    record_->bytes_up = bytes_up_;
+                    record_->bytes_down = bytes_down_;
+                }
+                flow_ = 0;
+            }
+            if (forward_->connections_.contains(this)) {
+                forward_->connections_.remove(this);
+                stats_set(forward_->stats_, RINETD_STAT_ACTIVE, forward_->connections_.size());
+            }
+            
+            close_socket(remote_socket_);
+            close_socket(local_socket_);
+        }
+        inline void                                         abort(int reason_, int error_) {
+            cause(reason_, error_);
+            abort();
+        }
+        inline const boost::asio::ip::tcp::endpoint&        client() {
+            return client_ep_;
+        }
+        inline const backend_state_ptr&                     backend() {
+            return backend_;
+        }
+        inline uint64_t                                     bytes_up() {
+            return bytes_up_;
+        }
+        inline uint64_t                                     bytes_down() {
+            return bytes_down_;
+        }
+        inline uint64_t                                     created() {
+            return created_;
+        }
+        inline bool                                         spliced() {
+            return spliced_;
+        }
+
+    private:    
+        inline bool                                         connect_backend() {
+            /* Backends marked down are skipped without a syscall; with none left the client is refused right away. */
+            boost::intrusive_ptr<tcp_connection> self(this);
+            backend_state_list& backends_ = forward_->backends_;
+            if (tried_ >= backends_.size()) {
+                cause(RINETD_REASON_NO_BACKEND, 0);
+                return false;
+            }
+
+            int index_ = backend_state::select(backends_, next_, backends_.size() - tried_, GetTickCount(false));
+            if (index_ < 0) {
+                cause(RINETD_REASON_NO_BACKEND, 0);
+                return false;
+            }
+            tried_ += ((size_t)index_ + backends_.size() - next_) % backends_.size() + 1;
+            next_ = (index_ + 1) % backends_.size();
+            backend_ = backends_[index_];
+            backend_index_ = index_;
+
             try {
-                listen_port& connect_dst_ = forward_->forward_;
-                boost::asio::ip::tcp::endpoint connectEP = to_endpoint<boost::asio::ip::tcp>(connect_dst_.remote_host, connect_dst_.remote_port);
+                boost::asio::ip::tcp::endpoint connectEP = to_endpoint<boost::asio::ip::tcp>(backend_->host(), backend_->port());
 
                 boost::system::error_code ec;
-                remote_socket_.open(connectEP.protocol(), ec);
+                syssocket_open(remote_socket_, connectEP.protocol(), (forward_->forward_.mptcp & RINETD_MPTCP_BACKEND) != 0, ec);
                 if (ec) {
+                    cause(RINETD_REASON_BACKEND_ERROR, ec.value());
                     return false;
                 }
 
                 remote_socket_.set_option(boost::asio::detail::socket_option::boolean<IPPROTO_TCP, TCP_FASTOPEN>(true), ec);
-                syssocket_setsockopt(remote_socket_.native_handle(), connect_dst_.remote_host.bv6 ? false : true);
+                syssocket_setsockopt(remote_socket_.native_handle(), backend_->host().bv6 ? false : true);
+                if (forward_->forward_.busy_poll) {
+                    syssocket_busy_poll(remote_socket_.native_handle(), forward_->forward_.busy_poll, true);
+                }
 
+                /* A client the backend's family cannot carry is forwarded from our own address instead. */
+                boost::asio::ip::tcp::endpoint sourceEP;
+                if (forward_->forward_.transparent && transparent_endpoint(client_ep_.address(), connectEP.protocol(), sourceEP) &&
+                    syssocket_transparent(remote_socket_.native_handle(), !backend_->host().bv6, true)) {
+                    remote_socket_.bind(sourceEP, ec);
+                }
+
+                if (forward_->worker_.flight().enabled()) {
+                    connect_started_ = GetTickCount(true);
+                }
                 timeout_.expires_from_now(boost::posix_time::seconds(RINETD_TCP_CONNECT_TIMEOUT));
-                timeout_.async_wait([self, this](const boost::system::error_code& ec) {
+                timeout_.async_wait(with_memory(memory_, [self, this](const boost::system::error_code& ec) {
                     if (ec != boost::system::errc::operation_canceled) {
-                        abort();
+                        boost::system::error_code ec_;
+                        remote_socket_.close(ec_);
                     }
-                });
-                remote_socket_.async_connect(connectEP, [self, this](boost::system::error_code ec_) {
-                    if (ec_) {
+                }));
+                remote_socket_.async_connect(connectEP, with_memory(memory_, [self, this](const boost::system::error_code& ec) {
+                    if (!local_socket_.is_open()) {
                         abort();
                         return;
                     }
 
+                    boost::system::error_code ec_;
                     timeout_.cancel(ec_);
-                    socket_to_destination(local_socket_.get(), &remote_socket_, local_socket_buf);
-                    socket_to_destination(&remote_socket_, local_socket_.get(), remote_socket_buf);
+                    if (ec || !remote_socket_.is_open()) {
+                        /* The connect timer closes the socket, which cancels the connect. */
+                        bool timed_out_ = ec == boost::asio::error::operation_aborted || !remote_socket_.is_open();
+                        flight_connect(RINETD_FLIGHT_CONNECT_FAIL, timed_out_ ? RINETD_REASON_TIMEOUT : RINETD_REASON_BACKEND_ERROR, 
+                            timed_out_ ? 0 : ec.value());
+                        backend_->report_failure(GetTickCount(false));
+                        remote_socket_.close(ec_);
+                        if (!connect_backend()) {
+                            abort();
+                        }
+                        return;
+                    }
+
+                    backend_->report_success();
+                    flight_connect(RINETD_FLIGHT_CONNECT, RINETD_REASON_NONE, 0);
+                    forward_->top_.backend_connection(backend_index_);
+                    if (forward_->mirror_) {
+                        mirror_flow_ = forward_->mirror_->open_flow(client_ep_, backend_);
+                    }
+                    splice();
+                    socket_to_destination(&local_socket_, &remote_socket_, local_socket_buf);
+                    socket_to_destination(&remote_socket_, &local_socket_, remote_socket_buf);
 
                     if (forward_->log_ || !forward_->config_.log_var.empty()) {
                         wirte_log(2);
                     }
-                });
+                }));
 
                 if (forward_->log_ || !forward_->config_.log_var.empty()) {
                     wirte_log(1);
@@ -62,18 +222,10 @@ public:
                 return remote_socket_.is_open();
             }
             catch (std::exception&) {
+                cause(RINETD_REASON_BACKEND_ERROR, 0);
                 return false;
             }
-        }   
-        inline void                                         abort() {
-            boost::system::error_code ec_;
-            timeout_.cancel(ec_);
-            
-            close_socket(remote_socket_);
-            close_socket(*local_socket_.get());
         }
-
-    private:    
         inline bool                                         socket_to_destination(
             boost::asio::ip::tcp::socket*                   socket, 
             boost::asio::ip::tcp::socket*                   to,
@@ -81,34 +233,178 @@ public:
             if (!socket->is_open()) {
                 return false;
             }
-            std::shared_ptr<tcp_connection> self = shared_from_this();
-            socket->async_receive(boost::asio::buffer(buf, RINETD_BUFFER_SIZE), 
+            if (memory_budget::pressure()) {
+                forward_->suspend(this, socket, to, buf);
+                return true;
+            }
+            return resume_read(socket, to, buf);
+        }
+        inline bool                                         resume_read(
+            boost::asio::ip::tcp::socket*                   socket, 
+            boost::asio::ip::tcp::socket*                   to,
+            char*                                           buf) {
+            if (!socket->is_open()) {
+                return false;
+            }
+            boost::intrusive_ptr<tcp_connection> self(this);
+            socket->async_receive(boost::asio::buffer(buf, RINETD_BUFFER_SIZE), with_memory(memory_,
                 [self, this, socket, to, buf](const boost::system::error_code& ec, uint32_t sz) {
                     int by = std::max<int>(-1, ec ? -1 : sz);
                     if (by < 1) {
-                        abort();
+                        bool client_ = socket == &local_socket_;
+                        if (!ec || ec == boost::asio::error::eof) {
+                            cause(client_ ? RINETD_REASON_CLIENT_CLOSED : RINETD_REASON_BACKEND_CLOSED, 0);
+                        }
+                        else {
+                            cause(client_ ? RINETD_REASON_CLIENT_ERROR : RINETD_REASON_BACKEND_ERROR, ec.value());
+                        }
+                        if (spliced_ && local_socket_.is_open() && remote_socket_.is_open()) {
+                            linger();
+                        }
+                        else {
+                            abort();
+                        }
                         return;
                     }
 
-                    boost::asio::async_write(*to, boost::asio::buffer(buf, sz), 
+                    if (socket == &local_socket_) {
+                        bytes_up_ += sz;
+                        stats_add2(forward_->stats_, RINETD_STAT_BYTES_UP, sz, RINETD_STAT_PACKETS_UP);
+                        if (spliced_) {
+                            spliced_up_ += sz;
+                            spliced_up_segments_++;
+                        }
+                    }
+                    else {
+                        bytes_down_ += sz;
+                        stats_add2(forward_->stats_, RINETD_STAT_BYTES_DOWN, sz, RINETD_STAT_PACKETS_DOWN);
+                        if (spliced_) {
+                            spliced_down_ += sz;
+                            spliced_down_segments_++;
+                        }
+                    }
+                    if (forward_->top_.enabled()) {
+                        forward_->top_.traffic(top_key_, backend_index_, sz, GetTickCount(false));
+                    }
+                    if (mirror_flow_) {
+                        mirror(socket == &local_socket_ ? RINETD_CAPTURE_UP : RINETD_CAPTURE_DOWN, buf, sz);
+                    }
+                    writing_++;
+                    boost::asio::async_write(*to, boost::asio::buffer(buf, sz), with_memory(memory_,
                         [self, this, socket, to, buf](const boost::system::error_code& ec, uint32_t sz) {
+                            writing_--;
                             if (ec) {
-                                abort();
+                                abort(to == &remote_socket_ ? RINETD_REASON_BACKEND_ERROR : RINETD_REASON_CLIENT_ERROR, ec.value());
                             }
                             else {
+                                splice();
                                 socket_to_destination(socket, to, buf);
                             }
-                        });
-                });
+                        }));
+                }));
             return true;
         }
+        inline void                                         splice() {
+            /* Hand the pair to the kernel only while neither direction has bytes in flight through userspace; the
+             * receives stay armed to observe the close, and anything the verdict passes up is relayed as before.
+             * A sockmap takes plain tcp sockets only, multipath rules always relay here. */
+            if (spliced_ || writing_ > 0 || splice_attempts_ >= RINETD_SOCKMAP_ATTEMPTS || !sockmap_available() || forward_->mirror_ ||
+                forward_->forward_.mptcp) {
+                return;
+            }
+            splice_attempts_++;
+            spliced_ = sockmap_splice(local_socket_.native_handle(), remote_socket_.native_handle());
+            if (spliced_) {
+                stats_add(forward_->stats_, RINETD_STAT_SPLICED, 1);
+                sockmap_received(local_socket_.native_handle(), spliced_up_, spliced_up_segments_);
+                sockmap_received(remote_socket_.native_handle(), spliced_down_, spliced_down_segments_);
+            }
+        }
+        /* Bytes the kernel relayed on its own never pass through the receive loop: they are what each socket received
+         * since the splice, less what userspace read and counted itself, and are accounted for once before the close. */
+        inline void                                         account_spliced() {
+            if (!spliced_) {
+                return;
+            }
+            uint64_t bytes_ = 0;
+            uint64_t segments_ = 0;
+            uint64_t relayed_ = 0;
+            if (sockmap_received(local_socket_.native_handle(), bytes_, segments_) && bytes_ > spliced_up_) {
+                bytes_up_ += bytes_ - spliced_up_;
+                relayed_ += bytes_ - spliced_up_;
+                stats_add(forward_->stats_, RINETD_STAT_BYTES_UP, bytes_ - spliced_up_);
+                stats_add(forward_->stats_, RINETD_STAT_PACKETS_UP, segments_ > spliced_up_segments_ ? segments_ - spliced_up_segments_ : 1);
+                spliced_up_ = bytes_;
+                spliced_up_segments_ = segments_;
+            }
+            if (sockmap_received(remote_socket_.native_handle(), bytes_, segments_) && bytes_ > spliced_down_) {
+                bytes_down_ += bytes_ - spliced_down_;
+                relayed_ += bytes_ - spliced_down_;
+                stats_add(forward_->stats_, RINETD_STAT_BYTES_DOWN, bytes_ - spliced_down_);
+                stats_add(forward_->stats_, RINETD_STAT_PACKETS_DOWN, segments_ > spliced_down_segments_ ? segments_ - spliced_down_segments_ : 1);
+                spliced_down_ = bytes_;
+                spliced_down_segments_ = segments_;
+            }
+            if (relayed_ > 0 && forward_->top_.enabled()) {
+                forward_->top_.traffic(top_key_, backend_index_, relayed_, GetTickCount(false));
+            }
+        }
+        /* A record the sink cannot take is added to the flow's gap, reported before the flow's next record. */
+        inline void                                         mirror(int type_, const char* data_, uint32_t length_) {
+            mirror_sink_ptr& mirror_ = forward_->mirror_;
+            while (mirror_lost_ > 0) {
+                uint32_t lost_ = (uint32_t)std::min<uint64_t>(mirror_lost_, UINT32_MAX);
+                if (!mirror_->lost(mirror_flow_, lost_)) {
+                    break;
+                }
+                mirror_lost_ -= lost_;
+            }
+            if (mirror_lost_ > 0 || !mirror_->append(mirror_flow_, type_, data_, length_)) {
+                mirror_lost_ += length_;
+                stats_add(forward_->stats_, RINETD_STAT_MIRROR_DROPPED, length_);
+            }
+        }
+        /* Only the first cause is kept, closing one side makes the other fail as well. */
+        inline void                                         cause(int reason_, int error_) {
+            if (close_reason_ == RINETD_REASON_NONE) {
+                close_reason_ = reason_;
+                close_error_ = error_;
+            }
+        }
+        inline rinetd_flight_record*                        flight(int type_, int reason_) {
+            rinetd_flight_record* record_ = forward_->worker_.flight().add(type_, reason_, forward_->rule_index_, flow_);
+            if (record_) {
+                flight_recorder::client(record_, client_ep_);
+                if (backend_) {
+                    flight_recorder::backend(record_, backend_->host(), backend_->port());
+                }
+            }
+            return record_;
+        }
+        inline void                                         flight_connect(int type_, int reason_, int error_) {
+            rinetd_flight_record* record_ = flight(type_, reason_);
+            if (record_) {
+                record_->elapsed = (uint32_t)std::min<uint64_t>(record_->timestamp - connect_started_, UINT32_MAX);
+                record_->error = error_;
+            }
+        }
+        inline void                                         linger() {
+            /* Redirected bytes may still sit in the kernel's backlog of the peer socket, closing right away would drop them. */
+            boost::intrusive_ptr<tcp_connection> self(this);
+            timeout_.expires_from_now(boost::posix_time::milliseconds(RINETD_SOCKMAP_LINGER));
+            timeout_.async_wait(with_memory(memory_, [self, this](const boost::system::error_code& ec) {
+                if (ec != boost::system::errc::operation_canceled) {
+                    abort();
+                }
+            }));
+        }
         inline void                                         wirte_log(int m_) {
             boost::asio::ip::tcp::endpoint socket_ep_;
             boost::system::error_code ec;
             try {
-                socket_ep_ = local_socket_->remote_endpoint(ec);
+                socket_ep_ = local_socket_.remote_endpoint(ec);
                 if (ec) {
-                    abort();
+                    abort(RINETD_REASON_CLIENT_ERROR, ec.value());
                     return;
                 }
             }
@@ -121,7 +417,7 @@ public:
             try {
                 nat_ep_ = remote_socket_.local_endpoint(ec);
                 if (ec) {
-                    abort();
+                    abort(RINETD_REASON_BACKEND_ERROR, ec.value());
                     return;
                 }
             }
@@ -145,7 +441,7 @@ public:
                 throw std::runtime_error("This operand is not supported.");
                 break;
             }
-            sb.append(PaddingRight(to_address(connect_dst_.remote_host, connect_dst_.remote_port), 46, '\x20'));
+            sb.append(PaddingRight(to_address(backend_->host(), backend_->port()), 46, '\x20'));
             sb.append("nat ");
             sb.append(PaddingRight(to_address(nat_ep_), 46, '\x20'));
             sb.append(to_address(connect_dst_.local_host, connect_dst_.local_port));
@@ -162,21 +458,72 @@ public:
     private:    
         std::shared_ptr<tcp_forward>                        forward_;
         boost::asio::deadline_timer                         timeout_;
-        std::shared_ptr<boost::asio::ip::tcp::socket>       local_socket_;
+        boost::asio::ip::tcp::socket                        local_socket_;
         boost::asio::ip::tcp::socket                        remote_socket_;
+        backend_state_ptr                                   backend_;
+        size_t                                              tried_;
+        size_t                                              next_;
+        int                                                 writing_;
+        int                                                 splice_attempts_;
+        bool                                                spliced_;
+        uint64_t                                            bytes_up_;
+        uint64_t                                            bytes_down_;
+        uint64_t                                            spliced_up_;            /* kernel counters already accounted for */
+        uint64_t                                            spliced_up_segments_;
+        uint64_t                                            spliced_down_;
+        uint64_t                                            spliced_down_segments_;
+        uint64_t                                            created_;
+        uint64_t                                            mirror_flow_;
+        uint64_t                                            mirror_lost_;
+        uint32_t                                            flow_;
+        int                                                 close_reason_;
+        int                                                 close_error_;
+        uint64_t                                            connect_started_;
+        int                                                 backend_index_;
+        top_key                                             top_key_;
+        boost::asio::ip::tcp::endpoint                      client_ep_;
+        connection_memory                                   memory_;
         char                                                local_socket_buf[RINETD_BUFFER_SIZE];
         char                                                remote_socket_buf[RINETD_BUFFER_SIZE];
     };  
-    inline tcp_forward(boost::asio::io_context& context_, rinetd_config& config_, listen_port& forward_, const std::shared_ptr<boost::asio::posix::stream_descriptor>& log_)
+    struct suspended_read {
+        boost::intrusive_ptr<tcp_connection>                connection;
+        boost::asio::ip::tcp::socket*                       socket;
+        boost::asio::ip::tcp::socket*                       to;
+        char*                                               buf;
+    };
+    inline tcp_forward(rinetd_worker& worker_, listen_port& forward_, const backend_state_list& backends_, const maglev_table_ptr& maglev_, 
+        const rate_limiter_ptr& limiter_, const acl_table_ptr& acl_)
         : enable_shared_from_this()
-        , context_(context_)
-        , config_(config_)
+        , worker_(worker_)
+        , context_(worker_.context())
+        , config_(worker_.config())
         , forward_(forward_)
+        , rule_index_((uint32_t)(&forward_ - config_.listen_ports.data()))
+        , backends_(backends_)
+        , maglev_(maglev_)
+        , limiter_(limiter_)
+        , acl_(acl_)
         , server_(context_)
-        , log_(log_) {
-        
+        , log_(worker_.log())
+        , pressure_timer_(context_)
+        , pressure_waiting_(false)
+        , accept_suspended_(false)
+        , suspended_since_(0)
+        , private_stats_() {
+        stats_ = stats_attach(rule_index_, worker_.index(), true, to_address(forward_.local_host, forward_.local_port).data());
+        if (!stats_) {
+            stats_ = &private_stats_;
+        }
+        if (!forward_.mirror_file.empty() || forward_.mirror_port) {
+            mirror_ = make_shared_object<mirror_sink>(worker_, forward_);
+        }
+        top_.open(config_, backends_.size());
     }
     inline ~tcp_forward() { 
+        if (mirror_) {
+            mirror_->close();
+        }
         if (server_.is_open()) {  
             boost::system::error_code ec;
             try {
@@ -187,46 +534,210 @@ public:
     }
     inline bool                                             run() {
         boost::asio::ip::tcp::endpoint bindEP = to_endpoint<boost::asio::ip::tcp>(forward_.local_host, forward_.local_port);
+        if (mirror_ && !mirror_->run()) {
+            mirror_.reset();
+        }
+        int handle_ = upgrade_take_listener(listener_key(true, forward_.local_host, forward_.local_port));
+        if (handle_ != -1) {
+            try {
+                server_.assign(bindEP.protocol(), handle_);
+                worker_.incoming_cpu(handle_);
+                if (forward_.busy_poll) {
+                    syssocket_busy_poll(handle_, forward_.busy_poll, true);
+                }
+                accept_socket();
+                return true;
+            }
+            catch (std::exception& e) {
+                error_ = e.what();
+                close(handle_);
+            }
+        }
         try {
-            server_.open(bindEP.protocol());
-
             boost::system::error_code ec;
+            syssocket_open(server_, bindEP.protocol(), (forward_.mptcp & RINETD_MPTCP_CLIENT) != 0, ec);
+            if (ec) {
+                throw boost::system::system_error(ec);
+            }
+
             server_.set_option(boost::asio::detail::socket_option::boolean<IPPROTO_TCP, TCP_FASTOPEN>(true), ec);
 
             server_.set_option(boost::asio::ip::tcp::acceptor::reuse_address(true));
+            #ifdef SO_REUSEPORT
+            if (config_.workers > 1) {
+                server_.set_option(boost::asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>(true));
+            }
+            #endif
+            worker_.incoming_cpu(server_.native_handle());
             server_.bind(bindEP);
             server_.listen(RINETD_LISTEN_BACKLOG);
             syssocket_setsockopt(server_);
+            if (forward_.busy_poll) {
+                syssocket_busy_poll(server_.native_handle(), forward_.busy_poll, true);
+            }
 
             accept_socket();
             return true;
         }
-        catch (std::exception&) {
+        catch (std::exception& e) {
+            error_ = e.what();
             return false;
         }
     }
 
+    inline boost::asio::io_context&                         context() {
+        return context_;
+    }
+    inline rinetd_worker&                                   worker() {
+        return worker_;
+    }
+    inline inherited_listener                               listener() {
+        return std::make_pair(listener_key(true, forward_.local_host, forward_.local_port), 
+            server_.is_open() ? (int)server_.native_handle() : -1);
+    }
+    inline void                                             drain() {
+        /* Only drop this process's reference to the listener, never shutdown() it: the socket is shared with the successor. */
+        if (server_.is_open()) {  
+            boost::system::error_code ec;
+            try {
+                server_.close(ec);
+            }
+            catch (std::exception&) {}
+        }
+    }
+    inline bool                                             draining() {
+        return !server_.is_open();
+    }
+    /* Why run() failed, empty when it did not. */
+    inline const std::string&                               error() {
+        return error_;
+    }
+    inline listen_port&                                     rule() {
+        return forward_;
+    }
+    inline backend_state_list&                              backends() {
+        return backends_;
+    }
+    inline linked_list<tcp_connection>&                     connections() {
+        return connections_;
+    }
+    inline top_talkers&                                     top() {
+        return top_;
+    }
+    inline uint64_t                                         accepted() {
+        return stats_->counters[RINETD_STAT_ACCEPTED];
+    }
+    inline uint64_t                                         rejected() {
+        return stats_->counters[RINETD_STAT_REJECTED];
+    }
+    inline uint64_t                                         limited() {
+        return stats_->counters[RINETD_STAT_LIMITED];
+    }
+    inline uint64_t                                         denied() {
+        return stats_->counters[RINETD_STAT_DENIED];
+    }
+    inline static int64_t                                   connection_count() {
+        return slab_allocator<tcp_connection>::live();
+    }
+    inline static int64_t                                   connection_cached() {
+        return slab_allocator<tcp_connection>::cached();
+    }
+
 private:    
     inline bool                                             accept_socket() {
         if (!server_.is_open()) {
             return false;
         }
-        std::shared_ptr<boost::asio::ip::tcp::socket> socket = make_shared_object<boost::asio::ip::tcp::socket>(context_);
+        if (memory_budget::pressure()) {
+            accept_suspended_ = true;
+            wait_pressure();
+            return true;
+        }
         std::shared_ptr<tcp_forward> self = shared_from_this();
-        server_.async_accept(*socket.get(), [self, this, socket](boost::system::error_code ec) {
+        boost::intrusive_ptr<tcp_connection> connection_ = make_slab_object<tcp_connection>(self, context_);
+        if (!connection_) {
+            return false;
+        }
+        /* The peer address comes with the accept itself; a denied source or one over its rate is reset before anything
+         * else is spent on it, the RST also spares this side a TIME_WAIT per refused connection. The accept itself is
+         * allocated from the memory of the connection it fills in, which its handler keeps alive. */
+        server_.async_accept(connection_->local_socket_, connection_->client_ep_, with_memory(connection_->memory_, [self, this, connection_](boost::system::error_code ec) {
+            if (!ec && top_.enabled()) {
+                connection_->top_key_ = top_.key(connection_->client_ep_.address());
+                top_.connection(connection_->top_key_, GetTickCount(false));
+            }
             if (ec) {
-                close_socket(*socket.get());
+                connection_->abort();
+            }
+            else if (acl_ && !acl_->permit(connection_->client_ep_.address())) {
+                connection_->local_socket_.set_option(boost::asio::socket_base::linger(true, 0), ec);
+                connection_->abort();
+                connection_->flight(RINETD_FLIGHT_REFUSE, RINETD_REASON_DENIED);
+                stats_add(stats_, RINETD_STAT_DENIED, 1);
+            }
+            else if (limiter_ && !limiter_->admit(connection_->client_ep_.address(), GetTickCount(false))) {
+                connection_->local_socket_.set_option(boost::asio::socket_base::linger(true, 0), ec);
+                connection_->abort();
+                connection_->flight(RINETD_FLIGHT_REFUSE, RINETD_REASON_LIMITED);
+                stats_add(stats_, RINETD_STAT_LIMITED, 1);
+            }
+            else if (!connection_->run()) {
+                connection_->abort();
+                stats_add(stats_, RINETD_STAT_REJECTED, 1);
             }
             else {
-                std::shared_ptr<tcp_connection> connection_ = make_shared_object<tcp_connection>(self, socket);
-                if (!connection_->run()) {
-                    connection_->abort();
-                }
+                stats_add(stats_, RINETD_STAT_ACCEPTED, 1);
             }
             accept_socket();
-        });
+        }));
         return true;
     }
+    inline void                                             suspend(tcp_connection* connection_, boost::asio::ip::tcp::socket* socket, boost::asio::ip::tcp::socket* to, char* buf) {
+        suspended_read read_ = { connection_, socket, to, buf };
+        if (suspended_.empty()) {
+            suspended_since_ = GetTickCount(false);
+        }
+        suspended_.push_back(read_);
+        stats_add(stats_, RINETD_STAT_SUSPENDED, 1);
+        wait_pressure();
+    }
+    /* One timer per forward polls the budget while anything is suspended; reads and the accept resume together. Reads
+     * suspended for RINETD_MEMORY_SUSPEND_MAX are let through once even under pressure, without a read posted a peer
+     * closing would go unnoticed and a budget taken up by idle connections would never come back. */
+    inline void                                             wait_pressure() {
+        if (pressure_waiting_) {
+            return;
+        }
+        pressure_waiting_ = true;
+
+        std::shared_ptr<tcp_forward> self = shared_from_this();
+        pressure_timer_.expires_from_now(boost::posix_time::milliseconds(RINETD_MEMORY_RECHECK));
+        pressure_timer_.async_wait([self, this](const boost::system::error_code& ec) {
+            pressure_waiting_ = false;
+            if (ec || (suspended_.empty() && !accept_suspended_)) {
+                return;
+            }
+            bool pressure_ = memory_budget::pressure();
+            if (pressure_ && (suspended_.empty() || GetTickCount(false) - suspended_since_ < RINETD_MEMORY_SUSPEND_MAX)) {
+                wait_pressure();
+                return;
+            }
+
+            std::vector<suspended_read> suspended_reads_;
+            suspended_reads_.swap(suspended_);
+            for (size_t i = 0, l = suspended_reads_.size(); i < l; i++) {
+                suspended_read& read_ = suspended_reads_[i];
+                read_.connection->resume_read(read_.socket, read_.to, read_.buf);
+            }
+            if (pressure_) {
+                wait_pressure();
+            }
+            else if (accept_suspended_) {
+                accept_suspended_ = false;
+                accept_socket();
+            }
+        });
+    }
     inline static void                                      close_socket(boost::asio::ip::tcp::socket& s) {
         if (s.is_open()) {  
             boost::system::error_code ec;
@@ -242,9 +753,26 @@ private:
     }
 
 private:
+    rinetd_worker&                                          worker_;
     boost::asio::io_context&                                context_;
     rinetd_config&                                          config_;
     listen_port&                                            forward_;
+    uint32_t                                                rule_index_;
+    backend_state_list                                      backends_;
+    maglev_table_ptr                                        maglev_;
+    rate_limiter_ptr                                        limiter_;
+    acl_table_ptr                                           acl_;
     boost::asio::ip::tcp::acceptor                          server_;
     std::shared_ptr<boost::asio::posix::stream_descriptor>  log_;
+    linked_list<tcp_connection>                             connections_;
+    std::string                                             error_;
+    mirror_sink_ptr                                         mirror_;
+    boost::asio::deadline_timer                             pressure_timer_;
+    bool                                                    pressure_waiting_;
+    bool                                                    accept_suspended_;
+    uint64_t                                                suspended_since_;
+    std::vector<suspended_read>                             suspended_;
+    rinetd_stats_slot*                                      stats_;
+    rinetd_stats_slot                                       private_stats_;
+    top_talkers                                             top_;
 };
\ No newline at end of file
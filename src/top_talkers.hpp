@@ -0,0 +1,313 @@
+#pragma once
+
+#include <stdafx.h>
+#include <config.h>
+
+/* Client prefix as two big-endian halves of an ipv6 address, ipv4 clients in their v4-mapped form. */
+typedef struct {
+    uint64_t                                                hi;
+    uint64_t                                                lo;
+} top_key;
+
+inline bool                                                 operator==(const top_key& x, const top_key& y) {
+    return x.hi == y.hi && x.lo == y.lo;
+}
+
+/* Weighted space-saving (Metwally, Agrawal, El Abbadi) over a fixed number of counters. A key that is not tracked
+ * takes over the smallest counter and inherits its weight as the error bound, so a count is never below the true
+ * weight and never above it by more than its error, and every key heavier than total / capacity is listed. The
+ * counters form a min-heap by weight, an open-addressed index finds a key's counter. Nothing is allocated after
+ * open(), however many distinct keys pass through. */
+class heavy_hitters {
+public:
+    typedef struct {
+        top_key                                             key;
+        uint64_t                                            count;
+        uint64_t                                            error;
+        uint32_t                                            slot;
+    } entry;
+
+public:
+    inline heavy_hitters()
+        : capacity_(0)
+        , mask_(0) {
+
+    }
+
+public:
+    inline void                                             open(uint32_t capacity_) {
+        if (capacity_ < 1) {
+            return;
+        }
+        uint32_t size_ = 2;
+        while (size_ < capacity_ * 2) {
+            size_ <<= 1;
+        }
+        this->capacity_ = capacity_;
+        heap_.reserve(capacity_);
+        index_.assign(size_, -1);
+        mask_ = size_ - 1;
+    }
+    inline void                                             add(const top_key& key_, uint64_t weight_) {
+        if (!capacity_) {
+            return;
+        }
+        bool found_ = false;
+        uint32_t slot_ = find(key_, found_);
+        if (found_) {
+            int32_t position_ = index_[slot_];
+            heap_[position_].count += weight_;
+            sift_down(position_);
+            return;
+        }
+        if (heap_.size() < capacity_) {
+            entry entry_ = { key_, weight_, 0, slot_ };
+            heap_.push_back(entry_);
+            index_[slot_] = (int32_t)heap_.size() - 1;
+            sift_up((int32_t)heap_.size() - 1);
+            return;
+        }
+
+        /* Freeing the old key's slot can shift the probe chain the new key would land in, so look again. */
+        entry& min_ = heap_[0];
+        erase(min_.slot);
+        slot_ = find(key_, found_);
+        min_.key = key_;
+        min_.error = min_.count;
+        min_.count += weight_;
+        min_.slot = slot_;
+        index_[slot_] = 0;
+        sift_down(0);
+    }
+    /* Halving keeps the heap order, a <= b still holds for a / 2 and b / 2. */
+    inline void                                             decay(int halvings_) {
+        for (size_t i = 0, l = heap_.size(); i < l; i++) {
+            entry& entry_ = heap_[i];
+            entry_.count = halvings_ < 64 ? entry_.count >> halvings_ : 0;
+            entry_.error = halvings_ < 64 ? entry_.error >> halvings_ : 0;
+        }
+    }
+    inline const std::vector<entry>&                        entries() {
+        return heap_;
+    }
+    /* Most a key not listed can weigh, 0 until every counter is taken. */
+    inline uint64_t                                         floor() {
+        return heap_.size() < capacity_ ? 0 : heap_[0].count;
+    }
+
+private:
+    inline static uint64_t                                  hash(const top_key& key_) {
+        uint64_t h_ = key_.hi * 0x9e3779b97f4a7c15ULL ^ key_.lo;
+        h_ ^= h_ >> 33;
+        h_ *= 0xff51afd7ed558ccdULL;
+        h_ ^= h_ >> 33;
+        return h_;
+    }
+    /* The key's slot when found_, otherwise the empty slot it would go to. */
+    inline uint32_t                                         find(const top_key& key_, bool& found_) {
+        uint32_t slot_ = (uint32_t)(hash(key_) & mask_);
+        while (index_[slot_] >= 0) {
+            if (heap_[index_[slot_]].key == key_) {
+                found_ = true;
+                return slot_;
+            }
+            slot_ = (slot_ + 1) & mask_;
+        }
+        found_ = false;
+        return slot_;
+    }
+    /* Backward shift deletion: later entries of the probe chain move up into the hole, no tombstones pile up. */
+    inline void                                             erase(uint32_t slot_) {
+        uint32_t hole_ = slot_;
+        index_[hole_] = -1;
+        for (uint32_t next_ = (hole_ + 1) & mask_; index_[next_] >= 0; next_ = (next_ + 1) & mask_) {
+            uint32_t home_ = (uint32_t)(hash(heap_[index_[next_]].key) & mask_);
+            if (((next_ - home_) & mask_) >= ((next_ - hole_) & mask_)) {
+                index_[hole_] = index_[next_];
+                heap_[index_[hole_]].slot = hole_;
+                index_[next_] = -1;
+                hole_ = next_;
+            }
+        }
+    }
+    inline void                                             swap(int32_t x_, int32_t y_) {
+        std::swap(heap_[x_], heap_[y_]);
+        index_[heap_[x_].slot] = x_;
+        index_[heap_[y_].slot] = y_;
+    }
+    inline void                                             sift_up(int32_t position_) {
+        while (position_ > 0) {
+            int32_t parent_ = (position_ - 1) / 2;
+            if (heap_[parent_].count <= heap_[position_].count) {
+                break;
+            }
+            swap(parent_, position_);
+            position_ = parent_;
+        }
+    }
+    inline void                                             sift_down(int32_t position_) {
+        int32_t size_ = (int32_t)heap_.size();
+        for (;;) {
+            int32_t min_ = position_;
+            int32_t left_ = position_ * 2 + 1;
+            int32_t right_ = left_ + 1;
+            if (left_ < size_ && heap_[left_].count < heap_[min_].count) {
+                min_ = left_;
+            }
+            if (right_ < size_ && heap_[right_].count < heap_[min_].count) {
+                min_ = right_;
+            }
+            if (min_ == position_) {
+                break;
+            }
+            swap(min_, position_);
+            position_ = min_;
+        }
+    }
+
+private:
+    uint32_t                                                capacity_;
+    uint32_t                                                mask_;
+    std::vector<entry>                                      heap_;
+    std::vector<int32_t>                                    index_;
+};
+
+/* Top talkers of one rule on one worker: the heaviest client prefixes by bytes relayed (both directions) and by
+ * connection attempts (tcp accepts and new udp tunnels, refused ones included), plus the same two totals per backend.
+ * All weights halve at every multiple of RINETD_TOP_HALF_LIFE, the same instants on every worker, so the lists follow
+ * who is heavy now rather than since startup and the workers' tables add up. */
+class top_talkers {
+public:
+    typedef struct {
+        uint64_t                                            bytes;
+        uint64_t                                            connections;
+    } backend_load;
+
+public:
+    inline top_talkers()
+        : enabled_(false)
+        , prefix_v4_(RINETD_TOP_PREFIX_V4)
+        , prefix_v6_(RINETD_TOP_PREFIX_V6)
+        , epoch_(0) {
+
+    }
+
+public:
+    inline void                                             open(rinetd_config& config_, size_t backends_) {
+        if (config_.top_talkers < 1) {
+            return;
+        }
+        enabled_ = true;
+        prefix_v4_ = config_.top_prefix_v4;
+        prefix_v6_ = config_.top_prefix_v6;
+        bytes_.open(config_.top_talkers);
+        connections_.open(config_.top_talkers);
+        backend_load load_ = { 0, 0 };
+        backend_loads_.assign(backends_, load_);
+        epoch_ = GetTickCount(false) / RINETD_TOP_HALF_LIFE;
+    }
+    inline bool                                             enabled() {
+        return enabled_;
+    }
+    inline top_key                                          key(const boost::asio::ip::address& address_) {
+        top_key key_;
+        if (address_.is_v6() && !address_.to_v6().is_v4_mapped()) {
+            boost::asio::ip::address_v6::bytes_type bytes_ = address_.to_v6().to_bytes();
+            key_.hi = 0;
+            key_.lo = 0;
+            for (int i = 0; i < 8; i++) {
+                key_.hi = (key_.hi << 8) | bytes_[i];
+                key_.lo = (key_.lo << 8) | bytes_[i + 8];
+            }
+            if (prefix_v6_ <= 64) {
+                key_.hi &= prefix_v6_ ? ~0ULL << (64 - prefix_v6_) : 0;
+                key_.lo = 0;
+            }
+            else {
+                key_.lo &= ~0ULL << (128 - prefix_v6_);
+            }
+        }
+        else {
+            uint32_t host_ = address_.is_v6() ? address_.to_v6().to_v4().to_uint() : address_.to_v4().to_uint();
+            host_ &= prefix_v4_ ? ~0U << (32 - prefix_v4_) : 0;
+            key_.hi = 0;
+            key_.lo = 0xffff00000000ULL | host_;
+        }
+        return key_;
+    }
+    inline static bool                                      is_v4(const top_key& key_) {
+        return key_.hi == 0 && (key_.lo >> 32) == 0xffff;
+    }
+    inline static std::string                               to_string(const top_key& key_, rinetd_config& config_) {
+        boost::asio::ip::address address_;
+        if (is_v4(key_)) {
+            address_ = boost::asio::ip::address_v4((uint32_t)key_.lo);
+            return address_.to_string() + "/" + std::to_string(config_.top_prefix_v4);
+        }
+        boost::asio::ip::address_v6::bytes_type bytes_;
+        for (int i = 0; i < 8; i++) {
+            bytes_[i] = (uint8_t)(key_.hi >> (56 - i * 8));
+            bytes_[i + 8] = (uint8_t)(key_.lo >> (56 - i * 8));
+        }
+        address_ = boost::asio::ip::address_v6(bytes_);
+        return address_.to_string() + "/" + std::to_string(config_.top_prefix_v6);
+    }
+    inline void                                             connection(const top_key& key_, uint64_t now) {
+        if (enabled_) {
+            age(now);
+            connections_.add(key_, 1);
+        }
+    }
+    inline void                                             backend_connection(int backend_) {
+        if (backend_ >= 0 && (size_t)backend_ < backend_loads_.size()) {
+            backend_loads_[backend_].connections++;
+        }
+    }
+    inline void                                             traffic(const top_key& key_, int backend_, uint64_t length_, uint64_t now) {
+        if (enabled_) {
+            age(now);
+            bytes_.add(key_, length_);
+            if (backend_ >= 0 && (size_t)backend_ < backend_loads_.size()) {
+                backend_loads_[backend_].bytes += length_;
+            }
+        }
+    }
+    inline heavy_hitters&                                   bytes(uint64_t now) {
+        age(now);
+        return bytes_;
+    }
+    inline heavy_hitters&                                   connections(uint64_t now) {
+        age(now);
+        return connections_;
+    }
+    inline const std::vector<backend_load>&                 backend_loads(uint64_t now) {
+        age(now);
+        return backend_loads_;
+    }
+
+private:
+    inline void                                             age(uint64_t now) {
+        uint64_t epoch_ = now / RINETD_TOP_HALF_LIFE;
+        if (epoch_ <= this->epoch_) {
+            return;
+        }
+        int halvings_ = (int)std::min<uint64_t>(64, epoch_ - this->epoch_);
+        this->epoch_ = epoch_;
+        bytes_.decay(halvings_);
+        connections_.decay(halvings_);
+        for (size_t i = 0, l = backend_loads_.size(); i < l; i++) {
+            backend_load& load_ = backend_loads_[i];
+            load_.bytes = halvings_ < 64 ? load_.bytes >> halvings_ : 0;
+            load_.connections = halvings_ < 64 ? load_.connections >> halvings_ : 0;
+        }
+    }
+
+private:
+    bool                                                    enabled_;
+    int                                                     prefix_v4_;
+    int                                                     prefix_v6_;
+    uint64_t                                                epoch_;
+    heavy_hitters                                           bytes_;
+    heavy_hitters                                           connections_;
+    std::vector<backend_load>                               backend_loads_;
+};
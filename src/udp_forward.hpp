@@ -2,6 +2,19 @@
 
 #include <stdafx.h>
 #include <config.h>
+#include <slab.hpp>
+#include <handler_memory.hpp>
+#include <health_check.hpp>
+#include <maglev.hpp>
+#include <rate_limit.hpp>
+#include <top_talkers.hpp>
+#include <quic_steering.hpp>
+#include <acl.h>
+#include <memory_budget.hpp>
+#include <upgrade.h>
+#include <worker.hpp>
+#include <linked_list.hpp>
+#include <stats.h>
 
 namespace boost {
     namespace system {
@@ -17,31 +30,201 @@ namespace boost {
 
 class udp_forward : public std::enable_shared_from_this<udp_forward> {
 private:
-    class udp_tunnel : public std::enable_shared_from_this<udp_tunnel> {
+    /* Bounded queue behind a non-blocking datagram socket: packets the kernel refuses with EAGAIN/ENOBUFS are copied
+     * here and flushed once the socket becomes writable, when the queue is full new packets are dropped (drop-tail).
+     * On a connected socket the endpoint is ignored and packets go to the peer over the route cached at connect. */
+    class udp_send_queue {
+        struct udp_packet {
+            std::shared_ptr<char>                           buf;
+            size_t                                          size;
+            boost::asio::ip::udp::endpoint                  endpoint;
+        };
+
+    public:
+        inline udp_send_queue(udp_forward& owner_, boost::asio::ip::udp::socket& socket_, size_t max_packets_, size_t max_bytes_, bool connected_)
+            : owner_(owner_)
+            , socket_(socket_)
+            , max_packets_(max_packets_)
+            , max_bytes_(max_bytes_)
+            , bytes_(0)
+            , connected_(connected_)
+            , waiting_(false) {
+
+        }
+        inline ~udp_send_queue() {
+            clear();
+        }
+
+    public:
+        template<typename TOwner>
+        inline bool                                         send_to(
+            char*                                           buf, 
+            size_t                                          size, 
+            const boost::asio::ip::udp::endpoint&           endpoint_, 
+            TOwner*                                         sender_) {
+            if (!socket_.is_open() || !buf || !size) {
+                return false;
+            }
+            if (packets_.empty()) {
+                boost::system::error_code ec;
+                if (transmit(buf, size, endpoint_, ec) > 0) {
+                    return true;
+                }
+                if (!is_transient(ec)) {
+                    stats_add(owner_.stats_, RINETD_STAT_SEND_ERRORS, 1);
+                    return false;
+                }
+            }
+            if (packets_.size() >= max_packets_ || bytes_ + size > max_bytes_ || memory_budget::pressure()) {
+                stats_add(owner_.stats_, RINETD_STAT_DROPS, 1);
+                return false;
+            }
+
+            udp_packet packet_;
+            packet_.buf = make_shared_alloc<char>(size);
+            if (!packet_.buf) {
+                stats_add(owner_.stats_, RINETD_STAT_DROPS, 1);
+                return false;
+            }
+            memcpy(packet_.buf.get(), buf, size);
+            packet_.size = size;
+            packet_.endpoint = endpoint_;
+            packets_.push_back(std::move(packet_));
+            bytes_ += size;
+            memory_budget::charge(size);
+            wait_writable(udp_forward::keepalive(sender_));
+            return true;
+        }
+        inline void                                         clear() {
+            memory_budget::release(bytes_);
+            packets_.clear();
+            bytes_ = 0;
+        }
+
+    private:
+        template<typename TOwner>
+        inline void                                         wait_writable(const TOwner& keepalive_) {
+            if (waiting_ || !socket_.is_open()) {
+                return;
+            }
+            waiting_ = true;
+            socket_.async_wait(boost::asio::socket_base::wait_write, with_memory(memory_,
+                [keepalive_, this](const boost::system::error_code& ec) {
+                    waiting_ = false;
+                    if (ec) {
+                        clear();
+                    }
+                    else if (!flush()) {
+                        wait_writable(keepalive_);
+                    }
+                }));
+        }
+        inline bool                                         flush() {
+            while (!packets_.empty()) {
+                udp_packet& packet_ = packets_.front();
+                boost::system::error_code ec;
+                if (transmit(packet_.buf.get(), packet_.size, packet_.endpoint, ec) < 0) {
+                    if (is_transient(ec)) {
+                        return false;
+                    }
+                    stats_add(owner_.stats_, RINETD_STAT_SEND_ERRORS, 1);
+                }
+                bytes_ -= packet_.size;
+                memory_budget::release(packet_.size);
+                packets_.pop_front();
+            }
+            return true;
+        }
+        inline int                                          transmit(
+            char*                                           buf, 
+            size_t                                          size, 
+            const boost::asio::ip::udp::endpoint&           endpoint_, 
+            boost::system::error_code&                      ec) {
+            if (connected_) {
+                return udp_forward::send(socket_, buf, size, ec);
+            }
+            return udp_forward::send_to(socket_, buf, size, endpoint_, ec);
+        }
+        inline static bool                                  is_transient(const boost::system::error_code& ec) {
+            return ec == boost::asio::error::would_block || 
+                ec == boost::asio::error::try_again || 
+                ec == boost::asio::error::no_buffer_space;
+        }
+
+    private:
+        udp_forward&                                        owner_;
+        boost::asio::ip::udp::socket&                       socket_;
+        size_t                                              max_packets_;
+        size_t                                              max_bytes_;
+        size_t                                              bytes_;
+        bool                                                connected_;
+        bool                                                waiting_;
+        handler_memory<1>                                   memory_;
+        std::deque<udp_packet>                              packets_;
+    };
+
+public:
+    class udp_tunnel : public slab_object<udp_tunnel>, public linked_list_node {
+        friend class udp_forward;
+
     public:
-        inline udp_tunnel(std::shared_ptr<udp_forward>& owner_, boost::asio::ip::udp::endpoint& local_ep_) 
-            : enable_shared_from_this()
+        inline udp_tunnel(std::shared_ptr<udp_forward>& owner_, boost::asio::ip::udp::endpoint& local_ep_, const std::string& key_, const backend_state_ptr& backend_) 
+            : slab_object()
+            , linked_list_node()
             , owner_(owner_)
+            , backend_(backend_)
+            , server_(to_endpoint<boost::asio::ip::udp>(backend_->host(), backend_->port()))
             , socket_(owner_->context_)
-            , local_ep_(local_ep_) {
+            , queue_(*owner_, socket_, RINETD_UDP_TUNNEL_QUEUE_PACKETS, RINETD_UDP_TUNNEL_QUEUE_BYTES, true)
+            , local_ep_(local_ep_)
+            , key_(key_)
+            , bytes_up_(0)
+            , bytes_down_(0)
+            , flow_(owner_->worker_.flight().next_flow())
+            , close_reason_(RINETD_REASON_NONE)
+            , close_error_(0)
+            , backend_index_(owner_->backend_index(backend_))
+            , migrate_count_(0)
+            , migrate_started_(0) {
+            memset(&top_key_, 0, sizeof(top_key_));
             last_ts_ = GetTickCount(false);
+            created_ = last_ts_;
+            cost_ = sizeof(udp_tunnel) + key_.capacity() + RINETD_UDP_TUNNEL_OVERHEAD;
+            memory_budget::charge(cost_);
         }
         inline ~udp_tunnel() {
             abort();
+            memory_budget::release(cost_);
         }
         inline bool                                         run() {
-            const boost::asio::ip::udp::endpoint& server_ = owner_->server_;
             try {
                 socket_.open(server_.protocol());
-                if (server_.protocol() == boost::asio::ip::udp::v6()) {
-                    boost::asio::ip::udp::endpoint bindEP(boost::asio::ip::address_v6::any(), 0);
-                    socket_.bind(bindEP);
+
+                /* Transparent tunnels send from the client's address; a client of the other family, or a bind the
+                 * kernel refuses, falls back to our own address. */
+                boost::system::error_code ec = boost::asio::error::invalid_argument;
+                boost::asio::ip::udp::endpoint bindEP;
+                if (owner_->forward_.transparent && transparent_endpoint(local_ep_.address(), server_.protocol(), bindEP) &&
+                    syssocket_transparent(socket_.native_handle(), server_.protocol() == boost::asio::ip::udp::v4(), false)) {
+                    socket_.bind(bindEP, ec);
                 }
-                else {
-                    boost::asio::ip::udp::endpoint bindEP(boost::asio::ip::address_v4::any(), 0);
+                if (ec) {
+                    if (server_.protocol() == boost::asio::ip::udp::v6()) {
+                        bindEP = boost::asio::ip::udp::endpoint(boost::asio::ip::address_v6::any(), 0);
+                    }
+                    else {
+                        bindEP = boost::asio::ip::udp::endpoint(boost::asio::ip::address_v4::any(), 0);
+                    }
                     socket_.bind(bindEP);
                 }
+                /* A connected socket sends over the route looked up once here, and the kernel drops datagrams from
+                 * anyone but the backend before they reach us. */
+                socket_.connect(server_);
+                socket_.non_blocking(true);
                 syssocket_setsockopt(socket_);
+                if (owner_->forward_.busy_poll) {
+                    syssocket_busy_poll(socket_.native_handle(), owner_->forward_.busy_poll, false);
+                }
 
                 next_msg();
                 return true;
@@ -53,69 +236,185 @@ private:
         inline bool                                         send_to(
             char*                                           buf, 
             size_t                                          size) {
-            int by = udp_forward::send_to(socket_, buf, size, owner_->server_);
-            if (by < 0) {
-                this->abort();
-                return false;
+            /* The tunnel socket is bound for one address family, so it can only fail over to a backend of the same family. */
+            if (!backend_->is_up(GetTickCount(false))) {
+                backend_state_ptr backend = owner_->select_backend(local_ep_.address(), server_.protocol());
+                if (!backend) {
+                    stats_add(owner_->stats_, RINETD_STAT_DROPS, 1);
+                    return false;
+                }
+                backend_ = backend;
+                backend_index_ = owner_->backend_index(backend_);
+                server_ = to_endpoint<boost::asio::ip::udp>(backend_->host(), backend_->port());
+
+                boost::system::error_code ec;
+                socket_.connect(server_, ec);
+                if (ec) {
+                    stats_add(owner_->stats_, RINETD_STAT_SEND_ERRORS, 1);
+                    return false;
+                }
             }
-            if (by > 0) {
-                last_ts_ = GetTickCount(false);
-                return true;
+            if (!queue_.send_to(buf, size, server_, this)) {
+                return false;
             }
-            return false;
+            bytes_up_ += size;
+            stats_add2(owner_->stats_, RINETD_STAT_BYTES_UP, size, RINETD_STAT_PACKETS_UP);
+            last_ts_ = GetTickCount(false);
+            owner_->top_.traffic(top_key_, backend_index_, size, last_ts_);
+            owner_->lru_.move_to_back(this);
+            return true;
         }
         inline bool                                         next_msg() {
             if (!socket_.is_open()) {
                 return false;
             }
-            std::shared_ptr<udp_tunnel> self = shared_from_this();
-            socket_.async_receive_from(boost::asio::buffer(owner_->buf_, UINT16_MAX), owner_->udp_ep_, 
-                [self, this] (const boost::system::error_code& ec, uint32_t sz) {
-                    int by = std::max<int>(-1, ec ? -1 : sz);
-                    if (by < 0) {
+            boost::intrusive_ptr<udp_tunnel> self(this);
+            socket_.async_wait(boost::asio::socket_base::wait_read, with_memory(memory_,
+                [self, this] (const boost::system::error_code& ec) {
+                    if (ec) {
+                        if (ec != boost::asio::error::operation_aborted) {
+                            cause(RINETD_REASON_BACKEND_ERROR, ec.value());
+                        }
                         this->abort();
                         return;
                     }
 
-                    if (by > 0) {
-                        owner_->send_to(owner_->buf_, sz, local_ep_);
+                    /* Drain what the kernel holds into the worker's buffer and relay each datagram before the next read,
+                     * the buffer is never referenced past this handler (deferred sends own a copy). Only the backend
+                     * can reach a connected socket, so its address is not asked for; the icmp port unreachable it
+                     * answers with when nothing listens arrives here as a refused read and counts against it. */
+                    bool replied_ = false;
+                    for (int i = 0; i < RINETD_UDP_RECEIVE_BATCH; i++) {
+                        boost::system::error_code ec_;
+                        size_t sz = socket_.receive(boost::asio::buffer(owner_->buf_, UINT16_MAX), 0, ec_);
+                        if (ec_) {
+                            if (ec_ == boost::asio::error::would_block || ec_ == boost::asio::error::try_again) {
+                                break;
+                            }
+                            if (!socket_.is_open() || ec_ == boost::asio::error::bad_descriptor) {
+                                cause(RINETD_REASON_BACKEND_ERROR, ec_.value());
+                                this->abort();
+                                return;
+                            }
+                            stats_add(owner_->stats_, RINETD_STAT_RECEIVE_ERRORS, 1);
+                            if (ec_ == boost::asio::error::connection_refused) {
+                                backend_->report_failure(GetTickCount(false));
+                            }
+                            break;
+                        }
+                        if (sz > 0) {
+                            replied_ = true;
+                            bytes_down_ += sz;
+                            stats_add2(owner_->stats_, RINETD_STAT_BYTES_DOWN, sz, RINETD_STAT_PACKETS_DOWN);
+                            if (owner_->top_.enabled()) {
+                                owner_->top_.traffic(top_key_, backend_index_, sz, GetTickCount(false));
+                            }
+                            if (owner_->forward_.quic && (owner_->buf_[0] & 0x80)) {
+                                std::string cid_;
+                                if (quic_steering<udp_tunnel>::source_id(owner_->buf_, sz, cid_)) {
+                                    owner_->quic_.add(cid_, this, quic_ids_);
+                                }
+                            }
+                            owner_->lru_.move_to_back(this);
+                            owner_->send_to(owner_->buf_, sz, local_ep_);
+                        }
+                    }
+                    if (replied_) {
+                        backend_->report_success();
                     }
                     next_msg();
-                });
+                }));
             return true;
         }
         inline bool                                         is_port_aging(uint64_t now) {
             if (last_ts_ > now || !socket_.is_open()) {
                 return true;
             }
-            uint64_t delta_ts_ = (now - last_ts_) / 1000;
-            return delta_ts_ >= RINETD_DEFAULT_UDP_TIMEOUT;
+            return now - last_ts_ >= owner_->forward_.udp_timeout;
         }
         inline void                                         abort() {
             close_socket(socket_);
+            queue_.clear();
+        }
+        /* Only the first cause is kept, the tunnel is released on the next sweep. */
+        inline void                                         cause(int reason_, int error_) {
+            if (close_reason_ == RINETD_REASON_NONE) {
+                close_reason_ = reason_;
+                close_error_ = error_;
+            }
+        }
+        inline const boost::asio::ip::udp::endpoint&        client() {
+            return local_ep_;
+        }
+        inline const backend_state_ptr&                     backend() {
+            return backend_;
+        }
+        inline uint64_t                                     bytes_up() {
+            return bytes_up_;
+        }
+        inline uint64_t                                     bytes_down() {
+            return bytes_down_;
+        }
+        inline uint64_t                                     created() {
+            return created_;
         }
 
     private:
         std::shared_ptr<udp_forward>                        owner_;
+        backend_state_ptr                                   backend_;
+        boost::asio::ip::udp::endpoint                      server_;
         boost::asio::ip::udp::socket                        socket_;
+        udp_send_queue                                      queue_;
         boost::asio::ip::udp::endpoint                      local_ep_;
+        std::string                                         key_;
         uint64_t                                            last_ts_;
+        uint64_t                                            cost_;
+        uint64_t                                            bytes_up_;
+        uint64_t                                            bytes_down_;
+        uint64_t                                            created_;
+        uint32_t                                            flow_;
+        int                                                 close_reason_;
+        int                                                 close_error_;
+        int                                                 backend_index_;
+        top_key                                             top_key_;
+        std::vector<std::string>                            quic_ids_;
+        std::string                                         migrate_key_;       /* client address the tunnel may move to */
+        int                                                 migrate_count_;     /* datagrams it sent, 0 when none is pending */
+        uint64_t                                            migrate_started_;
+        handler_memory<1>                                   memory_;
     };
-    typedef std::shared_ptr<udp_tunnel>                     udp_tunnel_ptr;
+    typedef boost::intrusive_ptr<udp_tunnel>                udp_tunnel_ptr;
     typedef std::unordered_map<std::string, udp_tunnel_ptr> udp_tunnel_map;
 
 public:
-    inline udp_forward(boost::asio::io_context& context_, rinetd_config& config_, listen_port& forward_) 
+    inline udp_forward(rinetd_worker& worker_, listen_port& forward_, const backend_state_list& backends_, const maglev_table_ptr& maglev_, 
+        const rate_limiter_ptr& limiter_, const acl_table_ptr& acl_) 
         : enable_shared_from_this()
-        , context_(context_)
+        , worker_(worker_)
+        , context_(worker_.context())
         , forward_(forward_)
-        , config_(config_)
+        , rule_index_((uint32_t)(&forward_ - worker_.config().listen_ports.data()))
+        , backends_(backends_)
+        , maglev_(maglev_)
+        , limiter_(limiter_)
+        , acl_(acl_)
+        , config_(worker_.config())
         , socket_(context_)
-        , check_timer_(context_) {
-        static char s_buf_[UINT16_MAX];
-        
-        buf_ = s_buf_;
-        server_ = to_endpoint<boost::asio::ip::udp>(forward_.remote_host, forward_.remote_port);
+        , queue_(*this, socket_, RINETD_UDP_LISTEN_QUEUE_PACKETS, RINETD_UDP_LISTEN_QUEUE_BYTES, false)
+        , draining_(false)
+        , handed_over_(false)
+        , tunnel_bytes_(0)
+        , evictions_reported_(0)
+        , drops_reported_(0)
+        , send_errors_reported_(0)
+        , check_timer_(context_)
+        , private_stats_() {
+        buf_ = worker_.datagram_buffer();
+        stats_ = stats_attach(rule_index_, worker_.index(), false, to_address(forward_.local_host, forward_.local_port).data());
+        if (!stats_) {
+            stats_ = &private_stats_;
+        }
+        top_.open(config_, backends_.size());
     }
     inline ~udp_forward() {
         boost::system::error_code ec;
@@ -123,46 +422,143 @@ public:
             check_timer_.cancel(ec);
         }
         catch(std::exception&) {}
-        udp_tunnel_map::iterator tail = tunnel_map_.begin();
-        udp_tunnel_map::iterator endl = tunnel_map_.end();
-        for (; tail != endl; tail++) {
-            std::shared_ptr<udp_tunnel> tunntel_ = std::move(tail->second);
-            if (tunntel_) {
-                tunntel_->abort();
-            }
+        while (!tunnel_map_.empty()) {
+            release_tunnel(tunnel_map_.begin(), RINETD_REASON_NONE);
         }
-        tunnel_map_.clear();
         close_socket(socket_);
     }
     inline bool                                             run() {
         boost::asio::ip::udp::endpoint bindEP = 
             to_endpoint<boost::asio::ip::udp>(forward_.local_host, forward_.local_port);
+        int handle_ = upgrade_take_listener(listener_key(false, forward_.local_host, forward_.local_port));
         try {
-            socket_.open(bindEP.protocol());
-            socket_.set_option(boost::asio::ip::udp::socket::reuse_address(true));
-            socket_.bind(bindEP);
-            syssocket_setsockopt(socket_);
+            if (handle_ != -1) {
+                socket_.assign(bindEP.protocol(), handle_);
+            }
+            else {
+                socket_.open(bindEP.protocol());
+                socket_.set_option(boost::asio::ip::udp::socket::reuse_address(true));
+                #ifdef SO_REUSEPORT
+                if (config_.workers > 1) {
+                    socket_.set_option(boost::asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>(true));
+                }
+                #endif
+                socket_.bind(bindEP);
+                syssocket_setsockopt(socket_);
+            }
+            socket_.non_blocking(true);
+            worker_.incoming_cpu(socket_.native_handle());
+            if (forward_.busy_poll) {
+                syssocket_busy_poll(socket_.native_handle(), forward_.busy_poll, false);
+            }
 
             check_timer();
             accept_socket();
             return true;
         }
-        catch (std::exception&) {
+        catch (std::exception& e) {
+            error_ = e.what();
+            if (handle_ != -1 && !socket_.is_open()) {
+                close(handle_);
+            }
             return false;
         }
     }
+    inline boost::asio::io_context&                         context() {
+        return context_;
+    }
+    inline rinetd_worker&                                   worker() {
+        return worker_;
+    }
+    inline inherited_listener                               listener() {
+        return std::make_pair(listener_key(false, forward_.local_host, forward_.local_port), 
+            socket_.is_open() ? (int)socket_.native_handle() : -1);
+    }
+    inline void                                             drain() {
+        /* New clients are refused, the listening socket is still read: it carries what the clients of existing tunnels
+         * send to their backends. */
+        draining_ = true;
+    }
+    inline void                                             hand_over() {
+        /* The successor of an upgrade reads the shared socket from now on and serves every datagram; this process keeps
+         * it open only to answer the clients of its existing tunnels. */
+        boost::system::error_code ec;
+        draining_ = true;
+        handed_over_ = true;
+        try {
+            socket_.cancel(ec);
+        }
+        catch (std::exception&) {}
+    }
+    inline static int64_t                                   tunnel_count() {
+        return slab_allocator<udp_tunnel>::live();
+    }
+    inline static int64_t                                   tunnel_cached() {
+        return slab_allocator<udp_tunnel>::cached();
+    }
+    inline uint64_t                                         evictions() {
+        return stats_->counters[RINETD_STAT_EVICTIONS];
+    }
+    inline uint64_t                                         drops() {
+        return stats_->counters[RINETD_STAT_DROPS];
+    }
+    inline uint64_t                                         send_errors() {
+        return stats_->counters[RINETD_STAT_SEND_ERRORS];
+    }
+    inline uint64_t                                         receive_errors() {
+        return stats_->counters[RINETD_STAT_RECEIVE_ERRORS];
+    }
+    inline uint64_t                                         limited() {
+        return stats_->counters[RINETD_STAT_LIMITED];
+    }
+    inline uint64_t                                         denied() {
+        return stats_->counters[RINETD_STAT_DENIED];
+    }
+    inline uint64_t                                         migrations() {
+        return stats_->counters[RINETD_STAT_MIGRATIONS];
+    }
+    inline uint64_t                                         migrations_refused() {
+        return stats_->counters[RINETD_STAT_MIGRATIONS_REFUSED];
+    }
+    inline bool                                             draining() {
+        return draining_;
+    }
+    /* Why run() failed, empty when it did not. */
+    inline const std::string&                               error() {
+        return error_;
+    }
+    inline listen_port&                                     rule() {
+        return forward_;
+    }
+    inline backend_state_list&                              backends() {
+        return backends_;
+    }
+    inline linked_list<udp_tunnel>&                         tunnels() {
+        return lru_;
+    }
+    inline top_talkers&                                     top() {
+        return top_;
+    }
+    inline uint64_t                                         tunnel_bytes() {
+        return tunnel_bytes_;
+    }
+    inline void                                             release_tunnel(udp_tunnel* tunnel_, int reason_) {
+        release_tunnel(tunnel_map_.find(tunnel_->key_), reason_);
+    }
     inline bool                                             send_to(
         char*                                               buf, 
         size_t                                              size, 
         boost::asio::ip::udp::endpoint&                     endpoint_) {
-        return udp_forward::send_to(socket_, buf, size, endpoint_) > 0;
+        return queue_.send_to(buf, size, endpoint_, this);
     }
     inline static int                                       send_to(
         boost::asio::ip::udp::socket&                       socket_, 
         char*                                               buf, 
         size_t                                              size, 
-        boost::asio::ip::udp::endpoint&                     endpoint_) {
+        const boost::asio::ip::udp::endpoint&               endpoint_,
+        boost::system::error_code&                          ec) {
         if (!socket_.is_open()) {
+            ec = boost::asio::error::bad_descriptor;
             return -1;
         }
 
@@ -170,7 +566,6 @@ public:
             return 0;
         }
 
-        boost::system::error_code ec;
         #ifdef _WIN32
         size_t sz = socket_.send_to(boost::asio::buffer(buf, size), endpoint_, 0, ec);
         #else
@@ -178,71 +573,303 @@ public:
         #endif
         return std::max<int>(-1, ec ? -1 : sz);
     }
+    inline static int                                       send(
+        boost::asio::ip::udp::socket&                       socket_, 
+        char*                                               buf, 
+        size_t                                              size, 
+        boost::system::error_code&                          ec) {
+        if (!socket_.is_open()) {
+            ec = boost::asio::error::bad_descriptor;
+            return -1;
+        }
+
+        if (!buf || !size) {
+            return 0;
+        }
+
+        #ifdef _WIN32
+        size_t sz = socket_.send(boost::asio::buffer(buf, size), 0, ec);
+        #else
+        size_t sz = socket_.send(boost::asio::buffer(buf, size), MSG_NOSIGNAL, ec);
+        #endif
+        return std::max<int>(-1, ec ? -1 : sz);
+    }
 
 private:
+    inline static std::shared_ptr<udp_forward>              keepalive(udp_forward* forward_) {
+        return forward_->shared_from_this();
+    }
+    inline static udp_tunnel_ptr                            keepalive(udp_tunnel* tunnel_) {
+        return udp_tunnel_ptr(tunnel_);
+    }
     inline void                                             accept_socket() {
-        if (!socket_.is_open()) {
+        if (!socket_.is_open() || handed_over_) {
             return;    
         }
         std::shared_ptr<udp_forward> self = shared_from_this();
-        socket_.async_receive_from(boost::asio::buffer(buf_, UINT16_MAX), udp_ep_, 
-            [self, this] (const boost::system::error_code& ec, uint32_t sz) {
-                do {
-                    int by = std::max<int>(-1, ec ? -1 : sz);
-                    if (by < 1) {
+        socket_.async_wait(boost::asio::socket_base::wait_read, with_memory(memory_,
+            [self, this] (const boost::system::error_code& ec) {
+                for (int i = 0; !ec && i < RINETD_UDP_RECEIVE_BATCH; i++) {
+                    boost::system::error_code ec_;
+                    size_t sz = socket_.receive_from(boost::asio::buffer(buf_, UINT16_MAX), udp_ep_, 0, ec_);
+                    if (ec_) {
                         break;
                     }
+                    if (sz < 1) {
+                        continue;
+                    }
 
-                    std::shared_ptr<udp_tunnel> tunnel_ = get_or_add_tunnel(udp_ep_);
+                    udp_tunnel_ptr tunnel_ = get_or_add_tunnel(udp_ep_, buf_, sz);
                     if (tunnel_) {
-                        tunnel_->send_to(buf_, by);
+                        tunnel_->send_to(buf_, sz);
                     }
-                } while (0);
+                }
                 accept_socket();
-            });
+            }));
     }
-    inline std::shared_ptr<udp_tunnel>                      get_or_add_tunnel(boost::asio::ip::udp::endpoint& endpoint_) {
+    inline udp_tunnel_ptr                                   get_or_add_tunnel(boost::asio::ip::udp::endpoint& endpoint_, const char* buf, size_t size) {
         std::string key = to_address(endpoint_);
         udp_tunnel_map::iterator it = tunnel_map_.find(key);
         if (it != tunnel_map_.end()) {
+            if (it->second->migrate_count_) {
+                /* The tunnel's own client is still sending: no rebinding, the other address does not get the tunnel. */
+                it->second->migrate_count_ = 0;
+                stats_add(stats_, RINETD_STAT_MIGRATIONS_REFUSED, 1);
+            }
             return it->second;
         }
+        if (forward_.quic) {
+            bool refused_ = false;
+            udp_tunnel_ptr tunnel_ = migrate_tunnel(endpoint_, key, buf, size, refused_);
+            if (tunnel_ || refused_) {
+                return tunnel_;
+            }
+        }
+        if (draining_) {
+            flight(RINETD_FLIGHT_REFUSE, RINETD_REASON_DRAINING, 0, endpoint_, backend_state_ptr());
+            stats_add(stats_, RINETD_STAT_REJECTED, 1);
+            return udp_tunnel_ptr();
+        }
+        top_key top_key_ = { 0, 0 };
+        if (top_.enabled()) {
+            top_key_ = top_.key(endpoint_.address());
+            top_.connection(top_key_, GetTickCount(false));
+        }
+        if (acl_ && !acl_->permit(endpoint_.address())) {
+            flight(RINETD_FLIGHT_REFUSE, RINETD_REASON_DENIED, 0, endpoint_, backend_state_ptr());
+            stats_add(stats_, RINETD_STAT_DENIED, 1);
+            return udp_tunnel_ptr();
+        }
+        if (limiter_ && !limiter_->admit(endpoint_.address(), GetTickCount(false))) {
+            flight(RINETD_FLIGHT_REFUSE, RINETD_REASON_LIMITED, 0, endpoint_, backend_state_ptr());
+            stats_add(stats_, RINETD_STAT_LIMITED, 1);
+            return udp_tunnel_ptr();
+        }
+        /* No new tunnels while the memory budget is exhausted, established ones keep flowing. */
+        if (memory_budget::pressure()) {
+            flight(RINETD_FLIGHT_REFUSE, RINETD_REASON_PRESSURE, 0, endpoint_, backend_state_ptr());
+            stats_add(stats_, RINETD_STAT_REJECTED, 1);
+            return udp_tunnel_ptr();
+        }
+        backend_state_ptr backend_ = select_backend(endpoint_.address());
+        if (!backend_) {
+            flight(RINETD_FLIGHT_REFUSE, RINETD_REASON_NO_BACKEND, 0, endpoint_, backend_state_ptr());
+            stats_add(stats_, RINETD_STAT_DROPS, 1);
+            return udp_tunnel_ptr();
+        }
+
         std::shared_ptr<udp_forward> self_ = shared_from_this();
-        std::shared_ptr<udp_tunnel> tunnel_ = make_shared_object<udp_tunnel>(self_, endpoint_);
-        if (!tunnel_->run()) {
-            return NULL;
+        udp_tunnel_ptr tunnel_ = make_slab_object<udp_tunnel>(self_, endpoint_, key, backend_);
+        if (!tunnel_) {
+            return udp_tunnel_ptr();
+        }
+
+        /* Full table: recycle the least recently used tunnels rather than refusing the new client. */
+        while (!lru_.empty() && is_tunnel_exhausted(tunnel_->cost_)) {
+            release_tunnel(tunnel_map_.find(lru_.front()->key_), RINETD_REASON_EVICTED);
+            stats_add(stats_, RINETD_STAT_EVICTIONS, 1);
+        }
+        if (is_tunnel_exhausted(tunnel_->cost_) || !tunnel_->run()) {
+            flight(RINETD_FLIGHT_REFUSE, is_tunnel_exhausted(tunnel_->cost_) ? RINETD_REASON_FULL : RINETD_REASON_BACKEND_ERROR, 0, endpoint_, backend_);
+            stats_add(stats_, RINETD_STAT_REJECTED, 1);
+            return udp_tunnel_ptr();
+        }
+        flight(RINETD_FLIGHT_TUNNEL_OPEN, RINETD_REASON_NONE, tunnel_->flow_, endpoint_, backend_);
+        if (top_.enabled()) {
+            tunnel_->top_key_ = top_key_;
+            top_.backend_connection(tunnel_->backend_index_);
+        }
+        tunnel_map_.insert(std::make_pair(key, tunnel_));
+        tunnel_bytes_ += tunnel_->cost_;
+        lru_.push_back(tunnel_.get());
+        stats_add(stats_, RINETD_STAT_ACCEPTED, 1);
+        stats_set(stats_, RINETD_STAT_ACTIVE, lru_.size());
+        return tunnel_;
+    }
+    /* A client address that is new to the rule but sends to the connection id of a live tunnel is that tunnel's client
+     * after a nat rebinding or a migration. Short header ids travel in the clear, so one datagram is not enough to move
+     * the tunnel: the new address has to send RINETD_QUIC_MIGRATE_DATAGRAMS of them within RINETD_QUIC_MIGRATE_WINDOW
+     * while the old one stays silent, and each attempt passes the rule's allow/deny lists and rate limits. Until then
+     * its datagrams reach the backend but the replies keep going to the old address. The tunnel then moves to the new
+     * address and keeps its backend socket, so the backend sees the same flow; a transparent tunnel keeps the source
+     * address it was bound to. refused_ is set when the datagram is to be dropped. */
+    inline udp_tunnel_ptr                                   migrate_tunnel(boost::asio::ip::udp::endpoint& endpoint_, const std::string& key, const char* buf, size_t size, bool& refused_) {
+        udp_tunnel* found_ = quic_.find(buf, size);
+        if (!found_ || !found_->socket_.is_open()) {
+            return udp_tunnel_ptr();
+        }
+        udp_tunnel_map::iterator it = tunnel_map_.find(found_->key_);
+        if (it == tunnel_map_.end() || it->second.get() != found_) {
+            return udp_tunnel_ptr();
+        }
+
+        uint64_t now = GetTickCount(false);
+        if (!found_->migrate_count_ || found_->migrate_key_ != key || now - found_->migrate_started_ > (uint64_t)RINETD_QUIC_MIGRATE_WINDOW) {
+            int reason_ = RINETD_REASON_NONE;
+            if (acl_ && !acl_->permit(endpoint_.address())) {
+                reason_ = RINETD_REASON_DENIED;
+            }
+            else if (limiter_ && !limiter_->admit(endpoint_.address(), now)) {
+                reason_ = RINETD_REASON_LIMITED;
+            }
+            if (reason_ != RINETD_REASON_NONE) {
+                flight(RINETD_FLIGHT_REFUSE, reason_, found_->flow_, endpoint_, found_->backend_);
+                stats_add(stats_, RINETD_STAT_MIGRATIONS_REFUSED, 1);
+                refused_ = true;
+                return udp_tunnel_ptr();
+            }
+            found_->migrate_key_ = key;
+            found_->migrate_count_ = 0;
+            found_->migrate_started_ = now;
+        }
+        if (++found_->migrate_count_ < RINETD_QUIC_MIGRATE_DATAGRAMS) {
+            return it->second;
+        }
+
+        udp_tunnel_ptr tunnel_ = std::move(it->second);
+        tunnel_map_.erase(it);
+        tunnel_->key_ = key;
+        tunnel_->local_ep_ = endpoint_;
+        tunnel_->migrate_key_.clear();
+        tunnel_->migrate_count_ = 0;
+        if (top_.enabled()) {
+            tunnel_->top_key_ = top_.key(endpoint_.address());
         }
         tunnel_map_.insert(std::make_pair(key, tunnel_));
+        flight(RINETD_FLIGHT_TUNNEL_MIGRATE, RINETD_REASON_NONE, tunnel_->flow_, endpoint_, tunnel_->backend_);
+        stats_add(stats_, RINETD_STAT_MIGRATIONS, 1);
         return tunnel_;
     }
+    inline backend_state_ptr                                select_backend(const boost::asio::ip::address& client_) {
+        int start_ = maglev_ ? maglev_->lookup(client_) : 0;
+        int index_ = backend_state::select(backends_, start_, backends_.size(), GetTickCount(false));
+        return index_ < 0 ? backend_state_ptr() : backends_[index_];
+    }
+    inline backend_state_ptr                                select_backend(const boost::asio::ip::address& client_, const boost::asio::ip::udp& protocol_) {
+        uint64_t now = GetTickCount(false);
+        size_t start_ = maglev_ ? maglev_->lookup(client_) : 0;
+        for (size_t i = 0, l = backends_.size(); i < l; i++) {
+            backend_state_ptr& backend_ = backends_[(start_ + i) % l];
+            if (backend_->is_up(now) && to_endpoint<boost::asio::ip::udp>(backend_->host(), backend_->port()).protocol() == protocol_) {
+                return backend_;
+            }
+        }
+        return backend_state_ptr();
+    }
+    inline int                                              backend_index(const backend_state_ptr& backend_) {
+        for (size_t i = 0, l = backends_.size(); i < l; i++) {
+            if (backends_[i] == backend_) {
+                return (int)i;
+            }
+        }
+        return -1;
+    }
+    /* Limits are per rule, each worker's shard of the tunnel table gets an equal part; busy_poll and quic rules have one. */
+    inline bool                                             is_tunnel_exhausted(uint64_t cost_) {
+        uint64_t shards_ = forward_.busy_poll || forward_.quic ? 1 : std::max<int>(1, config_.workers);
+        if (forward_.max_tunnels > 0 && lru_.size() >= std::max<uint64_t>(1, forward_.max_tunnels / shards_)) {
+            return true;
+        }
+        return forward_.tunnel_budget > 0 && tunnel_bytes_ + cost_ > forward_.tunnel_budget / shards_;
+    }
+    /* The tunnel's own cause, when it failed before, takes precedence over the reason it is released for. */
+    inline void                                             release_tunnel(udp_tunnel_map::iterator it, int reason_) {
+        if (it == tunnel_map_.end()) {
+            return;
+        }
+        udp_tunnel_ptr tunnel_ = std::move(it->second);
+        tunnel_map_.erase(it);
+        if (tunnel_) {
+            quic_.remove(tunnel_->quic_ids_, tunnel_.get());
+            if (lru_.contains(tunnel_.get())) {
+                lru_.remove(tunnel_.get());
+                tunnel_bytes_ -= tunnel_->cost_;
+                stats_set(stats_, RINETD_STAT_ACTIVE, lru_.size());
+            }
+            tunnel_->cause(reason_, 0);
+            rinetd_flight_record* record_ = flight(RINETD_FLIGHT_TUNNEL_CLOSE, tunnel_->close_reason_, tunnel_->flow_, tunnel_->local_ep_, tunnel_->backend_);
+            if (record_) {
+                record_->elapsed = (uint32_t)std::min<uint64_t>(GetTickCount(false) - tunnel_->created_, UINT32_MAX);
+                record_->error = tunnel_->close_error_;
+                record_->bytes_up = tunnel_->bytes_up_;
+                record_->bytes_down = tunnel_->bytes_down_;
+            }
+            tunnel_->abort();
+        }
+    }
+    inline rinetd_flight_record*                            flight(int type_, int reason_, uint32_t flow_, 
+        const boost::asio::ip::udp::endpoint& client_, const backend_state_ptr& backend_) {
+        rinetd_flight_record* record_ = worker_.flight().add(type_, reason_, rule_index_, flow_);
+        if (record_) {
+            flight_recorder::client(record_, client_);
+            if (backend_) {
+                flight_recorder::backend(record_, backend_->host(), backend_->port());
+            }
+        }
+        return record_;
+    }
     inline void                                             check_timer() {
         std::shared_ptr<udp_forward> self = shared_from_this();
-        boost::asio::deadline_timer::duration_type duration_time_ = boost::posix_time::seconds(10);
-        
+        /* Short udp_timeout values are swept more often so idle tunnels go away close to their deadline. */
+        boost::asio::deadline_timer::duration_type duration_time_ = boost::posix_time::milliseconds(std::min<uint32_t>(10000, forward_.udp_timeout));
+
         check_timer_.expires_from_now(duration_time_);
-        check_timer_.async_wait([self, this](const boost::system::error_code& ec) {
+        check_timer_.async_wait(with_memory(memory_, [self, this](const boost::system::error_code& ec) {
             next_tick(GetTickCount(false));
             check_timer();
-        });
+        }));
     }
     inline void                                             next_tick(uint64_t now) {
         std::vector<std::string> releases;
         udp_tunnel_map::iterator tail = tunnel_map_.begin();
         udp_tunnel_map::iterator endl = tunnel_map_.end();
         for (; tail != endl; tail++) {
-            std::shared_ptr<udp_tunnel> tunntel_ = tail->second;
+            udp_tunnel_ptr tunntel_ = tail->second;
             if (!tunntel_ || tunntel_->is_port_aging(now)) {
                 releases.push_back(tail->first);
             }
         }
         for (size_t i = 0, l = releases.size(); i < l; i++) {
-            tail = tunnel_map_.find(std::move(releases[i]));
-            if (tail != endl) {
-                std::shared_ptr<udp_tunnel> tunntel_ = std::move(tail->second);
-                if (tunntel_) {
-                    tunntel_->abort();
-                }
-                tunnel_map_.erase(tail);
+            release_tunnel(tunnel_map_.find(releases[i]), RINETD_REASON_IDLE);
+        }
+
+        uint64_t evictions_ = evictions();
+        uint64_t drops_ = drops();
+        uint64_t send_errors_ = send_errors();
+        if (evictions_ != evictions_reported_ || drops_ != drops_reported_ || send_errors_ != send_errors_reported_) {
+            std::string sb = "udp " + to_address(forward_.local_host, forward_.local_port) + 
+                " evicted " + std::to_string(evictions_ - evictions_reported_) + " tunnels (lru), " + 
+                std::to_string(lru_.size()) + " live, " + std::to_string(tunnel_bytes_) + " bytes, " + 
+                "dropped " + std::to_string(drops_ - drops_reported_) + " datagrams (queue full), " + 
+                std::to_string(send_errors_ - send_errors_reported_) + " send errors";
+            evictions_reported_ = evictions_;
+            drops_reported_ = drops_;
+            send_errors_reported_ = send_errors_;
+            if (worker_.log()) {
+                write_log(*worker_.log().get(), sb);
+            }
+            else {
+                write_log(config_.log_var, sb);
             }
         }
     }
@@ -257,13 +884,32 @@ private:
     }
 
 private:
+    rinetd_worker&                                          worker_;
     boost::asio::io_context&                                context_;
     listen_port&                                            forward_;
+    uint32_t                                                rule_index_;
+    backend_state_list                                      backends_;
+    maglev_table_ptr                                        maglev_;
+    rate_limiter_ptr                                        limiter_;
+    acl_table_ptr                                           acl_;
     rinetd_config&                                          config_;
     boost::asio::ip::udp::socket                            socket_;
-    boost::asio::ip::udp::endpoint                          server_;
+    udp_send_queue                                          queue_;
     boost::asio::ip::udp::endpoint                          udp_ep_;
     char*                                                   buf_;
+    bool                                                    draining_;
+    bool                                                    handed_over_;   /* the successor of an upgrade reads the socket */
+    std::string                                             error_;
     udp_tunnel_map                                          tunnel_map_;
+    linked_list<udp_tunnel>                                 lru_;
+    uint64_t                                                tunnel_bytes_;
+    uint64_t                                                evictions_reported_;
+    uint64_t                                                drops_reported_;
+    uint64_t                                                send_errors_reported_;
     boost::asio::deadline_timer                             check_timer_;
+    rinetd_stats_slot*                                      stats_;
+    rinetd_stats_slot                                       private_stats_;
+    top_talkers                                             top_;
+    quic_steering<udp_tunnel>                               quic_;
+    handler_memory<2>                                       memory_;        /* the datagram wait and the sweep timer */
 };
\ No newline at end of file
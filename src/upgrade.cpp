@@ -0,0 +1,337 @@
+#include <upgrade.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+extern char** environ;
+
+static std::unordered_multimap<std::string, int>        s_inherited_;
+static std::mutex                                       s_inherited_lock_; /* listeners are claimed from every worker at startup */
+static int                                              s_channel_ = -1;
+
+static bool
+send_listener(int channel_, const std::string& key_, int fd_) {
+    struct msghdr msg_;
+    struct iovec iov_;
+    char control_[CMSG_SPACE(sizeof(int))];
+
+    memset(&msg_, 0, sizeof(msg_));
+    memset(control_, 0, sizeof(control_));
+    iov_.iov_base = (void*)key_.data();
+    iov_.iov_len = key_.size();
+    msg_.msg_iov = &iov_;
+    msg_.msg_iovlen = 1;
+    if (fd_ != -1) {
+        msg_.msg_control = control_;
+        msg_.msg_controllen = sizeof(control_);
+
+        struct cmsghdr* cmsg_ = CMSG_FIRSTHDR(&msg_);
+        cmsg_->cmsg_level = SOL_SOCKET;
+        cmsg_->cmsg_type = SCM_RIGHTS;
+        cmsg_->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg_), &fd_, sizeof(int));
+    }
+    for (;;) {
+        ssize_t sz = sendmsg(channel_, &msg_, MSG_NOSIGNAL);
+        if (sz >= 0) {
+            return (size_t)sz == key_.size();
+        }
+        if (errno != EINTR) {
+            return false;
+        }
+    }
+}
+
+static ssize_t
+receive_listener(int channel_, char* key_, size_t size_, int& fd_) {
+    struct msghdr msg_;
+    struct iovec iov_;
+    char control_[CMSG_SPACE(sizeof(int))];
+
+    memset(&msg_, 0, sizeof(msg_));
+    iov_.iov_base = key_;
+    iov_.iov_len = size_;
+    msg_.msg_iov = &iov_;
+    msg_.msg_iovlen = 1;
+    msg_.msg_control = control_;
+    msg_.msg_controllen = sizeof(control_);
+
+    fd_ = -1;
+    ssize_t sz;
+    do {
+        sz = recvmsg(channel_, &msg_, 0);
+    } while (sz < 0 && errno == EINTR);
+    if (sz <= 0) {
+        return sz;
+    }
+
+    struct cmsghdr* cmsg_ = CMSG_FIRSTHDR(&msg_);
+    if (cmsg_ && cmsg_->cmsg_level == SOL_SOCKET && cmsg_->cmsg_type == SCM_RIGHTS) {
+        memcpy(&fd_, CMSG_DATA(cmsg_), sizeof(int));
+    }
+    return sz;
+}
+
+static void
+close_from(int first_) {
+    #ifdef SYS_close_range
+    if (syscall(SYS_close_range, first_, ~0U, 0) == 0) {
+        return;
+    }
+    #endif
+    long max_ = sysconf(_SC_OPEN_MAX);
+    for (int fd_ = first_; fd_ < max_; fd_++) {
+        close(fd_);
+    }
+}
+#endif
+
+std::string listener_key(bool tcp_or_udp, const ip_address& host, uint16_t port) {
+    return (tcp_or_udp ? "tcp/" : "udp/") + to_address(host, port);
+}
+
+int upgrade_take_listener(const std::string& key) {
+    #ifdef _WIN32
+    return -1;
+    #else
+    std::lock_guard<std::mutex> scope_(s_inherited_lock_);
+    std::unordered_multimap<std::string, int>::iterator it = s_inherited_.find(key);
+    if (it == s_inherited_.end()) {
+        return -1;
+    }
+    int fd_ = it->second;
+    s_inherited_.erase(it);
+    return fd_;
+    #endif
+}
+
+bool upgrade_has_listener(const std::string& key) {
+    #ifdef _WIN32
+    return false;
+    #else
+    std::lock_guard<std::mutex> scope_(s_inherited_lock_);
+    return s_inherited_.find(key) != s_inherited_.end();
+    #endif
+}
+
+size_t upgrade_count_listeners(const std::string& key) {
+    #ifdef _WIN32
+    return 0;
+    #else
+    std::lock_guard<std::mutex> scope_(s_inherited_lock_);
+    return s_inherited_.count(key);
+    #endif
+}
+
+/* An inherited socket without SO_REUSEPORT, as a service manager passes them unless told ReusePort=yes, keeps other
+ * sockets off its address: the rule has to be served by the one worker claiming it. */
+bool upgrade_listener_exclusive(const std::string& key) {
+    #ifdef _WIN32
+    return false;
+    #else
+    std::lock_guard<std::mutex> scope_(s_inherited_lock_);
+    std::pair<std::unordered_multimap<std::string, int>::iterator, std::unordered_multimap<std::string, int>::iterator> range_ = s_inherited_.equal_range(key);
+    for (; range_.first != range_.second; range_.first++) {
+        int reuse_ = 0;
+        socklen_t reuse_len_ = sizeof(reuse_);
+        if (getsockopt(range_.first->second, SOL_SOCKET, SO_REUSEPORT, &reuse_, &reuse_len_) == 0 && !reuse_) {
+            return true;
+        }
+    }
+    return false;
+    #endif
+}
+
+std::vector<std::string> upgrade_unclaimed_listeners() {
+    std::vector<std::string> keys_;
+    #ifndef _WIN32
+    std::lock_guard<std::mutex> scope_(s_inherited_lock_);
+    std::unordered_multimap<std::string, int>::iterator tail = s_inherited_.begin();
+    std::unordered_multimap<std::string, int>::iterator endl = s_inherited_.end();
+    for (; tail != endl; tail++) {
+        if (std::find(keys_.begin(), keys_.end(), tail->first) == keys_.end()) {
+            keys_.push_back(tail->first);
+        }
+    }
+    #endif
+    return keys_;
+}
+
+bool upgrade_receive_listeners() {
+    #ifdef _WIN32
+    return false;
+    #else
+    const char* env_ = getenv(RINETD_UPGRADE_ENV);
+    if (!env_) {
+        return false;
+    }
+    int channel_ = atoi(env_);
+    unsetenv(RINETD_UPGRADE_ENV);
+    if (channel_ < 0) {
+        return false;
+    }
+
+    /* key + fd per listener, terminated by a bare "end" message without descriptor. */
+    for (;;) {
+        char key_[256];
+        int fd_ = -1;
+        ssize_t sz = receive_listener(channel_, key_, sizeof(key_), fd_);
+        if (sz <= 0) {
+            close(channel_);
+            break;
+        }
+        if (fd_ == -1) {
+            s_channel_ = channel_;
+            break;
+        }
+        s_inherited_.insert(std::make_pair(std::string(key_, sz), fd_));
+    }
+    return s_inherited_.size() > 0;
+    #endif
+}
+
+/* The service manager passed sockets to this very process; it must be asked before anything forks. */
+bool upgrade_socket_activated() {
+    #ifdef _WIN32
+    return false;
+    #else
+    const char* pid_ = getenv(RINETD_LISTEN_PID_ENV);
+    const char* fds_ = getenv(RINETD_LISTEN_FDS_ENV);
+    return pid_ && fds_ && atoi(pid_) == getpid() && atoi(fds_) > 0;
+    #endif
+}
+
+int upgrade_receive_activated(int tcp_copies) {
+    #ifdef _WIN32
+    return 0;
+    #else
+    if (!upgrade_socket_activated()) {
+        return 0;
+    }
+    int count_ = atoi(getenv(RINETD_LISTEN_FDS_ENV));
+    unsetenv(RINETD_LISTEN_PID_ENV);
+    unsetenv(RINETD_LISTEN_FDS_ENV);
+    unsetenv("LISTEN_FDNAMES");
+
+    /* The sockets are matched to rules by their bound address, the same key a predecessor hands its listeners over
+     * with. A tcp socket is shared by every worker through duplicates, the kernel then queues connections on the one
+     * socket the service manager keeps open across restarts. A udp socket is not: workers reading one socket would
+     * each open tunnels for the same client, so the rule is served by the single worker owning it. */
+    int activated_ = 0;
+    for (int fd_ = RINETD_LISTEN_FDS_START; fd_ < RINETD_LISTEN_FDS_START + count_; fd_++) {
+        struct sockaddr_storage ss_;
+        socklen_t ss_len_ = sizeof(ss_);
+        int type_ = 0;
+        socklen_t type_len_ = sizeof(type_);
+        if (getsockname(fd_, (struct sockaddr*)&ss_, &ss_len_) < 0 || getsockopt(fd_, SOL_SOCKET, SO_TYPE, &type_, &type_len_) < 0 ||
+            (ss_.ss_family != AF_INET && ss_.ss_family != AF_INET6) || (type_ != SOCK_STREAM && type_ != SOCK_DGRAM)) {
+            close(fd_);
+            continue;
+        }
+        fcntl(fd_, F_SETFD, FD_CLOEXEC);
+
+        boost::asio::ip::tcp::endpoint ep_;
+        memcpy(ep_.data(), &ss_, ss_len_);
+        ep_.resize(ss_len_);
+
+        bool tcp_or_udp = type_ == SOCK_STREAM;
+        std::string key_ = (tcp_or_udp ? "tcp/" : "udp/") + to_address(ep_);
+        std::lock_guard<std::mutex> scope_(s_inherited_lock_);
+        s_inherited_.insert(std::make_pair(key_, fd_));
+        for (int i = 1; tcp_or_udp && i < tcp_copies; i++) {
+            int copy_ = fcntl(fd_, F_DUPFD_CLOEXEC, 0);
+            if (copy_ != -1) {
+                s_inherited_.insert(std::make_pair(key_, copy_));
+            }
+        }
+        activated_++;
+    }
+    return activated_;
+    #endif
+}
+
+void upgrade_notify_ready() {
+    #ifndef _WIN32
+    std::lock_guard<std::mutex> scope_(s_inherited_lock_);
+    std::unordered_multimap<std::string, int>::iterator tail = s_inherited_.begin();
+    std::unordered_multimap<std::string, int>::iterator endl = s_inherited_.end();
+    for (; tail != endl; tail++) {
+        close(tail->second);
+    }
+    s_inherited_.clear();
+
+    if (s_channel_ != -1) {
+        char ack_ = 'R';
+        send_listener(s_channel_, std::string(&ack_, 1), -1);
+        close(s_channel_);
+        s_channel_ = -1;
+    }
+    #endif
+}
+
+/* The returned channel is non-blocking: the successor reads the listeners only once it has loaded its configuration, and
+ * the kernel queues few messages on a seqpacket pair, so the caller sends them with upgrade_send_listeners whenever the
+ * channel is writable instead of waiting on a process that may never get there. */
+int upgrade_spawn(const std::string& path_, const char** argv, int& pid_) {
+    #ifdef _WIN32
+    return -1;
+    #else
+    int pair_[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, pair_) < 0) {
+        return -1;
+    }
+
+    /* Everything the successor needs is prepared before fork, the child only calls async-signal-safe functions. */
+    char env_var_[64];
+    snprintf(env_var_, sizeof(env_var_), "%s=3", RINETD_UPGRADE_ENV);
+
+    std::vector<char*> envp_;
+    for (char** p = environ; p && *p; p++) {
+        if (strncmp(*p, RINETD_UPGRADE_ENV, sizeof(RINETD_UPGRADE_ENV) - 1) != 0) {
+            envp_.push_back(*p);
+        }
+    }
+    envp_.push_back(env_var_);
+    envp_.push_back(NULL);
+
+    pid_ = fork();
+    if (pid_ < 0) {
+        close(pair_[0]);
+        close(pair_[1]);
+        return -1;
+    }
+    if (pid_ == 0) {
+        if (pair_[1] != 3) {
+            dup2(pair_[1], 3);
+        }
+        close_from(4);
+        execve(path_.data(), (char* const*)argv, envp_.data());
+        _exit(127);
+    }
+
+    close(pair_[1]);
+    fcntl(pair_[0], F_SETFL, fcntl(pair_[0], F_GETFL, 0) | O_NONBLOCK);
+    fcntl(pair_[0], F_SETFD, FD_CLOEXEC);
+    return pair_[0];
+    #endif
+}
+
+/* Sends listeners_ from next_ on, then the "end" message: 1 once everything is sent, 0 when the channel is full and
+ * the rest has to wait until it is writable again, -1 on failure. */
+int upgrade_send_listeners(int channel_, const std::vector<inherited_listener>& listeners_, size_t& next_) {
+    #ifdef _WIN32
+    return -1;
+    #else
+    for (size_t l = listeners_.size(); next_ <= l; next_++) {
+        bool sent_ = next_ < l ? 
+            listeners_[next_].second == -1 || send_listener(channel_, listeners_[next_].first, listeners_[next_].second) :
+            send_listener(channel_, "end", -1);
+        if (!sent_) {
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        }
+    }
+    return 1;
+    #endif
+}
\ No newline at end of file
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdafx.h>
+#include <config.h>
+
+static char const RINETD_UPGRADE_ENV[]                  = "RINETD_UPGRADE_FD";
+static char const RINETD_LISTEN_PID_ENV[]               = "LISTEN_PID";     /* systemd socket activation */
+static char const RINETD_LISTEN_FDS_ENV[]               = "LISTEN_FDS";
+static int const  RINETD_LISTEN_FDS_START               = 3;
+
+typedef std::pair<std::string, int>                     inherited_listener;
+
+std::string                                             listener_key(bool tcp_or_udp, const ip_address& host, uint16_t port);
+int                                                     upgrade_take_listener(const std::string& key);
+bool                                                    upgrade_has_listener(const std::string& key);
+size_t                                                  upgrade_count_listeners(const std::string& key);
+bool                                                    upgrade_listener_exclusive(const std::string& key);
+std::vector<std::string>                                upgrade_unclaimed_listeners();
+bool                                                    upgrade_receive_listeners();
+bool                                                    upgrade_socket_activated();
+int                                                     upgrade_receive_activated(int tcp_copies);
+void                                                    upgrade_notify_ready();
+int                                                     upgrade_spawn(const std::string& path_, const char** argv, int& pid_);
+int                                                     upgrade_send_listeners(int channel_, const std::vector<inherited_listener>& listeners_, size_t& next_);
\ No newline at end of file
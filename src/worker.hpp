@@ -0,0 +1,107 @@
+#pragma once
+
+#include <stdafx.h>
+#include <config.h>
+#include <flight_recorder.hpp>
+
+/* One io_context driven by one thread, optionally pinned to a CPU; every forward, connection and tunnel lives on exactly one worker.
+ * The polling worker, which serves the busy_poll rules alone, never sleeps in the reactor: it spins asking it for ready
+ * sockets with a zero timeout, so a packet is picked up without an epoll wakeup, at the cost of a CPU kept busy. */
+class rinetd_worker {
+public:
+    inline rinetd_worker(rinetd_config& config_, int index_, bool busy_poll_ = false)
+        : config_(config_)
+        , index_(index_)
+        , cpu_(-1)
+        , busy_poll_(busy_poll_) {
+        if (config_.cpu_affinity.size() > 0) {
+            cpu_ = config_.cpu_affinity[index_ % config_.cpu_affinity.size()];
+        }
+        log_ = open_log(context_, config_.log_var);
+        flight_.open(config_.flight_records);
+    }
+    inline ~rinetd_worker() {
+        if (thread_.joinable()) {
+            thread_.detach();
+        }
+    }
+
+public:
+    inline boost::asio::io_context&                         context() {
+        return context_;
+    }
+    inline rinetd_config&                                   config() {
+        return config_;
+    }
+    inline std::shared_ptr<boost::asio::posix::stream_descriptor>& log() {
+        return log_;
+    }
+    inline int                                              index() {
+        return index_;
+    }
+    inline int                                              cpu() {
+        return cpu_;
+    }
+    inline bool                                             busy_poll() {
+        return busy_poll_;
+    }
+    inline flight_recorder&                                 flight() {
+        return flight_;
+    }
+    /* Receive buffer shared by the udp forwards and tunnels of this worker, never referenced past a handler. */
+    inline char*                                            datagram_buffer() {
+        if (!datagram_buffer_) {
+            datagram_buffer_ = make_shared_alloc<char>(UINT16_MAX);
+        }
+        return datagram_buffer_.get();
+    }
+    inline void                                             incoming_cpu(int sockfd) {
+        /* Prefer this worker's listener for flows whose packets the kernel already handles on its CPU. */
+        #ifdef SO_INCOMING_CPU
+        if (sockfd != -1 && cpu_ >= 0 && config_.incoming_cpu) {
+            int cpu = cpu_;
+            ::setsockopt(sockfd, SOL_SOCKET, SO_INCOMING_CPU, (char*)&cpu, sizeof(cpu));
+        }
+        #endif
+    }
+    inline void                                             start() {
+        thread_ = std::thread([this] {
+            run();
+        });
+    }
+    inline int                                              run() {
+        #ifndef _WIN32
+        if (cpu_ >= 0) {
+            cpu_set_t set_;
+            CPU_ZERO(&set_);
+            CPU_SET(cpu_, &set_);
+            pthread_setaffinity_np(pthread_self(), sizeof(set_), &set_);
+        }
+        #endif
+        boost::asio::io_context::work work_(context_);
+        boost::system::error_code ec_;
+        if (busy_poll_) {
+            while (!context_.stopped() && !ec_) {
+                context_.poll(ec_);
+            }
+        }
+        else {
+            context_.run(ec_);
+        }
+        return ec_.value();
+    }
+    inline void                                             stop() {
+        context_.stop();
+    }
+
+private:
+    rinetd_config&                                          config_;
+    int                                                     index_;
+    int                                                     cpu_;
+    bool                                                    busy_poll_;
+    boost::asio::io_context                                 context_;
+    std::shared_ptr<boost::asio::posix::stream_descriptor>  log_;
+    std::shared_ptr<char>                                   datagram_buffer_;
+    flight_recorder                                         flight_;
+    std::thread                                             thread_;
+};
\ No newline at end of file
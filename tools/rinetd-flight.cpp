@@ -0,0 +1,306 @@
+/* rinetd-flight: decodes the flight recorder dump rinetd writes on SIGUSR1 ("flight_recorder", "flight_file"): the
+ * last accepts, backend connects and failures, closes with their byte counts and reason, and udp tunnels created
+ * and released, of every worker, merged in time order.
+ *
+ *   rinetd-flight [-f file] [-p pid] [-c client] [-n count] [-s]
+ *
+ * -p signals rinetd first and waits for the fresh dump, -c keeps the events of clients whose address:port contains
+ * the given text, -n the last count of them, -s prints a summary instead: events by type and reason, and the connect
+ * latency of each backend. */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <signal.h>
+#include <string.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+#include <flight.h>
+
+static char const RINETD_FLIGHT_DEFAULT_FILE[]          = "/tmp/rinetd.flight";
+static int const RINETD_FLIGHT_WAIT                     = 5000; /* ms -p waits for the dump */
+
+static const char* const s_types_[RINETD_FLIGHT_MAX] = {
+    "accept", "refuse", "connect", "connect-fail", "close", "tunnel-open", "tunnel-close", "tunnel-migrate",
+};
+static const char* const s_reasons_[RINETD_REASON_MAX] = {
+    "-", "client-closed", "backend-closed", "client-error", "backend-error", "timeout", "no-backend",
+    "denied", "limited", "memory-pressure", "table-full", "idle", "evicted", "killed",
+    "draining",
+};
+
+typedef struct {
+    uint32_t                                            worker;
+    rinetd_flight_record                                record;
+} flight_event;
+
+typedef struct {
+    rinetd_flight_header                                header;
+    std::vector<std::string>                            rules;
+    std::vector<rinetd_flight_chunk>                    chunks;
+    std::vector<flight_event>                           events;
+} flight_dump;
+
+typedef struct {
+    std::vector<uint32_t>                               latencies;      /* us, successful connects */
+    uint64_t                                            failures;
+    uint64_t                                            timeouts;
+} backend_summary;
+
+static std::string
+format_address(const uint8_t* address_, uint16_t port_) {
+    static const uint8_t v4_mapped_[12] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff };
+    char host_[INET6_ADDRSTRLEN];
+    char out_[INET6_ADDRSTRLEN + 16];
+    if (memcmp(address_, v4_mapped_, sizeof(v4_mapped_)) == 0) {
+        inet_ntop(AF_INET, address_ + 12, host_, sizeof(host_));
+        snprintf(out_, sizeof(out_), "%s:%u", host_, port_);
+    }
+    else {
+        inet_ntop(AF_INET6, address_, host_, sizeof(host_));
+        snprintf(out_, sizeof(out_), "[%s]:%u", host_, port_);
+    }
+    return out_;
+}
+
+static std::string
+format_time(uint64_t timestamp_) {
+    time_t seconds_ = (time_t)(timestamp_ / 1000000);
+    struct tm tm_;
+    localtime_r(&seconds_, &tm_);
+    char out_[64];
+    size_t sz_ = strftime(out_, sizeof(out_), "%Y-%m-%d %H:%M:%S", &tm_);
+    snprintf(out_ + sz_, sizeof(out_) - sz_, ".%06u", (unsigned)(timestamp_ % 1000000));
+    return out_;
+}
+
+static bool
+load_dump(const char* path_, flight_dump& dump_) {
+    FILE* file_ = fopen(path_, "rb");
+    if (!file_) {
+        fprintf(stderr, "rinetd-flight: cannot open %s\n", path_);
+        return false;
+    }
+    std::string data_;
+    char buf_[65536];
+    size_t sz_;
+    while ((sz_ = fread(buf_, 1, sizeof(buf_), file_)) > 0) {
+        data_.append(buf_, sz_);
+    }
+    fclose(file_);
+
+    rinetd_flight_header& header_ = dump_.header;
+    if (data_.size() < sizeof(header_)) {
+        fprintf(stderr, "rinetd-flight: %s is not a flight recorder dump\n", path_);
+        return false;
+    }
+    memcpy(&header_, data_.data(), sizeof(header_));
+    if (memcmp(header_.magic, RINETD_FLIGHT_MAGIC, sizeof(header_.magic)) != 0 || header_.version != RINETD_FLIGHT_VERSION ||
+        header_.record_size != sizeof(rinetd_flight_record)) {
+        fprintf(stderr, "rinetd-flight: %s is not a version %u flight recorder dump\n", path_, RINETD_FLIGHT_VERSION);
+        return false;
+    }
+
+    size_t offset_ = sizeof(header_);
+    for (uint32_t i = 0; i < header_.rules && offset_ + RINETD_FLIGHT_RULE_NAME <= data_.size(); i++) {
+        dump_.rules.push_back(std::string(data_.data() + offset_, strnlen(data_.data() + offset_, RINETD_FLIGHT_RULE_NAME)));
+        offset_ += RINETD_FLIGHT_RULE_NAME;
+    }
+    for (uint32_t i = 0; i < header_.workers && offset_ + sizeof(rinetd_flight_chunk) <= data_.size(); i++) {
+        rinetd_flight_chunk chunk_;
+        memcpy(&chunk_, data_.data() + offset_, sizeof(chunk_));
+        offset_ += sizeof(chunk_);
+        dump_.chunks.push_back(chunk_);
+
+        for (uint32_t n = 0; n < chunk_.records && offset_ + sizeof(rinetd_flight_record) <= data_.size(); n++) {
+            flight_event event_;
+            event_.worker = chunk_.worker;
+            memcpy(&event_.record, data_.data() + offset_, sizeof(event_.record));
+            offset_ += sizeof(event_.record);
+            dump_.events.push_back(event_);
+        }
+    }
+    std::stable_sort(dump_.events.begin(), dump_.events.end(), [](const flight_event& a, const flight_event& b) {
+        return a.record.timestamp < b.record.timestamp;
+    });
+    return true;
+}
+
+/* A dump replaces the previous one by rename, so a new inode means rinetd has written it. */
+static bool
+request_dump(const char* path_, pid_t pid_) {
+    struct stat st_;
+    ino_t inode_ = stat(path_, &st_) == 0 ? st_.st_ino : 0;
+    if (kill(pid_, SIGUSR1) < 0) {
+        fprintf(stderr, "rinetd-flight: cannot signal %d\n", (int)pid_);
+        return false;
+    }
+    for (int waited_ = 0; waited_ < RINETD_FLIGHT_WAIT; waited_ += 50) {
+        usleep(50 * 1000);
+        if (stat(path_, &st_) == 0 && st_.st_ino != inode_) {
+            return true;
+        }
+    }
+    fprintf(stderr, "rinetd-flight: %d wrote no dump to %s, is flight_recorder off?\n", (int)pid_, path_);
+    return false;
+}
+
+static void
+print_event(const flight_dump& dump_, const flight_event& event_) {
+    const rinetd_flight_record& record_ = event_.record;
+    std::string rule_ = record_.rule < dump_.rules.size() ? dump_.rules[record_.rule] : "rule " + std::to_string(record_.rule);
+    std::string backend_ = record_.backend_port ? format_address(record_.backend, record_.backend_port) : "-";
+    printf("%s w%-2u #%-8u %-24s %-12s %s -> %s", format_time(record_.timestamp).data(), event_.worker, record_.flow, rule_.data(),
+        record_.type < RINETD_FLIGHT_MAX ? s_types_[record_.type] : "?", format_address(record_.client, record_.client_port).data(),
+        backend_.data());
+
+    switch (record_.type) {
+    case RINETD_FLIGHT_CONNECT:
+    case RINETD_FLIGHT_CONNECT_FAIL:
+        printf(" %.3f ms", (double)record_.elapsed / 1000);
+        break;
+    case RINETD_FLIGHT_CLOSE:
+    case RINETD_FLIGHT_TUNNEL_CLOSE:
+        printf(" %u ms up %llu down %llu", record_.elapsed, (unsigned long long)record_.bytes_up, (unsigned long long)record_.bytes_down);
+        break;
+    default:
+        break;
+    }
+    if (record_.reason != RINETD_REASON_NONE) {
+        printf(" %s", record_.reason < RINETD_REASON_MAX ? s_reasons_[record_.reason] : "?");
+    }
+    if (record_.error) {
+        printf(" (%s)", strerror(record_.error));
+    }
+    printf("\n");
+}
+
+static uint32_t
+percentile(std::vector<uint32_t>& values_, double p_) {
+    if (values_.empty()) {
+        return 0;
+    }
+    size_t index_ = std::min(values_.size() - 1, (size_t)(p_ * values_.size()));
+    std::nth_element(values_.begin(), values_.begin() + index_, values_.end());
+    return values_[index_];
+}
+
+static void
+print_summary(const flight_dump& dump_, const std::vector<const flight_event*>& events_) {
+    printf("pid %d, dumped %s\n", dump_.header.pid, format_time(dump_.header.dumped).data());
+    for (size_t i = 0, l = dump_.chunks.size(); i < l; i++) {
+        const rinetd_flight_chunk& chunk_ = dump_.chunks[i];
+        printf("worker %u: %u events held, %llu recorded\n", chunk_.worker, chunk_.records, (unsigned long long)chunk_.events);
+    }
+    if (!events_.empty()) {
+        printf("span %s .. %s\n", format_time(events_.front()->record.timestamp).data(), format_time(events_.back()->record.timestamp).data());
+    }
+
+    uint64_t types_[RINETD_FLIGHT_MAX] = { 0 };
+    std::map<std::string, uint64_t> reasons_;
+    std::map<std::string, backend_summary> backends_;
+    for (size_t i = 0, l = events_.size(); i < l; i++) {
+        const rinetd_flight_record& record_ = events_[i]->record;
+        if (record_.type >= RINETD_FLIGHT_MAX) {
+            continue;
+        }
+        types_[record_.type]++;
+        if (record_.reason != RINETD_REASON_NONE && record_.reason < RINETD_REASON_MAX) {
+            reasons_[std::string(s_types_[record_.type]) + " " + s_reasons_[record_.reason]]++;
+        }
+        if (record_.type == RINETD_FLIGHT_CONNECT || record_.type == RINETD_FLIGHT_CONNECT_FAIL) {
+            backend_summary& backend_ = backends_[format_address(record_.backend, record_.backend_port)];
+            if (record_.type == RINETD_FLIGHT_CONNECT) {
+                backend_.latencies.push_back(record_.elapsed);
+            }
+            else {
+                backend_.failures++;
+                backend_.timeouts += record_.reason == RINETD_REASON_TIMEOUT ? 1 : 0;
+            }
+        }
+    }
+
+    printf("\n%-28s %12s\n", "event", "count");
+    for (int i = 0; i < RINETD_FLIGHT_MAX; i++) {
+        printf("%-28s %12llu\n", s_types_[i], (unsigned long long)types_[i]);
+    }
+    if (!reasons_.empty()) {
+        printf("\n%-28s %12s\n", "reason", "count");
+        for (std::map<std::string, uint64_t>::iterator it = reasons_.begin(); it != reasons_.end(); ++it) {
+            printf("%-28s %12llu\n", it->first.data(), (unsigned long long)it->second);
+        }
+    }
+    if (!backends_.empty()) {
+        printf("\n%-46s %9s %9s %9s %10s %10s %10s\n", "backend", "connects", "failures", "timeouts", "p50 ms", "p99 ms", "max ms");
+        for (std::map<std::string, backend_summary>::iterator it = backends_.begin(); it != backends_.end(); ++it) {
+            backend_summary& backend_ = it->second;
+            uint32_t max_ = backend_.latencies.empty() ? 0 : *std::max_element(backend_.latencies.begin(), backend_.latencies.end());
+            printf("%-46s %9llu %9llu %9llu %10.3f %10.3f %10.3f\n", it->first.data(), (unsigned long long)backend_.latencies.size(),
+                (unsigned long long)backend_.failures, (unsigned long long)backend_.timeouts, (double)percentile(backend_.latencies, 0.5) / 1000,
+                (double)percentile(backend_.latencies, 0.99) / 1000, (double)max_ / 1000);
+        }
+    }
+}
+
+int main(int argc, char* argv[]) {
+    const char* path_ = RINETD_FLIGHT_DEFAULT_FILE;
+    const char* client_ = NULL;
+    pid_t pid_ = 0;
+    size_t count_ = 0;
+    bool summary_ = false;
+    int opt_;
+    while ((opt_ = getopt(argc, argv, "f:p:c:n:sh")) != -1) {
+        switch (opt_) {
+        case 'f':
+            path_ = optarg;
+            break;
+        case 'p':
+            pid_ = (pid_t)atoi(optarg);
+            break;
+        case 'c':
+            client_ = optarg;
+            break;
+        case 'n':
+            count_ = (size_t)strtoul(optarg, NULL, 10);
+            break;
+        case 's':
+            summary_ = true;
+            break;
+        default:
+            fprintf(stderr, "usage: rinetd-flight [-f file] [-p pid] [-c client] [-n count] [-s]\n");
+            return 1;
+        }
+    }
+    if (pid_ > 0 && !request_dump(path_, pid_)) {
+        return 1;
+    }
+
+    flight_dump dump_;
+    if (!load_dump(path_, dump_)) {
+        return 1;
+    }
+    std::vector<const flight_event*> events_;
+    for (size_t i = 0, l = dump_.events.size(); i < l; i++) {
+        const rinetd_flight_record& record_ = dump_.events[i].record;
+        if (client_ && format_address(record_.client, record_.client_port).find(client_) == std::string::npos) {
+            continue;
+        }
+        events_.push_back(&dump_.events[i]);
+    }
+    if (count_ > 0 && events_.size() > count_) {
+        events_.erase(events_.begin(), events_.end() - count_);
+    }
+
+    if (summary_) {
+        print_summary(dump_, events_);
+        return 0;
+    }
+    for (size_t i = 0, l = events_.size(); i < l; i++) {
+        print_event(dump_, *events_[i]);
+    }
+    return 0;
+}
@@ -0,0 +1,406 @@
+/* rinetd-latency: relay latency benchmark. Starts rinetd in front of a local echo backend with the same forward twice,
+ * once on the default workers and once with busy_poll, and plays ping-pong over loopback: one request of -s bytes
+ * at a time, the next sent as soon as the echo is back. Round trips are timed directly against the backend, through
+ * the default rule and through the busy_poll rule, the paths taking turns in blocks so drift hits them alike, and
+ * the percentiles of each are printed.
+ *
+ *   rinetd-latency [-b rinetd] [-n rounds] [-s size] [-p usec] [-w workers] [-u] [-k]
+ *
+ * -p is the rule's busy_poll value, -u adds the same three paths over udp, -k keeps the working directory. The
+ * polling worker spins on a CPU of its own; on a machine with fewer CPUs than workers plus the two processes of
+ * the benchmark the spinning competes with them, pin it with cpu_affinity to get meaningful numbers. */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+static int const LATENCY_BLOCK                          = 500;  /* rounds a path runs before the next takes its turn */
+static int const LATENCY_WARMUP                         = 1000; /* rounds per path not counted */
+static int const LATENCY_MAX_SIZE                       = 65536;
+static int const LATENCY_TIMEOUT                        = 5;    /* s before a round trip counts as lost */
+
+typedef struct {
+    std::string                                         name;
+    int                                                 fd;
+    bool                                                stream;
+    std::vector<uint64_t>                               samples;        /* ns */
+    uint64_t                                            lost;
+} latency_path;
+
+static uint64_t
+now_ns() {
+    struct timespec ts_;
+    clock_gettime(CLOCK_MONOTONIC, &ts_);
+    return (uint64_t)ts_.tv_sec * 1000000000ULL + ts_.tv_nsec;
+}
+
+static struct sockaddr_in
+loopback(int port_) {
+    struct sockaddr_in in4_;
+    memset(&in4_, 0, sizeof(in4_));
+    in4_.sin_family = AF_INET;
+    in4_.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    in4_.sin_port = htons((uint16_t)port_);
+    return in4_;
+}
+
+static int
+bind_loopback(int type_, int& port_) {
+    int fd_ = socket(AF_INET, type_, 0);
+    if (fd_ < 0) {
+        return -1;
+    }
+    int on_ = 1;
+    setsockopt(fd_, SOL_SOCKET, SO_REUSEADDR, &on_, sizeof(on_));
+    struct sockaddr_in in4_ = loopback(port_);
+    socklen_t len_ = sizeof(in4_);
+    if (bind(fd_, (struct sockaddr*)&in4_, sizeof(in4_)) < 0 || getsockname(fd_, (struct sockaddr*)&in4_, &len_) < 0 ||
+        (type_ == SOCK_STREAM && listen(fd_, 64) < 0)) {
+        close(fd_);
+        return -1;
+    }
+    port_ = ntohs(in4_.sin_port);
+    return fd_;
+}
+
+static int
+free_port(int type_) {
+    int port_ = 0;
+    int fd_ = bind_loopback(type_, port_);
+    if (fd_ < 0) {
+        return 0;
+    }
+    close(fd_);
+    return port_;
+}
+
+/* The echo backend, a child process: every tcp connection and datagram on the port is answered with its bytes. */
+static pid_t
+start_echo(int tcp_, int udp_) {
+    pid_t child_ = fork();
+    if (child_ != 0) {
+        return child_;
+    }
+
+    std::vector<struct pollfd> fds_;
+    struct pollfd pfd_ = { tcp_, POLLIN, 0 };
+    fds_.push_back(pfd_);
+    pfd_.fd = udp_;
+    fds_.push_back(pfd_);
+    std::vector<char> buf_(LATENCY_MAX_SIZE);
+    for (;;) {
+        if (poll(fds_.data(), fds_.size(), -1) < 0 && errno != EINTR) {
+            _exit(1);
+        }
+        for (size_t i = 0; i < fds_.size(); i++) {
+            if (!fds_[i].revents) {
+                continue;
+            }
+            int fd_ = fds_[i].fd;
+            if (fd_ == tcp_) {
+                int conn_ = accept(tcp_, NULL, NULL);
+                if (conn_ >= 0) {
+                    int on_ = 1;
+                    setsockopt(conn_, IPPROTO_TCP, TCP_NODELAY, &on_, sizeof(on_));
+                    struct pollfd conn_pfd_ = { conn_, POLLIN, 0 };
+                    fds_.push_back(conn_pfd_);
+                }
+            }
+            else if (fd_ == udp_) {
+                struct sockaddr_storage from_;
+                socklen_t from_len_ = sizeof(from_);
+                ssize_t sz_ = recvfrom(udp_, buf_.data(), buf_.size(), 0, (struct sockaddr*)&from_, &from_len_);
+                if (sz_ > 0) {
+                    sendto(udp_, buf_.data(), sz_, 0, (struct sockaddr*)&from_, from_len_);
+                }
+            }
+            else {
+                ssize_t sz_ = recv(fd_, buf_.data(), buf_.size(), 0);
+                if (sz_ <= 0 || send(fd_, buf_.data(), sz_, MSG_NOSIGNAL) != sz_) {
+                    close(fd_);
+                    fds_.erase(fds_.begin() + i--);
+                }
+            }
+        }
+    }
+}
+
+static bool
+admin_pid(const std::string& path_, pid_t& pid_) {
+    int fd_ = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd_ < 0) {
+        return false;
+    }
+    struct sockaddr_un un_;
+    memset(&un_, 0, sizeof(un_));
+    un_.sun_family = AF_UNIX;
+    snprintf(un_.sun_path, sizeof(un_.sun_path), "%s", path_.data());
+    struct timeval tv_ = { 5, 0 };
+    setsockopt(fd_, SOL_SOCKET, SO_RCVTIMEO, &tv_, sizeof(tv_));
+    if (connect(fd_, (struct sockaddr*)&un_, sizeof(un_)) < 0 || send(fd_, "stats\n", 6, MSG_NOSIGNAL) != 6) {
+        close(fd_);
+        return false;
+    }
+
+    std::string out_;
+    char buf_[4096];
+    while (out_ != ".\n" && (out_.size() < 3 || out_.compare(out_.size() - 3, 3, "\n.\n") != 0)) {
+        ssize_t sz_ = recv(fd_, buf_, sizeof(buf_), 0);
+        if (sz_ <= 0) {
+            close(fd_);
+            return false;
+        }
+        out_.append(buf_, sz_);
+    }
+    close(fd_);
+
+    size_t sz_ = out_.find("process.pid ");
+    if (sz_ == std::string::npos) {
+        return false;
+    }
+    pid_ = (pid_t)atoi(out_.data() + sz_ + 12);
+    return pid_ > 0;
+}
+
+/* Starts rinetd and waits for its admin socket; a release build daemonizes, so the pid comes from its stats. */
+static pid_t
+start_rinetd(const std::string& binary_, const std::string& config_, const std::string& admin_) {
+    pid_t child_ = fork();
+    if (child_ < 0) {
+        return -1;
+    }
+    if (child_ == 0) {
+        execl(binary_.data(), binary_.data(), "-c", config_.data(), (char*)NULL);
+        _exit(127);
+    }
+
+    for (int i = 0; i < 100; i++) {
+        pid_t pid_ = 0;
+        if (admin_pid(admin_, pid_)) {
+            return pid_;
+        }
+        int status_ = 0;
+        if (waitpid(child_, &status_, WNOHANG) == child_ && !(WIFEXITED(status_) && WEXITSTATUS(status_) == 0)) {
+            return -1;
+        }
+        usleep(100000);
+    }
+    kill(child_, SIGTERM);
+    return -1;
+}
+
+static bool
+open_path(latency_path& path_, const char* name_, bool stream_, int port_) {
+    path_.name = name_;
+    path_.stream = stream_;
+    path_.lost = 0;
+    path_.fd = socket(AF_INET, stream_ ? SOCK_STREAM : SOCK_DGRAM, 0);
+    if (path_.fd < 0) {
+        return false;
+    }
+    int on_ = 1;
+    struct timeval tv_ = { LATENCY_TIMEOUT, 0 };
+    setsockopt(path_.fd, IPPROTO_TCP, TCP_NODELAY, &on_, sizeof(on_));
+    setsockopt(path_.fd, SOL_SOCKET, SO_RCVTIMEO, &tv_, sizeof(tv_));
+    struct sockaddr_in in4_ = loopback(port_);
+    return connect(path_.fd, (struct sockaddr*)&in4_, sizeof(in4_)) == 0;
+}
+
+/* One request and its echo; false when the path is broken. */
+static bool
+round_trip(latency_path& path_, std::vector<char>& out_, std::vector<char>& in_, bool counted_) {
+    out_[0]++;
+    uint64_t started_ = now_ns();
+    if (send(path_.fd, out_.data(), out_.size(), MSG_NOSIGNAL) != (ssize_t)out_.size()) {
+        return false;
+    }
+    size_t received_ = 0;
+    while (received_ < out_.size()) {
+        ssize_t sz_ = recv(path_.fd, in_.data() + received_, in_.size() - received_, 0);
+        if (sz_ < 0 && !path_.stream && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            path_.lost++;
+            return true;
+        }
+        if (sz_ <= 0) {
+            return false;
+        }
+        received_ += sz_;
+    }
+    if (counted_) {
+        path_.samples.push_back(now_ns() - started_);
+    }
+    return memcmp(out_.data(), in_.data(), out_.size()) == 0;
+}
+
+static double
+percentile(std::vector<uint64_t>& samples_, double p_) {
+    if (samples_.empty()) {
+        return 0;
+    }
+    size_t index_ = std::min(samples_.size() - 1, (size_t)(p_ * samples_.size()));
+    return samples_[index_] / 1000.0;
+}
+
+static void
+usage() {
+    fprintf(stderr, "usage: rinetd-latency [-b rinetd] [-n rounds] [-s size] [-p usec] [-w workers] [-u] [-k]\n");
+}
+
+int main(int argc, char** argv) {
+    std::string binary_ = "rinetd";
+    int rounds_ = 20000;
+    int size_ = 64;
+    int busy_poll_ = 50;
+    int workers_ = 1;
+    bool udp_ = false;
+    bool keep_ = false;
+    int opt_;
+    while ((opt_ = getopt(argc, argv, "b:n:s:p:w:ukh")) != -1) {
+        switch (opt_) {
+        case 'b':
+            binary_ = optarg;
+            break;
+        case 'n':
+            rounds_ = std::max(1, atoi(optarg));
+            break;
+        case 's':
+            size_ = std::min(LATENCY_MAX_SIZE, std::max(1, atoi(optarg)));
+            break;
+        case 'p':
+            busy_poll_ = std::max(1, atoi(optarg));
+            break;
+        case 'w':
+            workers_ = std::max(1, atoi(optarg));
+            break;
+        case 'u':
+            udp_ = true;
+            break;
+        case 'k':
+            keep_ = true;
+            break;
+        default:
+            usage();
+            return 2;
+        }
+    }
+    if (optind != argc) {
+        usage();
+        return 2;
+    }
+    if (binary_.find('/') == std::string::npos && access(binary_.data(), X_OK) == 0) {
+        binary_ = "./" + binary_;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    char dir_[] = "/tmp/rinetd-latency.XXXXXX";
+    if (!mkdtemp(dir_)) {
+        fprintf(stderr, "rinetd-latency: cannot create a working directory\n");
+        return 1;
+    }
+    std::string admin_ = std::string(dir_) + "/admin.sock";
+    std::string config_ = std::string(dir_) + "/rinetd.conf";
+    std::string log_ = std::string(dir_) + "/rinetd.log";
+
+    int backend_port_ = 0;
+    int backend_tcp_ = bind_loopback(SOCK_STREAM, backend_port_);
+    int backend_udp_ = backend_tcp_ < 0 ? -1 : bind_loopback(SOCK_DGRAM, backend_port_);
+    if (backend_udp_ < 0) {
+        fprintf(stderr, "rinetd-latency: cannot open the echo backend\n");
+        return 1;
+    }
+    pid_t echo_ = start_echo(backend_tcp_, backend_udp_);
+    close(backend_tcp_);
+    close(backend_udp_);
+
+    int default_port_ = free_port(SOCK_STREAM);
+    int busy_port_ = free_port(SOCK_STREAM);
+    FILE* file_ = fopen(config_.data(), "w");
+    if (!file_) {
+        fprintf(stderr, "rinetd-latency: cannot write %s\n", config_.data());
+        kill(echo_, SIGTERM);
+        return 1;
+    }
+    fprintf(file_, "workers %d\nadmin_socket %s\nlogfile %s\n", workers_, admin_.data(), log_.data());
+    fprintf(file_, "127.0.0.1 %d/tcp 127.0.0.1 %d/tcp\n", default_port_, backend_port_);
+    fprintf(file_, "127.0.0.1 %d/tcp 127.0.0.1 %d/tcp [busy_poll=%d]\n", busy_port_, backend_port_, busy_poll_);
+    fprintf(file_, "127.0.0.1 %d/udp 127.0.0.1 %d/udp\n", default_port_, backend_port_);
+    fprintf(file_, "127.0.0.1 %d/udp 127.0.0.1 %d/udp [busy_poll=%d]\n", busy_port_, backend_port_, busy_poll_);
+    fclose(file_);
+
+    pid_t pid_ = start_rinetd(binary_, config_, admin_);
+    if (pid_ <= 0) {
+        fprintf(stderr, "rinetd-latency: %s did not come up, see %s\n", binary_.data(), log_.data());
+        kill(echo_, SIGTERM);
+        return 1;
+    }
+
+    std::vector<latency_path> paths_(udp_ ? 6 : 3);
+    for (size_t i = 0; i < paths_.size(); i++) {
+        paths_[i].fd = -1;
+    }
+    bool ok_ = open_path(paths_[0], "tcp direct", true, backend_port_) &&
+        open_path(paths_[1], "tcp rinetd", true, default_port_) &&
+        open_path(paths_[2], "tcp busy_poll", true, busy_port_);
+    if (udp_) {
+        ok_ = ok_ && open_path(paths_[3], "udp direct", false, backend_port_) &&
+            open_path(paths_[4], "udp rinetd", false, default_port_) &&
+            open_path(paths_[5], "udp busy_poll", false, busy_port_);
+    }
+
+    printf("rinetd %d, %d workers, busy_poll=%d, %d rounds of %d bytes per path, working directory %s\n", (int)pid_,
+        workers_, busy_poll_, rounds_, size_, dir_);
+    std::vector<char> out_(size_, 'x');
+    std::vector<char> in_(size_);
+    int total_ = rounds_ + LATENCY_WARMUP;
+    for (int done_ = 0; ok_ && done_ < total_; done_ += LATENCY_BLOCK) {
+        for (size_t i = 0; ok_ && i < paths_.size(); i++) {
+            for (int n = done_; ok_ && n < std::min(total_, done_ + LATENCY_BLOCK); n++) {
+                ok_ = round_trip(paths_[i], out_, in_, n >= LATENCY_WARMUP);
+            }
+            if (!ok_) {
+                fprintf(stderr, "rinetd-latency: %s failed: %s\n", paths_[i].name.data(), strerror(errno));
+            }
+        }
+    }
+
+    if (ok_) {
+        printf("%-14s %8s %9s %9s %9s %9s %9s %6s\n", "path", "rounds", "p50us", "p90us", "p99us", "p99.9us", "maxus", "lost");
+        for (size_t i = 0; i < paths_.size(); i++) {
+            latency_path& path_ = paths_[i];
+            std::sort(path_.samples.begin(), path_.samples.end());
+            printf("%-14s %8zu %9.1f %9.1f %9.1f %9.1f %9.1f %6llu\n", path_.name.data(), path_.samples.size(),
+                percentile(path_.samples, 0.50), percentile(path_.samples, 0.90), percentile(path_.samples, 0.99),
+                percentile(path_.samples, 0.999), path_.samples.empty() ? 0 : path_.samples.back() / 1000.0,
+                (unsigned long long)path_.lost);
+        }
+    }
+    for (size_t i = 0; i < paths_.size(); i++) {
+        if (paths_[i].fd >= 0) {
+            close(paths_[i].fd);
+        }
+    }
+    kill(pid_, SIGTERM);
+    kill(echo_, SIGTERM);
+    waitpid(echo_, NULL, 0);
+    if (!keep_) {
+        sleep(1);
+        unlink(config_.data());
+        unlink(log_.data());
+        unlink(admin_.data());
+        rmdir(dir_);
+    }
+    return ok_ ? 0 : 1;
+}
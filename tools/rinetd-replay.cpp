@@ -0,0 +1,380 @@
+/* rinetd-replay: plays a capture written by a rule's "mirror=" option against a target, to reproduce a problem or
+ * to load a server with the traffic it really sees. Every captured flow becomes a connection to the target that
+ * sends the client's bytes at their recorded pace; what the target answers is read and counted, not compared.
+ *
+ *   rinetd-replay [-s speed] [-n passes] [-t seconds] capture host:port
+ *   rinetd-replay -l capture
+ *
+ * -s scales the recorded pace (2 plays twice as fast, 0 sends everything as soon as the target takes it), -n plays
+ * the capture several times in a row, -t is how long flows may still run after the last record, -l lists records. */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+#include <capture.h>
+
+typedef struct {
+    uint64_t                                            timestamp;
+    uint64_t                                            flow;
+    uint32_t                                            length;
+    int                                                 type;
+    size_t                                              offset;         /* payload position in the capture */
+} replay_record;
+
+typedef struct {
+    int                                                 fd;
+    bool                                                connected;
+    bool                                                closing;        /* the capture closed it, shut down once sent */
+    std::string                                         pending;
+    size_t                                              sent;
+} replay_flow;
+
+typedef struct {
+    uint64_t                                            flows;
+    uint64_t                                            connect_errors;
+    uint64_t                                            gaps;
+    uint64_t                                            bytes_sent;
+    uint64_t                                            bytes_received;
+    uint64_t                                            bytes_captured_down;
+} replay_totals;
+
+static uint64_t
+now_us() {
+    struct timespec ts_;
+    clock_gettime(CLOCK_MONOTONIC, &ts_);
+    return (uint64_t)ts_.tv_sec * 1000000 + ts_.tv_nsec / 1000;
+}
+
+static bool
+load_capture(const char* path_, std::string& data_, std::vector<replay_record>& records_) {
+    FILE* file_ = fopen(path_, "rb");
+    if (!file_) {
+        fprintf(stderr, "rinetd-replay: cannot open %s\n", path_);
+        return false;
+    }
+    char buf_[65536];
+    size_t sz_;
+    while ((sz_ = fread(buf_, 1, sizeof(buf_), file_)) > 0) {
+        data_.append(buf_, sz_);
+    }
+    fclose(file_);
+
+    rinetd_capture_header header_;
+    if (data_.size() < sizeof(header_)) {
+        fprintf(stderr, "rinetd-replay: %s is not a capture\n", path_);
+        return false;
+    }
+    memcpy(&header_, data_.data(), sizeof(header_));
+    if (memcmp(header_.magic, RINETD_CAPTURE_MAGIC, sizeof(header_.magic)) != 0 || header_.version != RINETD_CAPTURE_VERSION ||
+        header_.record_size != sizeof(rinetd_capture_record)) {
+        fprintf(stderr, "rinetd-replay: %s is not a version %u capture\n", path_, RINETD_CAPTURE_VERSION);
+        return false;
+    }
+
+    /* Workers append in chunks, so records are only ordered per worker; a truncated last record is ignored. */
+    size_t offset_ = sizeof(header_);
+    while (offset_ + sizeof(rinetd_capture_record) <= data_.size()) {
+        rinetd_capture_record record_;
+        memcpy(&record_, data_.data() + offset_, sizeof(record_));
+        offset_ += sizeof(record_);
+
+        size_t payload_ = record_.type == RINETD_CAPTURE_LOST ? 0 : record_.length;
+        if (offset_ + payload_ > data_.size()) {
+            break;
+        }
+        replay_record entry_ = { record_.timestamp, record_.flow, record_.length, record_.type, offset_ };
+        records_.push_back(entry_);
+        offset_ += payload_;
+    }
+    std::stable_sort(records_.begin(), records_.end(), [](const replay_record& a, const replay_record& b) {
+        return a.timestamp < b.timestamp;
+    });
+    return true;
+}
+
+static void
+list_capture(const std::string& data_, const std::vector<replay_record>& records_) {
+    static const char* types_[] = { "open", "up", "down", "close", "lost" };
+    uint64_t first_ = records_.empty() ? 0 : records_[0].timestamp;
+    for (size_t i = 0, l = records_.size(); i < l; i++) {
+        const replay_record& record_ = records_[i];
+        printf("%12.6f %3u:%-10llu %-5s %u", (double)(record_.timestamp - first_) / 1000000, (unsigned)(record_.flow >> 48),
+            (unsigned long long)(record_.flow & ((1ULL << 48) - 1)), record_.type <= RINETD_CAPTURE_LOST ? types_[record_.type] : "?",
+            record_.length);
+        if (record_.type == RINETD_CAPTURE_OPEN) {
+            printf(" %.*s", (int)record_.length, data_.data() + record_.offset);
+        }
+        printf("\n");
+    }
+}
+
+static bool
+parse_target(const char* str_, struct sockaddr_storage& target_, socklen_t& target_len_) {
+    std::string host_ = str_;
+    size_t sz_ = host_.rfind(':');
+    if (sz_ == std::string::npos) {
+        return false;
+    }
+    int port_ = atoi(host_.data() + sz_ + 1);
+    host_ = host_.substr(0, sz_);
+    if (host_.size() > 1 && host_[0] == '[' && host_[host_.size() - 1] == ']') {
+        host_ = host_.substr(1, host_.size() - 2);
+    }
+    if (port_ <= 0 || port_ > 65535) {
+        return false;
+    }
+
+    memset(&target_, 0, sizeof(target_));
+    struct sockaddr_in* in4_ = (struct sockaddr_in*)&target_;
+    struct sockaddr_in6* in6_ = (struct sockaddr_in6*)&target_;
+    if (inet_pton(AF_INET, host_.data(), &in4_->sin_addr) == 1) {
+        in4_->sin_family = AF_INET;
+        in4_->sin_port = htons((uint16_t)port_);
+        target_len_ = sizeof(*in4_);
+        return true;
+    }
+    if (inet_pton(AF_INET6, host_.data(), &in6_->sin6_addr) == 1) {
+        in6_->sin6_family = AF_INET6;
+        in6_->sin6_port = htons((uint16_t)port_);
+        target_len_ = sizeof(*in6_);
+        return true;
+    }
+    return false;
+}
+
+static void
+close_flow(std::map<uint64_t, replay_flow>& flows_, std::map<uint64_t, replay_flow>::iterator it) {
+    if (it->second.fd != -1) {
+        close(it->second.fd);
+    }
+    flows_.erase(it);
+}
+
+/* Sends what is pending; false once the flow is done with or broken. */
+static bool
+send_flow(replay_flow& flow_, replay_totals& totals_) {
+    while (flow_.connected && flow_.sent < flow_.pending.size()) {
+        ssize_t sz_ = send(flow_.fd, flow_.pending.data() + flow_.sent, flow_.pending.size() - flow_.sent, MSG_NOSIGNAL);
+        if (sz_ < 0) {
+            return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+        }
+        flow_.sent += sz_;
+        totals_.bytes_sent += sz_;
+    }
+    if (flow_.sent == flow_.pending.size()) {
+        flow_.pending.clear();
+        flow_.sent = 0;
+        if (flow_.connected && flow_.closing) {
+            shutdown(flow_.fd, SHUT_WR);
+        }
+    }
+    return true;
+}
+
+static void
+replay_event(const std::string& data_, const replay_record& record_, uint64_t pass_, std::map<uint64_t, replay_flow>& flows_,
+    const struct sockaddr_storage& target_, socklen_t target_len_, replay_totals& totals_) {
+    /* Passes get flows of their own, the serial has 48 bits and captures do not come close to 2^40 flows. */
+    uint64_t key_ = record_.flow ^ (pass_ << 40);
+    std::map<uint64_t, replay_flow>::iterator it = flows_.find(key_);
+    switch (record_.type) {
+    case RINETD_CAPTURE_OPEN: {
+        int fd_ = socket(target_.ss_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+        if (fd_ < 0) {
+            totals_.connect_errors++;
+            return;
+        }
+        int nodelay_ = 1;
+        setsockopt(fd_, IPPROTO_TCP, TCP_NODELAY, &nodelay_, sizeof(nodelay_));
+        if (connect(fd_, (struct sockaddr*)&target_, target_len_) < 0 && errno != EINPROGRESS) {
+            close(fd_);
+            totals_.connect_errors++;
+            return;
+        }
+        replay_flow& flow_ = flows_[key_];
+        flow_.fd = fd_;
+        flow_.connected = false;
+        flow_.closing = false;
+        flow_.sent = 0;
+        totals_.flows++;
+        break;
+    }
+    case RINETD_CAPTURE_UP:
+        /* Flows already open when the capture began have no open record and are skipped. */
+        if (it != flows_.end()) {
+            it->second.pending.append(data_.data() + record_.offset, record_.length);
+            if (!send_flow(it->second, totals_)) {
+                close_flow(flows_, it);
+            }
+        }
+        break;
+    case RINETD_CAPTURE_DOWN:
+        totals_.bytes_captured_down += record_.length;
+        break;
+    case RINETD_CAPTURE_CLOSE:
+        if (it != flows_.end()) {
+            it->second.closing = true;
+            if (!send_flow(it->second, totals_)) {
+                close_flow(flows_, it);
+            }
+        }
+        break;
+    case RINETD_CAPTURE_LOST:
+        totals_.gaps++;
+        break;
+    default:
+        break;
+    }
+}
+
+static void
+poll_flows(std::map<uint64_t, replay_flow>& flows_, int timeout_ms_, replay_totals& totals_) {
+    std::vector<struct pollfd> fds_;
+    std::vector<uint64_t> keys_;
+    for (std::map<uint64_t, replay_flow>::iterator it = flows_.begin(); it != flows_.end(); it++) {
+        struct pollfd pfd_;
+        pfd_.fd = it->second.fd;
+        pfd_.events = POLLIN;
+        pfd_.revents = 0;
+        if (!it->second.connected || it->second.sent < it->second.pending.size()) {
+            pfd_.events |= POLLOUT;
+        }
+        fds_.push_back(pfd_);
+        keys_.push_back(it->first);
+    }
+    if (poll(fds_.empty() ? NULL : fds_.data(), fds_.size(), timeout_ms_) <= 0) {
+        return;
+    }
+
+    char buf_[65536];
+    for (size_t i = 0, l = fds_.size(); i < l; i++) {
+        if (!fds_[i].revents) {
+            continue;
+        }
+        std::map<uint64_t, replay_flow>::iterator it = flows_.find(keys_[i]);
+        replay_flow& flow_ = it->second;
+        if (!flow_.connected && (fds_[i].revents & (POLLOUT | POLLERR | POLLHUP))) {
+            int error_ = 0;
+            socklen_t error_len_ = sizeof(error_);
+            if (getsockopt(flow_.fd, SOL_SOCKET, SO_ERROR, &error_, &error_len_) < 0 || error_ != 0) {
+                totals_.connect_errors++;
+                close_flow(flows_, it);
+                continue;
+            }
+            flow_.connected = true;
+        }
+        if (fds_[i].revents & (POLLIN | POLLHUP | POLLERR)) {
+            ssize_t sz_ = recv(flow_.fd, buf_, sizeof(buf_), 0);
+            if (sz_ > 0) {
+                totals_.bytes_received += sz_;
+            }
+            else if (sz_ == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+                close_flow(flows_, it);
+                continue;
+            }
+        }
+        if (!send_flow(flow_, totals_)) {
+            close_flow(flows_, it);
+        }
+    }
+}
+
+static void
+usage() {
+    fprintf(stderr, "usage: rinetd-replay [-s speed] [-n passes] [-t seconds] capture host:port\n"
+                    "       rinetd-replay -l capture\n");
+}
+
+int main(int argc, char** argv) {
+    double speed_ = 1;
+    int passes_ = 1;
+    int linger_ = 5;
+    bool list_ = false;
+    int opt_;
+    while ((opt_ = getopt(argc, argv, "s:n:t:lh")) != -1) {
+        switch (opt_) {
+        case 's':
+            speed_ = atof(optarg);
+            break;
+        case 'n':
+            passes_ = std::max(1, atoi(optarg));
+            break;
+        case 't':
+            linger_ = std::max(0, atoi(optarg));
+            break;
+        case 'l':
+            list_ = true;
+            break;
+        default:
+            usage();
+            return 2;
+        }
+    }
+    if (optind >= argc || (!list_ && optind + 1 >= argc) || speed_ < 0) {
+        usage();
+        return 2;
+    }
+
+    std::string data_;
+    std::vector<replay_record> records_;
+    if (!load_capture(argv[optind], data_, records_)) {
+        return 1;
+    }
+    if (list_) {
+        list_capture(data_, records_);
+        return 0;
+    }
+
+    struct sockaddr_storage target_;
+    socklen_t target_len_ = 0;
+    if (!parse_target(argv[optind + 1], target_, target_len_)) {
+        fprintf(stderr, "rinetd-replay: bad target %s\n", argv[optind + 1]);
+        return 2;
+    }
+
+    replay_totals totals_;
+    memset(&totals_, 0, sizeof(totals_));
+    std::map<uint64_t, replay_flow> flows_;
+    uint64_t started_ = now_us();
+    uint64_t span_ = records_.empty() ? 0 : records_.back().timestamp - records_.front().timestamp;
+    for (int pass_ = 0; pass_ < passes_; pass_++) {
+        uint64_t pass_start_ = now_us();
+        for (size_t i = 0, l = records_.size(); i < l;) {
+            uint64_t due_ = speed_ > 0 ? pass_start_ + (uint64_t)((records_[i].timestamp - records_[0].timestamp) / speed_) : 0;
+            uint64_t now_ = now_us();
+            if (due_ <= now_) {
+                replay_event(data_, records_[i++], (uint64_t)pass_, flows_, target_, target_len_, totals_);
+                continue;
+            }
+            poll_flows(flows_, (int)std::min<uint64_t>((due_ - now_ + 999) / 1000, 100), totals_);
+        }
+    }
+    uint64_t deadline_ = now_us() + (uint64_t)linger_ * 1000000;
+    while (!flows_.empty() && now_us() < deadline_) {
+        poll_flows(flows_, 100, totals_);
+    }
+    for (std::map<uint64_t, replay_flow>::iterator it = flows_.begin(); it != flows_.end(); it = flows_.begin()) {
+        close_flow(flows_, it);
+    }
+
+    double elapsed_ = (double)(now_us() - started_) / 1000000;
+    printf("passes %d, %zu records over %.3f s captured\n", passes_, records_.size(), (double)span_ / 1000000);
+    printf("flows %llu, connect errors %llu, capture gaps %llu\n", (unsigned long long)totals_.flows,
+        (unsigned long long)totals_.connect_errors, (unsigned long long)totals_.gaps);
+    printf("sent %llu bytes, received %llu bytes (captured %llu per pass) in %.3f s, %.1f Mbit/s\n",
+        (unsigned long long)totals_.bytes_sent, (unsigned long long)totals_.bytes_received, (unsigned long long)totals_.bytes_captured_down / passes_,
+        elapsed_, elapsed_ > 0 ? (double)(totals_.bytes_sent + totals_.bytes_received) * 8 / elapsed_ / 1000000 : 0.0);
+    return totals_.connect_errors > 0 ? 1 : 0;
+}
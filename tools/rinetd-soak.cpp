@@ -0,0 +1,701 @@
+/* rinetd-soak: connection churn soak test. Starts rinetd on a generated configuration in front of local stand-in
+ * backends, opens and closes short sessions against it in rounds and, whenever rinetd has gone idle, samples what
+ * its admin socket reports: live and cached slab objects, asio operations that missed their owner's handler memory,
+ * charged memory, open descriptors, resident set and, with jemalloc, allocated bytes. Sessions are echoed tcp connections, tcp connections whose backend refuses, tcp
+ * connections whose backend never answers the handshake (rinetd's connect timeout) and udp flows that echo once
+ * and are left to age out.
+ *
+ *   rinetd-soak [-b rinetd] [-r rounds] [-n sessions] [-c concurrency] [-w workers] [-g bytes] [-k]
+ *
+ * The first third of the rounds warms caches and heaps up, the last of them sets the baseline. The run fails when
+ * sessions misbehave, when objects, charged memory or descriptors are still held once rinetd is idle, when asio
+ * operations still go to the heap after the warm-up, or when memory
+ * per idle slot (each of the -c concurrent sessions) grew by more than -g bytes over the baseline; without jemalloc
+ * that is the resident set, which moves in pages, so keep -g coarse there. -k keeps the working directory. */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+
+static int const SOAK_UDP_TIMEOUT                       = 1;    /* s, udp_timeout of the udp rule */
+static int const SOAK_SESSION_TIMEOUT                   = 20;   /* s before a session rinetd never finished is stuck, well above its connect timeout */
+static int const SOAK_UDP_REPLY_TIMEOUT                 = 2;    /* s before an unanswered datagram counts as lost */
+static int const SOAK_IDLE_TIMEOUT                      = 30;   /* s rinetd gets to release everything after a round */
+static int const SOAK_MAX_PAYLOAD                       = 4096;
+
+enum {
+    SOAK_ECHO,                                          /* tcp, payload echoed by the backend */
+    SOAK_REFUSED,                                       /* tcp, backend port refuses */
+    SOAK_BLACKHOLE,                                     /* tcp, backend drops the handshake */
+    SOAK_UDP,                                           /* udp, one datagram echoed */
+    SOAK_KINDS,
+};
+
+typedef struct {
+    int                                                 kind;
+    int                                                 fd;
+    bool                                                connected;
+    uint64_t                                            deadline;
+    std::string                                         payload;
+    size_t                                              sent;
+    size_t                                              received;
+} soak_session;
+
+typedef struct {
+    int                                                 fd;
+    std::string                                         pending;
+} soak_echo;
+
+typedef struct {
+    uint64_t                                            started[SOAK_KINDS];
+    uint64_t                                            errors;         /* wrong data, early close, rinetd unreachable */
+    uint64_t                                            stuck;          /* not finished by rinetd in time */
+    uint64_t                                            udp_lost;
+} soak_totals;
+
+typedef std::map<std::string, std::string>              soak_stats;
+
+static uint64_t
+now_ms() {
+    struct timespec ts_;
+    clock_gettime(CLOCK_MONOTONIC, &ts_);
+    return (uint64_t)ts_.tv_sec * 1000 + ts_.tv_nsec / 1000000;
+}
+
+static struct sockaddr_in
+loopback(int port_) {
+    struct sockaddr_in in4_;
+    memset(&in4_, 0, sizeof(in4_));
+    in4_.sin_family = AF_INET;
+    in4_.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    in4_.sin_port = htons((uint16_t)port_);
+    return in4_;
+}
+
+/* Binds a loopback socket to a free port; listen_ < 0 leaves a tcp socket unlistened, which refuses connections. */
+static int
+bind_loopback(int type_, int listen_, int& port_) {
+    int fd_ = socket(AF_INET, type_ | SOCK_NONBLOCK, 0);
+    if (fd_ < 0) {
+        return -1;
+    }
+    struct sockaddr_in in4_ = loopback(0);
+    socklen_t len_ = sizeof(in4_);
+    if (bind(fd_, (struct sockaddr*)&in4_, sizeof(in4_)) < 0 || getsockname(fd_, (struct sockaddr*)&in4_, &len_) < 0 ||
+        (type_ == SOCK_STREAM && listen_ >= 0 && listen(fd_, listen_) < 0)) {
+        close(fd_);
+        return -1;
+    }
+    port_ = ntohs(in4_.sin_port);
+    return fd_;
+}
+
+static int
+free_port(int type_) {
+    int port_ = 0;
+    int fd_ = bind_loopback(type_, -1, port_);
+    if (fd_ < 0) {
+        return 0;
+    }
+    close(fd_);
+    return port_;
+}
+
+static bool
+admin_stats(const std::string& path_, soak_stats& stats_) {
+    int fd_ = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd_ < 0) {
+        return false;
+    }
+    struct sockaddr_un un_;
+    memset(&un_, 0, sizeof(un_));
+    un_.sun_family = AF_UNIX;
+    snprintf(un_.sun_path, sizeof(un_.sun_path), "%s", path_.data());
+    struct timeval tv_ = { 5, 0 };
+    setsockopt(fd_, SOL_SOCKET, SO_RCVTIMEO, &tv_, sizeof(tv_));
+    if (connect(fd_, (struct sockaddr*)&un_, sizeof(un_)) < 0 || send(fd_, "stats\n", 6, MSG_NOSIGNAL) != 6) {
+        close(fd_);
+        return false;
+    }
+
+    std::string out_;
+    char buf_[4096];
+    while (out_ != ".\n" && (out_.size() < 3 || out_.compare(out_.size() - 3, 3, "\n.\n") != 0)) {
+        ssize_t sz_ = recv(fd_, buf_, sizeof(buf_), 0);
+        if (sz_ <= 0) {
+            close(fd_);
+            return false;
+        }
+        out_.append(buf_, sz_);
+    }
+    close(fd_);
+
+    stats_.clear();
+    for (size_t begin_ = 0, end_; (end_ = out_.find('\n', begin_)) != std::string::npos; begin_ = end_ + 1) {
+        std::string line_ = out_.substr(begin_, end_ - begin_);
+        size_t sz_ = line_.find(' ');
+        if (sz_ != std::string::npos) {
+            stats_[line_.substr(0, sz_)] = line_.substr(sz_ + 1);
+        }
+    }
+    return true;
+}
+
+static int64_t
+stat_value(soak_stats& stats_, const char* key_) {
+    soak_stats::iterator it = stats_.find(key_);
+    return it == stats_.end() ? -1 : strtoll(it->second.data(), NULL, 10);
+}
+
+class soak_driver {
+public:
+    inline soak_driver(int concurrency_)
+        : concurrency_(concurrency_)
+        , echo_port_(0)
+        , refused_port_(0)
+        , blackhole_port_(0)
+        , udp_port_(0)
+        , echo_listener_(-1)
+        , refused_socket_(-1)
+        , blackhole_listener_(-1)
+        , udp_echo_(-1) {
+        memset(&totals_, 0, sizeof(totals_));
+        memset(ports_, 0, sizeof(ports_));
+    }
+    inline ~soak_driver() {
+        for (size_t i = 0, l = sessions_.size(); i < l; i++) {
+            close(sessions_[i].fd);
+        }
+        for (size_t i = 0, l = echoes_.size(); i < l; i++) {
+            close(echoes_[i].fd);
+        }
+        for (size_t i = 0, l = blackhole_fill_.size(); i < l; i++) {
+            close(blackhole_fill_[i]);
+        }
+        int fds_[] = { echo_listener_, refused_socket_, blackhole_listener_, udp_echo_ };
+        for (size_t i = 0; i < sizeof(fds_) / sizeof(*fds_); i++) {
+            if (fds_[i] != -1) {
+                close(fds_[i]);
+            }
+        }
+    }
+
+public:
+    /* Stand-in backends: an echo server, a bound but unlistened port, and a listener whose accept queue is kept
+     * full so further handshakes are dropped and rinetd's connect runs into its timeout. */
+    inline bool                                         open_backends() {
+        echo_listener_ = bind_loopback(SOCK_STREAM, 511, echo_port_);
+        refused_socket_ = bind_loopback(SOCK_STREAM, -1, refused_port_);
+        blackhole_listener_ = bind_loopback(SOCK_STREAM, 0, blackhole_port_);
+        udp_echo_ = bind_loopback(SOCK_DGRAM, 0, udp_port_);
+        if (echo_listener_ < 0 || refused_socket_ < 0 || blackhole_listener_ < 0 || udp_echo_ < 0) {
+            return false;
+        }
+        struct sockaddr_in in4_ = loopback(blackhole_port_);
+        for (int i = 0; i < 4; i++) {
+            int fd_ = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+            if (fd_ >= 0) {
+                connect(fd_, (struct sockaddr*)&in4_, sizeof(in4_));
+                blackhole_fill_.push_back(fd_);
+            }
+        }
+        for (int i = 0; i < SOAK_KINDS; i++) {
+            ports_[i] = free_port(i == SOAK_UDP ? SOCK_DGRAM : SOCK_STREAM);
+            if (ports_[i] == 0) {
+                return false;
+            }
+        }
+        return true;
+    }
+    inline std::string                                  rules() {
+        char buf_[1024];
+        snprintf(buf_, sizeof(buf_),
+            "127.0.0.1 %d/tcp 127.0.0.1 %d/tcp [fail_threshold=0]\n"
+            "127.0.0.1 %d/tcp 127.0.0.1 %d/tcp [fail_threshold=0]\n"
+            "127.0.0.1 %d/tcp 127.0.0.1 %d/tcp [fail_threshold=0]\n"
+            "127.0.0.1 %d/udp 127.0.0.1 %d/udp [udp_timeout=%ds]\n",
+            ports_[SOAK_ECHO], echo_port_, ports_[SOAK_REFUSED], refused_port_, ports_[SOAK_BLACKHOLE], blackhole_port_,
+            ports_[SOAK_UDP], udp_port_, SOAK_UDP_TIMEOUT);
+        return buf_;
+    }
+    /* Runs one round: a few blackholed sessions are started first, they hold their slot for the connect timeout,
+     * the rest cycles through refused, udp and echo sessions, never more than concurrency at a time. */
+    inline void                                         round(uint64_t count_) {
+        uint64_t blackholes_ = std::min<uint64_t>(std::max(1, concurrency_ / 16), count_);
+        uint64_t started_ = 0;
+        for (; started_ < blackholes_; started_++) {
+            start(SOAK_BLACKHOLE);
+        }
+        while (started_ < count_ || !sessions_.empty()) {
+            while (started_ < count_ && (int)sessions_.size() < concurrency_) {
+                uint64_t slot_ = started_++ % 20;
+                start(slot_ < 3 ? SOAK_REFUSED : slot_ < 6 ? SOAK_UDP : SOAK_ECHO);
+            }
+            poll_once(100);
+        }
+    }
+    /* Keeps the stand-ins serving while rinetd winds down. */
+    inline void                                         serve(int timeout_ms_) {
+        poll_once(timeout_ms_);
+    }
+    inline soak_totals&                                 totals() {
+        return totals_;
+    }
+
+private:
+    inline void                                         start(int kind_) {
+        totals_.started[kind_]++;
+        soak_session session_;
+        session_.kind = kind_;
+        session_.connected = false;
+        session_.sent = 0;
+        session_.received = 0;
+        session_.deadline = now_ms() + (kind_ == SOAK_UDP ? SOAK_UDP_REPLY_TIMEOUT : SOAK_SESSION_TIMEOUT) * 1000;
+        if (kind_ == SOAK_ECHO || kind_ == SOAK_UDP) {
+            size_t size_ = 1 + rand() % (kind_ == SOAK_UDP ? 1024 : SOAK_MAX_PAYLOAD);
+            session_.payload.resize(size_);
+            for (size_t i = 0; i < size_; i++) {
+                session_.payload[i] = (char)rand();
+            }
+        }
+
+        session_.fd = socket(AF_INET, (kind_ == SOAK_UDP ? SOCK_DGRAM : SOCK_STREAM) | SOCK_NONBLOCK, 0);
+        if (session_.fd < 0) {
+            totals_.errors++;
+            return;
+        }
+        struct sockaddr_in in4_ = loopback(ports_[kind_]);
+        if (connect(session_.fd, (struct sockaddr*)&in4_, sizeof(in4_)) < 0 && errno != EINPROGRESS) {
+            close(session_.fd);
+            totals_.errors++;
+            return;
+        }
+        if (kind_ == SOAK_UDP) {
+            session_.connected = true;
+            if (send(session_.fd, session_.payload.data(), session_.payload.size(), 0) < 0) {
+                close(session_.fd);
+                totals_.errors++;
+                return;
+            }
+        }
+        sessions_.push_back(session_);
+    }
+    /* False once the session is over, errors counted. */
+    inline bool                                         step(soak_session& session_, short revents_) {
+        char buf_[SOAK_MAX_PAYLOAD * 2];
+        if (!session_.connected) {
+            int error_ = 0;
+            socklen_t error_len_ = sizeof(error_);
+            if (getsockopt(session_.fd, SOL_SOCKET, SO_ERROR, &error_, &error_len_) < 0 || error_ != 0) {
+                /* A reset may beat the connect notification when rinetd gives up on the backend quickly. */
+                if (error_ != ECONNRESET || session_.kind == SOAK_ECHO) {
+                    totals_.errors++;
+                }
+                return false;
+            }
+            session_.connected = true;
+        }
+        while (session_.sent < session_.payload.size() && session_.kind == SOAK_ECHO) {
+            ssize_t sz_ = send(session_.fd, session_.payload.data() + session_.sent, session_.payload.size() - session_.sent, MSG_NOSIGNAL);
+            if (sz_ < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+                    break;
+                }
+                totals_.errors++;
+                return false;
+            }
+            session_.sent += sz_;
+        }
+        if (!(revents_ & (POLLIN | POLLHUP | POLLERR))) {
+            return true;
+        }
+
+        ssize_t sz_ = recv(session_.fd, buf_, sizeof(buf_), 0);
+        if (sz_ < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+            return true;
+        }
+        switch (session_.kind) {
+        case SOAK_ECHO:
+        case SOAK_UDP:
+            if (sz_ <= 0 || session_.received + sz_ > session_.payload.size() ||
+                memcmp(session_.payload.data() + session_.received, buf_, sz_) != 0) {
+                totals_.errors++;
+                return false;
+            }
+            session_.received += sz_;
+            return session_.received < session_.payload.size();
+        default:
+            /* rinetd closes or resets once its backend connect failed; it must not have sent anything. */
+            if (sz_ > 0) {
+                totals_.errors++;
+            }
+            return false;
+        }
+    }
+    inline void                                         accept_echoes() {
+        for (;;) {
+            int fd_ = accept4(echo_listener_, NULL, NULL, SOCK_NONBLOCK);
+            if (fd_ < 0) {
+                return;
+            }
+            soak_echo echo_;
+            echo_.fd = fd_;
+            echoes_.push_back(echo_);
+        }
+    }
+    /* False once the peer is gone. */
+    inline bool                                         serve_echo(soak_echo& echo_) {
+        char buf_[65536];
+        if (echo_.pending.empty()) {
+            ssize_t sz_ = recv(echo_.fd, buf_, sizeof(buf_), 0);
+            if (sz_ == 0 || (sz_ < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+                return false;
+            }
+            if (sz_ > 0) {
+                echo_.pending.assign(buf_, sz_);
+            }
+        }
+        if (!echo_.pending.empty()) {
+            ssize_t sz_ = send(echo_.fd, echo_.pending.data(), echo_.pending.size(), MSG_NOSIGNAL);
+            if (sz_ < 0) {
+                return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+            }
+            echo_.pending.erase(0, sz_);
+        }
+        return true;
+    }
+    inline void                                         serve_udp() {
+        char buf_[65536];
+        for (int i = 0; i < 64; i++) {
+            struct sockaddr_storage from_;
+            socklen_t from_len_ = sizeof(from_);
+            ssize_t sz_ = recvfrom(udp_echo_, buf_, sizeof(buf_), 0, (struct sockaddr*)&from_, &from_len_);
+            if (sz_ < 0) {
+                return;
+            }
+            sendto(udp_echo_, buf_, sz_, 0, (struct sockaddr*)&from_, from_len_);
+        }
+    }
+    inline void                                         poll_once(int timeout_ms_) {
+        std::vector<struct pollfd> fds_;
+        struct pollfd pfd_;
+        pfd_.revents = 0;
+        pfd_.events = POLLIN;
+        pfd_.fd = echo_listener_;
+        fds_.push_back(pfd_);
+        pfd_.fd = udp_echo_;
+        fds_.push_back(pfd_);
+        for (size_t i = 0, l = echoes_.size(); i < l; i++) {
+            pfd_.fd = echoes_[i].fd;
+            pfd_.events = echoes_[i].pending.empty() ? POLLIN : POLLOUT;
+            fds_.push_back(pfd_);
+        }
+        for (size_t i = 0, l = sessions_.size(); i < l; i++) {
+            soak_session& session_ = sessions_[i];
+            pfd_.fd = session_.fd;
+            pfd_.events = POLLIN;
+            if (!session_.connected || session_.sent < session_.payload.size()) {
+                pfd_.events |= POLLOUT;
+            }
+            fds_.push_back(pfd_);
+        }
+        if (poll(fds_.data(), fds_.size(), timeout_ms_) < 0) {
+            return;
+        }
+
+        if (fds_[0].revents) {
+            accept_echoes();
+        }
+        if (fds_[1].revents) {
+            serve_udp();
+        }
+        size_t base_ = 2;
+        std::vector<soak_echo> echoes_left_;
+        for (size_t i = 0, l = echoes_.size(); i < l; i++) {
+            if (fds_[base_ + i].revents && !serve_echo(echoes_[i])) {
+                close(echoes_[i].fd);
+                continue;
+            }
+            echoes_left_.push_back(echoes_[i]);
+        }
+
+        base_ += echoes_.size();
+        uint64_t now_ = now_ms();
+        std::vector<soak_session> sessions_left_;
+        for (size_t i = 0, l = sessions_.size(); i < l; i++) {
+            soak_session& session_ = sessions_[i];
+            bool alive_ = true;
+            if (fds_[base_ + i].revents) {
+                alive_ = step(session_, fds_[base_ + i].revents);
+            }
+            if (alive_ && now_ >= session_.deadline) {
+                if (session_.kind == SOAK_UDP) {
+                    totals_.udp_lost++;
+                }
+                else {
+                    totals_.stuck++;
+                }
+                alive_ = false;
+            }
+            if (alive_) {
+                sessions_left_.push_back(session_);
+            }
+            else {
+                close(session_.fd);
+            }
+        }
+        echoes_.swap(echoes_left_);
+        sessions_.swap(sessions_left_);
+    }
+
+private:
+    int                                                 concurrency_;
+    int                                                 ports_[SOAK_KINDS];
+    int                                                 echo_port_;
+    int                                                 refused_port_;
+    int                                                 blackhole_port_;
+    int                                                 udp_port_;
+    int                                                 echo_listener_;
+    int                                                 refused_socket_;
+    int                                                 blackhole_listener_;
+    int                                                 udp_echo_;
+    std::vector<int>                                    blackhole_fill_;
+    std::vector<soak_echo>                              echoes_;
+    std::vector<soak_session>                           sessions_;
+    soak_totals                                         totals_;
+};
+
+/* Starts rinetd and waits for its admin socket; a release build daemonizes, so the pid comes from its stats. */
+static pid_t
+start_rinetd(const std::string& binary_, const std::string& config_, const std::string& admin_, soak_driver& driver_) {
+    pid_t child_ = fork();
+    if (child_ < 0) {
+        return -1;
+    }
+    if (child_ == 0) {
+        execl(binary_.data(), binary_.data(), "-c", config_.data(), (char*)NULL);
+        _exit(127);
+    }
+
+    soak_stats stats_;
+    uint64_t deadline_ = now_ms() + 10000;
+    while (now_ms() < deadline_) {
+        if (admin_stats(admin_, stats_)) {
+            return (pid_t)stat_value(stats_, "process.pid");
+        }
+        int status_ = 0;
+        if (waitpid(child_, &status_, WNOHANG) == child_ && !(WIFEXITED(status_) && WEXITSTATUS(status_) == 0)) {
+            return -1;
+        }
+        driver_.serve(100);
+    }
+    kill(child_, SIGTERM);
+    return -1;
+}
+
+/* Waits until rinetd holds no sessions and is back to the objects and charged memory it started with, then samples
+ * it. Every listener keeps a connection ready for its next accept, so idle is not zero. */
+static bool
+wait_idle(const std::string& admin_, soak_stats& initial_, soak_driver& driver_, soak_stats& stats_, uint64_t& waited_) {
+    uint64_t started_ = now_ms();
+    uint64_t deadline_ = started_ + SOAK_IDLE_TIMEOUT * 1000;
+    bool idle_ = false;
+    while (!idle_ && now_ms() < deadline_) {
+        driver_.serve(100);
+        if (!admin_stats(admin_, stats_)) {
+            return false;
+        }
+        idle_ = stat_value(stats_, "tcp.connections") == 0 && stat_value(stats_, "udp.tunnels") == 0 &&
+            stat_value(stats_, "objects.tcp_connection") <= stat_value(initial_, "objects.tcp_connection") &&
+            stat_value(stats_, "objects.udp_tunnel") <= stat_value(initial_, "objects.udp_tunnel") &&
+            stat_value(stats_, "memory.used") <= stat_value(initial_, "memory.used");
+    }
+    waited_ = now_ms() - started_;
+    return true;
+}
+
+static void
+usage() {
+    fprintf(stderr, "usage: rinetd-soak [-b rinetd] [-r rounds] [-n sessions] [-c concurrency] [-w workers] [-g bytes] [-k]\n");
+}
+
+int main(int argc, char** argv) {
+    std::string binary_ = "rinetd";
+    int rounds_ = 10;
+    uint64_t count_ = 10000;
+    int concurrency_ = 64;
+    int workers_ = 2;
+    int64_t growth_ = 4096;
+    bool keep_ = false;
+    int opt_;
+    while ((opt_ = getopt(argc, argv, "b:r:n:c:w:g:kh")) != -1) {
+        switch (opt_) {
+        case 'b':
+            binary_ = optarg;
+            break;
+        case 'r':
+            rounds_ = std::max(2, atoi(optarg));
+            break;
+        case 'n':
+            count_ = std::max(1LL, atoll(optarg));
+            break;
+        case 'c':
+            concurrency_ = std::max(1, atoi(optarg));
+            break;
+        case 'w':
+            workers_ = std::max(1, atoi(optarg));
+            break;
+        case 'g':
+            growth_ = std::max(0LL, atoll(optarg));
+            break;
+        case 'k':
+            keep_ = true;
+            break;
+        default:
+            usage();
+            return 2;
+        }
+    }
+    if (optind != argc) {
+        usage();
+        return 2;
+    }
+    if (binary_.find('/') == std::string::npos && access(binary_.data(), X_OK) == 0) {
+        binary_ = "./" + binary_;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    srand((unsigned)time(NULL));
+
+    char dir_[] = "/tmp/rinetd-soak.XXXXXX";
+    if (!mkdtemp(dir_)) {
+        fprintf(stderr, "rinetd-soak: cannot create a working directory\n");
+        return 1;
+    }
+    std::string admin_ = std::string(dir_) + "/admin.sock";
+    std::string config_ = std::string(dir_) + "/rinetd.conf";
+    std::string log_ = std::string(dir_) + "/rinetd.log";
+
+    soak_driver driver_(concurrency_);
+    if (!driver_.open_backends()) {
+        fprintf(stderr, "rinetd-soak: cannot open the stand-in backends\n");
+        return 1;
+    }
+    FILE* file_ = fopen(config_.data(), "w");
+    if (!file_) {
+        fprintf(stderr, "rinetd-soak: cannot write %s\n", config_.data());
+        return 1;
+    }
+    fprintf(file_, "workers %d\nadmin_socket %s\nlogfile %s\n%s", workers_, admin_.data(), log_.data(), driver_.rules().data());
+    fclose(file_);
+
+    pid_t pid_ = start_rinetd(binary_, config_, admin_, driver_);
+    if (pid_ <= 0) {
+        fprintf(stderr, "rinetd-soak: %s did not come up, see %s\n", binary_.data(), log_.data());
+        return 1;
+    }
+    printf("rinetd %d, %d workers, %d rounds of %llu sessions, %d at a time, working directory %s\n", (int)pid_, workers_,
+        rounds_, (unsigned long long)count_, concurrency_, dir_);
+    printf("%5s %8s %6s %6s %6s %6s %7s %8s %8s %6s %5s %10s %12s %10s %9s\n", "round", "sessions", "errors", "stuck", "udplost",
+        "idle", "conns", "cached", "tunnels", "hheap", "fds", "rss", "allocated", "charged", "slot+");
+
+    std::vector<std::string> failures_;
+    bool allocator_ = false;
+    int64_t baseline_memory_ = 0;
+    int64_t baseline_fds_ = 0;
+    int64_t baseline_handler_heap_ = 0;
+    soak_stats initial_;
+    if (!admin_stats(admin_, initial_)) {
+        failures_.push_back("rinetd stopped answering on its admin socket");
+    }
+    for (int round_ = 0; round_ < rounds_ && failures_.empty(); round_++) {
+        soak_totals before_ = driver_.totals();
+        driver_.round(count_);
+
+        soak_stats stats_;
+        uint64_t waited_ = 0;
+        if (!wait_idle(admin_, initial_, driver_, stats_, waited_)) {
+            failures_.push_back("rinetd stopped answering on its admin socket");
+            break;
+        }
+
+        soak_totals& totals_ = driver_.totals();
+        int64_t conns_ = stat_value(stats_, "objects.tcp_connection");
+        int64_t tunnels_ = stat_value(stats_, "objects.udp_tunnel");
+        int64_t fds_ = stat_value(stats_, "process.fds");
+        int64_t handler_heap_ = stat_value(stats_, "objects.handler_heap");
+        int64_t used_ = stat_value(stats_, "memory.used");
+        int64_t allocated_ = stat_value(stats_, "allocator.allocated");
+        int64_t memory_ = allocated_ >= 0 ? allocated_ : stat_value(stats_, "process.rss");
+        bool warmup_ = round_ < std::max(1, rounds_ / 3);
+        if (warmup_) {
+            /* Slab caches, hash tables, log buffers and the heap grow to their working size first. */
+            allocator_ = allocated_ >= 0;
+            baseline_memory_ = memory_;
+            baseline_fds_ = fds_;
+            baseline_handler_heap_ = handler_heap_;
+        }
+        int64_t per_slot_ = (memory_ - baseline_memory_) / concurrency_;
+        printf("%5d %8llu %6llu %6llu %6llu %5.1fs %7lld %8lld %8lld %6lld %5lld %10lld %12s %10lld %9lld\n", round_,
+            (unsigned long long)count_, (unsigned long long)(totals_.errors - before_.errors),
+            (unsigned long long)(totals_.stuck - before_.stuck), (unsigned long long)(totals_.udp_lost - before_.udp_lost),
+            (double)waited_ / 1000, (long long)conns_, (long long)stat_value(stats_, "objects.tcp_connection_cached"),
+            (long long)tunnels_, (long long)handler_heap_, (long long)fds_, (long long)stat_value(stats_, "process.rss"),
+            allocated_ >= 0 ? std::to_string(allocated_).data() : "-", (long long)used_, (long long)per_slot_);
+        fflush(stdout);
+
+        if (totals_.errors != before_.errors || totals_.stuck != before_.stuck) {
+            failures_.push_back("sessions failed or were never finished by rinetd");
+        }
+        if (conns_ > stat_value(initial_, "objects.tcp_connection") || tunnels_ > stat_value(initial_, "objects.udp_tunnel")) {
+            failures_.push_back("connections or udp tunnels are still alive with no traffic");
+        }
+        if (used_ > stat_value(initial_, "memory.used")) {
+            failures_.push_back("charged memory did not return to the baseline");
+        }
+        if (fds_ > baseline_fds_) {
+            failures_.push_back("descriptors are left open");
+        }
+        if (!warmup_ && handler_heap_ > baseline_handler_heap_) {
+            failures_.push_back("asio operations were allocated from the heap after the warm-up");
+        }
+        if (!warmup_ && per_slot_ > growth_) {
+            failures_.push_back(std::string(allocator_ ? "allocated" : "resident") + " memory per idle slot grew by more than " +
+                std::to_string(growth_) + " bytes");
+        }
+    }
+
+    kill(pid_, SIGTERM);
+    soak_totals& totals_ = driver_.totals();
+    printf("sessions: %llu echo, %llu refused, %llu connect timeout, %llu udp; %llu udp datagrams lost\n",
+        (unsigned long long)totals_.started[SOAK_ECHO], (unsigned long long)totals_.started[SOAK_REFUSED],
+        (unsigned long long)totals_.started[SOAK_BLACKHOLE], (unsigned long long)totals_.started[SOAK_UDP],
+        (unsigned long long)totals_.udp_lost);
+    for (size_t i = 0, l = failures_.size(); i < l; i++) {
+        printf("FAIL: %s\n", failures_[i].data());
+    }
+    if (failures_.empty()) {
+        printf("PASS\n");
+        if (!keep_) {
+            unlink(config_.data());
+            unlink(log_.data());
+            unlink(admin_.data());
+            rmdir(dir_);
+        }
+    }
+    return failures_.empty() ? 0 : 1;
+}
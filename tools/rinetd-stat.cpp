@@ -0,0 +1,241 @@
+/* rinetd-stat: vmstat-like reader for the stats file a running rinetd publishes with "stats_file".
+ * It only maps the file and copies counters, so watching rinetd costs the daemon nothing.
+ *
+ *   rinetd-stat [-f file] [-w] [interval [count]]
+ *
+ * The first report shows the totals since rinetd started, every following one the rates over the interval. */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+#include <stats.h>
+
+static char const RINETD_STAT_DEFAULT_FILE[]            = "/dev/shm/rinetd.stats";
+
+typedef struct {
+    uint32_t                                            rule;
+    uint32_t                                            worker;
+    bool                                                tcp_or_udp;
+    std::string                                         name;
+    uint64_t                                            counters[RINETD_STATS_COUNTERS];
+} stat_row;
+
+class stat_file {
+public:
+    inline stat_file()
+        : map_(NULL)
+        , size_(0)
+        , inode_(0) {
+
+    }
+    inline ~stat_file() {
+        unmap();
+    }
+
+public:
+    /* Maps the file again when rinetd replaced it, e.g. after a binary upgrade. */
+    inline bool                                         open(const char* path_, bool& reopened_) {
+        struct stat st_;
+        reopened_ = false;
+        if (stat(path_, &st_) < 0) {
+            return false;
+        }
+        if (map_ && st_.st_ino == inode_) {
+            return true;
+        }
+        unmap();
+
+        int fd_ = ::open(path_, O_RDONLY);
+        if (fd_ < 0) {
+            return false;
+        }
+        void* map_address_ = mmap(NULL, st_.st_size, PROT_READ, MAP_SHARED, fd_, 0);
+        close(fd_);
+        if (map_address_ == MAP_FAILED) {
+            return false;
+        }
+
+        rinetd_stats_header* header_ = (rinetd_stats_header*)map_address_;
+        if ((size_t)st_.st_size < sizeof(rinetd_stats_header) || header_->magic != RINETD_STATS_MAGIC || 
+            header_->version != RINETD_STATS_VERSION || header_->slot_size != sizeof(rinetd_stats_slot)) {
+            munmap(map_address_, st_.st_size);
+            fprintf(stderr, "%s: not a rinetd stats file of version %u\n", path_, RINETD_STATS_VERSION);
+            exit(1);
+        }
+        map_ = map_address_;
+        size_ = st_.st_size;
+        inode_ = st_.st_ino;
+        reopened_ = true;
+        return true;
+    }
+    inline rinetd_stats_header*                         header() {
+        return (rinetd_stats_header*)map_;
+    }
+    inline void                                         sample(std::vector<stat_row>& rows_, bool per_worker_) {
+        rinetd_stats_header* header_ = header();
+        uint32_t count_ = std::min<uint32_t>(header_->slot_count.load(std::memory_order_acquire), header_->slot_capacity);
+        if (header_->header_size + (size_t)count_ * header_->slot_size > size_) {
+            count_ = 0;
+        }
+
+        std::map<std::pair<uint32_t, uint32_t>, size_t> index_;
+        rows_.clear();
+        for (uint32_t i = 0; i < count_; i++) {
+            const rinetd_stats_slot* slot_ = (const rinetd_stats_slot*)((char*)map_ + header_->header_size) + i;
+            uint64_t counters_[RINETD_STATS_COUNTERS];
+            if (!stats_read(slot_, counters_)) {
+                continue;
+            }
+
+            std::pair<uint32_t, uint32_t> key_ = std::make_pair(slot_->rule, per_worker_ ? slot_->worker : 0);
+            std::map<std::pair<uint32_t, uint32_t>, size_t>::iterator it = index_.find(key_);
+            if (it == index_.end()) {
+                stat_row row_;
+                row_.rule = slot_->rule;
+                row_.worker = slot_->worker;
+                row_.tcp_or_udp = slot_->tcp_or_udp != 0;
+                row_.name = std::string(slot_->name, strnlen(slot_->name, sizeof(slot_->name)));
+                memset(row_.counters, 0, sizeof(row_.counters));
+                it = index_.insert(std::make_pair(key_, rows_.size())).first;
+                rows_.push_back(row_);
+            }
+            stat_row& row_ = rows_[it->second];
+            for (int n = 0; n < RINETD_STATS_COUNTERS; n++) {
+                row_.counters[n] += counters_[n];
+            }
+        }
+    }
+
+private:
+    inline void                                         unmap() {
+        if (map_) {
+            munmap(map_, size_);
+            map_ = NULL;
+        }
+    }
+
+private:
+    void*                                               map_;
+    size_t                                              size_;
+    ino_t                                               inode_;
+};
+
+static std::string
+human(double value_) {
+    static const char units_[] = " KMGTP";
+    int unit_ = 0;
+    while (value_ >= 10000 && unit_ < 5) {
+        value_ /= 1000;
+        unit_++;
+    }
+
+    char sz_[32];
+    if (unit_ == 0) {
+        snprintf(sz_, sizeof(sz_), "%.0f", value_);
+    }
+    else {
+        snprintf(sz_, sizeof(sz_), "%.0f%c", value_, units_[unit_]);
+    }
+    return sz_;
+}
+
+static void
+print_header(bool per_worker_) {
+    printf("%4s %s%-4s %-22s %7s %7s %7s %6s %6s %7s %7s %7s %7s %6s %6s %6s %6s %6s %6s %6s %6s %6s\n", "rule", per_worker_ ? "wrk " : "", "prot", "listen",
+        "active", "accept", "reject", "limit", "deny", "in", "out", "pk_in", "pk_out", "splice", "drop", "evict", "err", "rerr", "susp", "mdrop", "migr", "mref");
+}
+
+static void
+print_row(const stat_row& row_, const uint64_t* last_, double seconds_, bool per_worker_) {
+    /* Gauges are printed as is, counters as totals on the first report and per second afterwards. */
+    static const int columns_[] = { RINETD_STAT_ACCEPTED, RINETD_STAT_REJECTED, RINETD_STAT_LIMITED, RINETD_STAT_DENIED, 
+        RINETD_STAT_BYTES_UP, RINETD_STAT_BYTES_DOWN, RINETD_STAT_PACKETS_UP, RINETD_STAT_PACKETS_DOWN, RINETD_STAT_SPLICED, 
+        RINETD_STAT_DROPS, RINETD_STAT_EVICTIONS, RINETD_STAT_SEND_ERRORS, RINETD_STAT_RECEIVE_ERRORS, RINETD_STAT_SUSPENDED, 
+        RINETD_STAT_MIRROR_DROPPED, RINETD_STAT_MIGRATIONS, RINETD_STAT_MIGRATIONS_REFUSED };
+    static const int widths_[] = { 7, 7, 6, 6, 7, 7, 7, 7, 6, 6, 6, 6, 6, 6, 6, 6, 6 };
+
+    printf("%4u ", row_.rule);
+    if (per_worker_) {
+        printf("%3u ", row_.worker);
+    }
+    printf("%-4s %-22s %7s", row_.tcp_or_udp ? "tcp" : "udp", row_.name.data(), human((double)row_.counters[RINETD_STAT_ACTIVE]).data());
+    for (size_t i = 0; i < sizeof(columns_) / sizeof(*columns_); i++) {
+        int n = columns_[i];
+        double value_ = (double)row_.counters[n];
+        if (last_) {
+            value_ = (double)(row_.counters[n] - last_[n]) / seconds_;
+        }
+        printf(" %*s", widths_[i], human(value_).data());
+    }
+    printf("\n");
+}
+
+int main(int argc, char** argv) {
+    const char* path_ = RINETD_STAT_DEFAULT_FILE;
+    bool per_worker_ = false;
+    int opt_;
+    while ((opt_ = getopt(argc, argv, "f:wh")) != -1) {
+        switch (opt_) {
+        case 'f':
+            path_ = optarg;
+            break;
+        case 'w':
+            per_worker_ = true;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-f file] [-w] [interval [count]]\n", argv[0]);
+            return opt_ == 'h' ? 0 : 2;
+        }
+    }
+    double interval_ = optind < argc ? atof(argv[optind]) : 0;
+    long count_ = optind + 1 < argc ? atol(argv[optind + 1]) : (interval_ > 0 ? -1 : 1);
+    if (interval_ <= 0) {
+        count_ = 1;
+    }
+
+    stat_file file_;
+    std::map<std::pair<uint32_t, uint32_t>, std::vector<uint64_t> > last_;
+    struct timespec last_ts_;
+    clock_gettime(CLOCK_MONOTONIC, &last_ts_);
+    for (long report_ = 0; count_ < 0 || report_ < count_; report_++) {
+        if (report_ > 0) {
+            usleep((useconds_t)(interval_ * 1000000));
+        }
+
+        bool reopened_ = false;
+        if (!file_.open(path_, reopened_)) {
+            fprintf(stderr, "%s: unable to open, is stats_file set in rinetd.conf?\n", path_);
+            return 1;
+        }
+        if (reopened_) {
+            last_.clear();
+        }
+
+        struct timespec now_;
+        clock_gettime(CLOCK_MONOTONIC, &now_);
+        double seconds_ = (now_.tv_sec - last_ts_.tv_sec) + (now_.tv_nsec - last_ts_.tv_nsec) / 1e9;
+        last_ts_ = now_;
+
+        std::vector<stat_row> rows_;
+        file_.sample(rows_, per_worker_);
+        if (rows_.size() != 1 || report_ % 20 == 0) {
+            print_header(per_worker_);
+        }
+        for (size_t i = 0, l = rows_.size(); i < l; i++) {
+            stat_row& row_ = rows_[i];
+            std::pair<uint32_t, uint32_t> key_ = std::make_pair(row_.rule, per_worker_ ? row_.worker : 0);
+            std::vector<uint64_t>& last_row_ = last_[key_];
+            print_row(row_, last_row_.empty() || seconds_ <= 0 ? NULL : last_row_.data(), seconds_, per_worker_);
+            last_row_.assign(row_.counters, row_.counters + RINETD_STATS_COUNTERS);
+        }
+        fflush(stdout);
+    }
+    return 0;
+}